@@ -0,0 +1,219 @@
+// Headless replay benchmark
+// Runs a script, or a whole route from the entrypoint, advancing through every break
+// and taking the first choice, then writes stage timings as JSON
+//
+// Usage: bench.exe [script] [--route] [--max-sections N] [--skip-unchanged] [--out file]
+// A script alone is replayed until it moves on, --route keeps following it
+// Every frame is rendered unless --skip-unchanged skips those with nothing new, as the game does
+
+#include <audio.hpp>
+#include <window.hpp>
+#include <image.hpp>
+#include <scene.hpp>
+#include <file.hpp>
+#include <profiler.hpp>
+
+#include <SDL2/SDL.h>
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+
+// Frames in a row without a section before the replay is considered stuck
+#define BENCH_MAX_IDLE_FRAMES 1000
+
+#define BENCH_DEFAULT_OUT "bench.json"
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct
+{
+    std::string script;
+    double ms;
+} SectionTiming;
+
+static double msSince(const Clock::time_point &start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Let background fetches and decodes finish so every run does the same work per frame
+static void settle(FileManager &fileManager)
+{
+    auto &workerPool = fileManager.getWorkerPool();
+    while (!workerPool.idle())
+    {
+        if (workerPool.drain(1000) == 0)
+            SDL_Delay(0);
+    }
+}
+
+static json percentiles(std::vector<double> values)
+{
+    if (values.empty())
+        return {};
+
+    std::sort(values.begin(), values.end());
+
+    double sum = 0;
+    for (const auto v : values)
+        sum += v;
+
+    auto at = [&values](const double p)
+    { return values[static_cast<size_t>(p * (values.size() - 1))]; };
+
+    return {
+        {"mean", sum / values.size()},
+        {"p50", at(0.5)},
+        {"p95", at(0.95)},
+        {"max", values.back()}};
+}
+
+int main(int argc, char **argv)
+{
+    std::string script = SCRIPT_ENTRYPOINT;
+    std::string outPath = BENCH_DEFAULT_OUT;
+    bool route = false;
+    bool scriptGiven = false;
+    bool skipUnchanged = false;
+    size_t maxSections = SIZE_MAX;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--route")
+            route = true;
+        else if (arg == "--max-sections" && i + 1 < argc)
+            maxSections = std::strtoull(argv[++i], NULL, 10);
+        else if (arg == "--skip-unchanged")
+            skipUnchanged = true;
+        else if (arg == "--out" && i + 1 < argc)
+            outPath = argv[++i];
+        else
+        {
+            script = arg;
+            scriptGiven = true;
+        }
+    }
+
+    // Starting from the entrypoint only makes sense as a route
+    if (!scriptGiven)
+        route = true;
+
+    // Must be set before the managers initialize SDL
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+
+    std::vector<Choice> currChoices;
+
+    FileManager fileManager;
+    WindowManager windowManager;
+    AudioManager audioManager(fileManager);
+    ImageManager imageManager(fileManager, windowManager.getRenderer(), currChoices);
+    imageManager.setSkipUnchanged(skipUnchanged);
+
+    // Starts the entrypoint once the KIF DB is read
+    SceneManager sceneManager(audioManager, imageManager, fileManager, currChoices);
+
+    if (script != SCRIPT_ENTRYPOINT)
+        sceneManager.start(script);
+
+    settle(fileManager);
+    Profiler::reset();
+
+    std::vector<SectionTiming> sections;
+    unsigned int frames = 0;
+    unsigned int idleFrames = 0;
+    bool stalled = false;
+
+    const auto start = Clock::now();
+
+    while (sections.size() < maxSections)
+    {
+        if (!route && sceneManager.getScriptName() != script)
+            break;
+
+        if (!currChoices.empty())
+            sceneManager.selectChoice(0);
+        else if (sceneManager.atEnd())
+            break;
+
+        // Same as clicking through the break, also skipping any wait
+        sceneManager.parse();
+
+        const std::string name = sceneManager.getScriptName();
+        const auto before = Profiler::getCount(PROFILE_STAGE::SECTION);
+        const auto sectionStart = Clock::now();
+
+        sceneManager.tickScript();
+        settle(fileManager);
+
+        // Includes the fetches and decodes the section started
+        const double sectionMs = msSince(sectionStart);
+
+        imageManager.processUploads();
+        imageManager.render();
+        PROFILE_FRAME();
+        frames++;
+
+        if (Profiler::getCount(PROFILE_STAGE::SECTION) > before)
+        {
+            sections.push_back({name, sectionMs});
+            idleFrames = 0;
+        }
+        else if (++idleFrames >= BENCH_MAX_IDLE_FRAMES)
+        {
+            stalled = true;
+            break;
+        }
+    }
+
+    const double wallMs = msSince(start);
+
+    json report;
+    report["script"] = script;
+    report["route"] = route;
+    report["stalled"] = stalled;
+    report["frames"] = frames;
+    report["skipped_frames"] = imageManager.getSkippedFrames();
+    report["sections"] = sections.size();
+    report["wall_ms"] = wallMs;
+
+    std::vector<double> sectionMs;
+    std::map<std::string, std::pair<size_t, double>> perScript;
+    for (const auto &section : sections)
+    {
+        sectionMs.push_back(section.ms);
+        perScript[section.script].first++;
+        perScript[section.script].second += section.ms;
+    }
+    report["section_ms"] = percentiles(sectionMs);
+
+    // Stages include the time of stages nested in them
+    json &jStages = report["stages"];
+    for (int i = 0; i < static_cast<int>(PROFILE_STAGE::COUNT); i++)
+    {
+        const auto stage = static_cast<PROFILE_STAGE>(i);
+        jStages[Profiler::getName(stage)] = {
+            {"ms", Profiler::getNanos(stage) / 1e6},
+            {"count", Profiler::getCount(stage)}};
+    }
+
+    json &jScripts = report["scripts"];
+    for (const auto &entry : perScript)
+    {
+        jScripts[entry.first] = {
+            {"sections", entry.second.first},
+            {"ms", entry.second.second}};
+    }
+
+    std::ofstream ofs(outPath);
+    ofs << report.dump(2) << std::endl;
+
+    LOG_INFO << "Replayed " << sections.size() << " sections in " << wallMs << " ms, report written to " << outPath;
+
+    return stalled ? 1 : 0;
+}
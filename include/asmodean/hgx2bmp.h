@@ -84,4 +84,39 @@ ASMODEAN_API ReturnCode ProcessImage(
 	uint32  depthBytes,
 	uint32  stride);
 
+/*
+ * Second half of ProcessImage, for callers that un-RLE the data themselves.
+ *
+ * unrleBuffer holds unrleLength bytes of un-RLEd data.
+ * rgbaBuffer does not need to be zeroed.
+ */
+ASMODEAN_API ReturnCode ProcessUnrled(
+	byte*   unrleBuffer,
+	uint32  unrleLength,
+	byte*   rgbaBuffer,
+	uint32  rgbaLength,
+	uint32  width,
+	uint32  height,
+	uint32  depthBytes,
+	uint32  stride);
+
+/*
+ * Kernels used by Undeltafilter, Auto picks the widest one the CPU supports.
+ */
+enum class UndeltaKernel : uint32 {
+	Auto,
+	Scalar,
+	SSE2,
+	AVX2,
+	SIMD128,
+};
+
+/*
+ * Force the kernels used by ProcessImage and ProcessUnrled, for checking the SIMD paths against the scalar one.
+ *
+ * Returns false and keeps the current kernels if the given ones are not built in or not supported by the CPU.
+ * Not thread-safe, call it while nothing is being decoded.
+ */
+ASMODEAN_API bool SetUndeltaKernel(UndeltaKernel kernel);
+
 #endif /* HGX2BMP_H */
\ No newline at end of file
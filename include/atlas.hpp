@@ -0,0 +1,74 @@
+#pragma once
+
+#include <hgxformat.h>
+
+#include <SDL2/SDL.h>
+
+#include <vector>
+
+// Width and height of each atlas page
+#define ATLAS_SIZE 1024
+#define ATLAS_PAGE_BYTES (ATLAS_SIZE * ATLAS_SIZE * 4)
+
+// Images taller than this get their own texture
+#define ATLAS_MAX_HEIGHT 256
+
+// Empty pixels kept between sprites
+#define ATLAS_PADDING 1
+
+// Packs small 32-bit images into shared page textures so their draws can be batched
+// Uses a skyline packer, space is only reclaimed once a page is emptied
+class TextureAtlas
+{
+public:
+    // Location of a packed image
+    typedef struct
+    {
+        int page;
+        SDL_Rect rect;
+    } Slot;
+
+    // Textures are not destroyed here as the renderer may already be gone at exit
+
+    // Whether an image is small enough to be packed
+    bool fits(const Stdinfo &) const;
+
+    // Copy pixels into a free spot, creating a new page if none has room
+    bool add(SDL_Renderer *, const byte *, const Stdinfo &, Slot &);
+
+    // Same for ARGB pixels that are not a decoded image, given their pitch, width and height
+    bool add(SDL_Renderer *, const void *, const int, const int, const int, Slot &);
+
+    // Release a packed image, destroying its page once empty
+    void release(const int);
+
+    SDL_Texture *getTexture(const int page) { return pages[page].texture; }
+
+    size_t getPages() const;
+
+    // Memory held by live pages, whole pages count however little of them is used
+    size_t getBytes() const { return getPages() * ATLAS_PAGE_BYTES; }
+
+private:
+    // Top edge of the used area over a span of columns
+    typedef struct
+    {
+        int x;
+        int y;
+        int width;
+    } SkylineNode;
+
+    typedef struct
+    {
+        SDL_Texture *texture;
+        std::vector<SkylineNode> skyline;
+        unsigned int sprites;
+    } Page;
+
+    // Empty pages keep their slot with a NULL texture so indices stay valid
+    std::vector<Page> pages;
+
+    bool createPage(SDL_Renderer *, Page &);
+
+    static bool pack(Page &, const int, const int, SDL_Rect &);
+};
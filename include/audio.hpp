@@ -1,14 +1,17 @@
 #pragma once
 
 #include <file.hpp>
+#include <state.hpp>
 #include <asmodean.h>
 
 #include <SDL2/SDL_mixer.h>
 
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
 #include <string>
 #include <vector>
+#include <atomic>
 
 #define SOUND_CHANNELS 8
 #define CHANNEL_PCM SOUND_CHANNELS - 1
@@ -28,6 +31,9 @@
 
 typedef std::unordered_map<std::string, Mix_Music *> MusicCache;
 
+// Raw audio files fetched ahead of time, consumed when first played
+typedef std::unordered_map<std::string, std::vector<byte>> AudioBufCache;
+
 class Sound
 {
 private:
@@ -57,6 +63,12 @@ typedef struct
     std::string name;
 } SoundData;
 
+typedef struct
+{
+    std::string name;
+    unsigned int generation;
+} PrefetchAudioData;
+
 class AudioManager
 {
 
@@ -77,6 +89,15 @@ public:
 
     const json dump();
 
+    // Binary equivalents of dump and loadDump for the history
+    void snapshot(StateWriter &);
+
+    void loadSnapshot(StateReader &);
+
+    void prefetch(const std::string &);
+
+    void cancelPrefetch();
+
 private:
     FileManager &fileManager ;
     MusicCache musicCache;
@@ -87,6 +108,18 @@ private:
 
     std::string currMusicName;
 
+    AudioBufCache prefetchedAudio;
+
+    // Names of audio currently being prefetched in the background
+    std::unordered_set<std::string> pendingAudio;
+
+    // Read from worker threads to drop stale prefetches
+    std::atomic<unsigned int> prefetchGeneration{1};
+
+    void storePrefetched(byte *, size_t, const PrefetchAudioData &);
+
+    bool playPrefetched(const std::string &, const int);
+
     void stopSounds();
 
     void stopMusic();
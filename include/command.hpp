@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+
+// Max captures of any command, index 0 is unused
+#define MAX_COMMAND_ARGS 8
+
+enum class COMMAND_TYPE
+{
+    NONE,
+    WAIT,
+    FRAMEON,
+    FRAMEOFF,
+    RDRAW,
+    WIPE,
+    PCM,
+    BGM,
+    SE,
+    IMAGE,
+    IF,
+    NEXT,
+    FSELECT,
+    CHOICE,
+    AUTO,
+    ASSIGN,
+};
+
+// A script command split into arguments
+// Arguments are numbered as the capture groups of the script regexes they replace
+typedef struct
+{
+    COMMAND_TYPE type = COMMAND_TYPE::NONE;
+    std::string args[MAX_COMMAND_ARGS];
+
+    // Value of each argument made up only of digits, 0 otherwise or if it does not fit in an int
+    int values[MAX_COMMAND_ARGS] = {};
+} Command;
+
+// Hand-written matcher for the command patterns
+// Dispatches on the first character and tries candidates in the order of the old regex cascade
+class CommandParser
+{
+public:
+    // Returns false if the string is not a known command
+    static bool parse(const std::string &, Command &);
+};
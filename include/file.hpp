@@ -1,6 +1,10 @@
 #pragma once
 
 #include <utils.hpp>
+#include <mappedfile.hpp>
+#include <kifdb.hpp>
+#include <workerpool.hpp>
+#include <profiler.hpp>
 #include <asmodean.h>
 #include <blowfish.h>
 
@@ -15,11 +19,15 @@
 #define ftell64 _ftelli64
 #endif
 
+#include <cstring>
 #include <type_traits>
 #include <unordered_map>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <utility>
+#include <mutex>
 
 // Macro for function signature of callbacks passed to FFAP function
 #define FFAP_CB(X) void (TClass::*X)(byte *, size_t, UdOutType)
@@ -29,12 +37,16 @@
 
 #define LOWERCASE_ASSETS
 
-typedef struct
+// Extension appended to a base name when looking up an asset
+enum class ASSET_EXT
 {
-    uint32 Offset;
-    uint32 Length;
-    unsigned char Index;
-} KifDbEntry;
+    NONE,
+    IMAGE,
+    SCRIPT,
+    MUSIC,
+    PCM,
+    SE
+};
 
 typedef struct
 {
@@ -53,35 +65,55 @@ public:
 
     void init(SceneManager *);
 
-    // Find asset in KIF DB and fetch it and pass data to callback
+    // Fetch an asset found with findAsset and pass data to callback
     template <typename TClass, typename UdOutType, typename UdInType>
-    void fetchAssetAndProcess(std::string fname, TClass *classobj, FFAP_CB(cb), UdInType userdata)
+    void fetchAssetAndProcess(const AssetId asset, TClass *classobj, FFAP_CB(cb), UdInType userdata)
     {
-#ifdef LOWERCASE_ASSETS
-        Utils::lowercase(fname);
-#endif
-        auto got = kifDb.find(fname);
-        if (got != kifDb.end())
+        if (kifDb.isOpen() && asset < kifDb.getEntryCount())
         {
-            const auto &kte = kifTable[got->second.Index];
-            auto offset = got->second.Offset;
-            auto length = got->second.Length;
+            const auto &kde = kifDb.getRecord(asset);
+
+#ifndef __EMSCRIPTEN__
+            // Serve the asset straight from the mapped archive if possible
+            if (processMappedKif(kde, classobj, cb, userdata))
+                return;
+#endif
+
+            const auto &kte = kifTable[kde.Index];
 
             typedef FFAP_CB(TCallback);
 
             // Struct containing original callback data to pass to decryption function callback
             typedef struct
             {
-                KifTableEntry kte;
+                uint32_t index;
                 TClass *classobj;
                 TCallback cb;
                 UdInType userdata;
             } A;
 
-            fetchFileAndProcess(ASSETS + kte.Filename, this, &FileManager::decryptKifAndProcess<A>, A{kte, classobj, cb, userdata}, offset, length);
+            fetchFileAndProcess(ASSETS + kte.Filename, this, &FileManager::decryptKifAndProcess<A>, A{kde.Index, classobj, cb, userdata}, kde.Offset, kde.Length);
         }
     }
 
+    // Fetch an asset found with findAsset and pass data to a callback that runs off the main thread
+    // Callbacks must not touch SDL or unguarded state, results go back through getWorkerPool().post
+    // WASM fetches are already asynchronous so the callback runs on the main thread once fetched
+    // Urgent fetches are started ahead of queued prefetches
+    template <typename TClass, typename UdOutType, typename UdInType>
+    void fetchAssetAsync(const AssetId asset, TClass *classobj, FFAP_CB(cb), UdInType userdata, const bool urgent = false)
+    {
+#ifdef __EMSCRIPTEN__
+        fetchAssetAndProcess(asset, classobj, cb, userdata);
+#else
+        workerPool.submit([this, asset, classobj, cb, userdata]()
+                          { fetchAssetAndProcess(asset, classobj, cb, userdata); },
+                          urgent);
+#endif
+    }
+
+    WorkerPool &getWorkerPool() { return workerPool; }
+
     // Multi-platform function to fetch a file and pass the contents to a callback
     // Supports optional offset and length arguments
     template <typename TClass, typename UdOutType, typename UdInType>
@@ -129,10 +161,10 @@ public:
         // Success callback
         attr.onsuccess = [](emscripten_fetch_t *fetch)
         {
-            LOG << "Fetched: " << fetch->url << " Size: " << fetch->numBytes;
+            LOG_DEBUG << "Fetched: " << fetch->url << " Size: " << fetch->numBytes;
             if (fetch->numBytes == 0)
             {
-                LOG << "Fetch failed!";
+                LOG_ERROR << "Fetch failed!";
                 delete fetch->userData;
                 emscripten_fetch_close(fetch);
                 return;
@@ -153,7 +185,7 @@ public:
         auto bufVec = readFile(fpath, offset, length);
         if (bufVec.empty())
         {
-            LOG << "Could not read local file " << fpath;
+            LOG_ERROR << "Could not read local file " << fpath;
             return;
         }
 
@@ -170,7 +202,7 @@ public:
 
         attr.onerror = [](emscripten_fetch_t *fetch)
         {
-            LOG << fetch->statusText << ": " << fetch->url;
+            LOG_ERROR << fetch->statusText << ": " << fetch->url;
             delete fetch->userData;
             emscripten_fetch_close(fetch);
         };
@@ -179,32 +211,46 @@ public:
 #endif
     }
 
+    // ID of a base name with the given extension, ASSET_NONE if it is not in the database
+    // Names are matched regardless of case as the database is lowercase
+    AssetId findAsset(const std::string_view, const ASSET_EXT = ASSET_EXT::NONE) const;
+
     // Return true if asset is in database
-    bool inDB(const std::string &name)
+    bool inDB(const std::string_view name, const ASSET_EXT ext = ASSET_EXT::NONE) const
     {
-        return kifDb.find(name) != kifDb.end();
+        return findAsset(name, ext) != ASSET_NONE;
     }
 
 private:
-    // Map of each asset to their respective offset and length and archive index in the KIF table
-    std::unordered_map<std::string, KifDbEntry> kifDb;
+    // Offset and length and archive index in the KIF table of each asset
+    // Looked up in place from the mapped or fetched DB, v1 DBs are converted on load
+    KifDbView kifDb;
+    std::vector<byte> kifDbData;
+
+#ifndef __EMSCRIPTEN__
+    MappedFile kifDbMap;
+#endif
 
     // Vector of KIF archives along with their decryption keys
     std::vector<KifTableEntry> kifTable;
 
+    // Blowfish state of each KIF archive, keyed once when parsing the DB
+    std::vector<Blowfish> kifCiphers;
+
     void parseKifDb(byte *, size_t, SceneManager*);
 
+    void openKifTable(SceneManager *);
+
     // Post-fetch decryption function for KIF assets
     // Passes the decrypted asset to the original callback
     template <typename A>
     void decryptKifAndProcess(byte *data, size_t sz, const A a)
     {
-        if (a.kte.IsEncrypted == '\x01')
+        if (kifTable[a.index].IsEncrypted == '\x01')
         {
             // Blowfish decryption
-            Blowfish bf;
-            bf.SetKey(a.kte.FileKey, 4);
-            bf.Decrypt(data, data, sz & ~7);
+            PROFILE_SCOPE(FETCH);
+            kifCiphers[a.index].Decrypt(data, data, sz & ~7);
         }
 
         // Call the original callback function
@@ -212,4 +258,57 @@ private:
     }
 
     std::vector<byte> readFile(const std::string &, uint64_t = 0, uint64_t = 0);
+
+#ifndef __EMSCRIPTEN__
+    // Read-only mappings of each KIF archive, indexed the same as the KIF table
+    std::vector<MappedFile> kifMaps;
+
+    // Spare buffers for decrypting mapped entries, reused across fetches
+    std::vector<std::vector<byte>> scratchPool;
+    std::mutex scratchMutex;
+
+    void mapArchives();
+
+    std::vector<byte> acquireScratch(size_t);
+
+    void releaseScratch(std::vector<byte> &&);
+
+    // Pass an asset to the callback as a view into its mapped archive
+    // Encrypted assets are decrypted into a pooled scratch buffer instead
+    // Returns false if the archive is not mapped so the caller can fall back to reading
+    template <typename TClass, typename UdOutType, typename UdInType>
+    bool processMappedKif(const KifDbRecord &kde, TClass *classobj, FFAP_CB(cb), UdInType &userdata)
+    {
+        const auto &archive = kifMaps[kde.Index];
+        if (!archive.contains(kde.Offset, kde.Length))
+            return false;
+
+        const byte *view = archive.data() + kde.Offset;
+
+        if (kifTable[kde.Index].IsEncrypted != '\x01')
+        {
+            // Callbacks only read from the buffer so the mapping can be handed out directly
+            (classobj->*cb)(const_cast<byte *>(view), kde.Length, userdata);
+            return true;
+        }
+
+        // Trailing bytes that do not fill a block are stored unencrypted
+        auto scratch = acquireScratch(kde.Length);
+        {
+            PROFILE_SCOPE(FETCH);
+            auto blocksLen = kde.Length & ~7;
+            kifCiphers[kde.Index].Decrypt(scratch.data(), view, blocksLen);
+            memcpy(scratch.data() + blocksLen, view + blocksLen, kde.Length - blocksLen);
+        }
+
+        (classobj->*cb)(scratch.data(), kde.Length, userdata);
+
+        releaseScratch(std::move(scratch));
+        return true;
+    }
+#endif
+
+    // Background threads for fetching and decoding assets
+    // Declared last so workers are joined before the state they use is destroyed
+    WorkerPool workerPool;
 };
@@ -5,6 +5,7 @@
 #include <SDL2/SDL.h>
 
 #include <vector>
+#include <memory>
 
 #define RMASK 0x00ff0000
 #define GMASK 0x0000ff00
@@ -15,10 +16,22 @@
 #define STRIDE(width, bytes) ((width * bytes + 3) & ~3)
 #define PITCH(width, bits) (width * BYTE_DEPTH(bits))
 
+// Bytes inflated at a time when streaming RLE data and commands
+#define INFLATE_CHUNK 0x10000
+
+// Decoder context owning scratch buffers that are reused across frames and assets
+// Buffers only grow, so decoding allocates nothing once they fit the largest image
+// Not thread-safe, use one context per thread
 class HGDecoder
 {
 
 public:
+    HGDecoder();
+    ~HGDecoder();
+
+    HGDecoder(HGDecoder &&);
+    HGDecoder &operator=(HGDecoder &&);
+
     // Holds pointers to structs necessary for decoding image
     typedef struct
     {
@@ -26,10 +39,28 @@ public:
         Img *Img;
     } Frame;
 
-    static std::vector<Frame> getFrames(FrameHeader *);
+    // Size of the buffer required by decodeFrame
+    static uint32 getPixelsLength(const Frame &);
+
+    // Parse frames into a vector owned by the context
+    const std::vector<Frame> &parseFrames(FrameHeader *);
 
-    static std::vector<byte> getPixelsFromFrame(Frame);
+    // Decode a frame into a caller-provided buffer of at least getPixelsLength bytes
+    bool decodeFrame(const Frame &, byte *, uint32);
 
 private:
+    // Incremental zlib stream and a bit reader over it, defined in hgdecoder.cpp
+    struct Inflater;
+    class StreamBitBuffer;
+
+    std::vector<Frame> frames;
+
+    // Streams are inflated chunk by chunk straight into the un-RLE buffer
+    std::unique_ptr<Inflater> dataStream;
+    std::unique_ptr<Inflater> cmdStream;
+    std::vector<byte> unrleArena;
+
+    bool unrle(const Frame &, uint32 &);
+
     static Frame getFrame(FrameTag *);
 };
@@ -4,6 +4,8 @@
 #include <file.hpp>
 #include <window.hpp>
 #include <imgtypes.hpp>
+#include <text.hpp>
+#include <profiler.hpp>
 
 #include <asmodean.h>
 #include <SDL2/SDL.h>
@@ -16,10 +18,29 @@
 #include <unordered_map>
 #include <utility>
 #include <array>
+#include <atomic>
+#include <mutex>
 
 #define IMAGE_EXT ".hg3"
 #define IMAGE_SIGNATURE "HG-3"
 
+// Default time allowed per frame for uploading textures decoded in the background
+#define UPLOAD_BUDGET_MS 4.0
+
+// Only interface sprites are packed into the atlas, scene images come and go too often to share pages
+#define ATLAS_PREFIX "sys_"
+
+// Max spare pixel buffers kept for decoding, any more are freed
+#define MAX_PIXEL_BUFFERS 8
+
+// Profiler overlay, graphs are scaled so a full bar is twice the frame target
+#define PROFILER_TARGET_MS 16.7
+#define PROFILER_GRAPH_HEIGHT 60
+#define PROFILER_BAR_WIDTH 2
+#define PROFILER_WORST_STAGES 5
+
+// Frames between updates of the overlay text so it stays readable
+#define PROFILER_REFRESH_FRAMES 30
 
 
 enum class IMAGE_TYPE
@@ -54,6 +75,11 @@ public:
 
     const json dump();
 
+    // Binary equivalents of dump and loadDump for the history
+    void snapshot(StateWriter &);
+
+    void loadSnapshot(StateReader &);
+
     const Stdinfo getStdinfo(const IMAGE_TYPE, const int);
 
     const std::pair<int, int> getShifts(const IMAGE_TYPE, const int);
@@ -70,24 +96,70 @@ public:
 
     void clearZIndex(const IMAGE_TYPE, const int);
 
-    void render();
+    bool render();
+
+    // Request a redraw on the next frame after anything visible changed
+    void markDirty() { dirty = true; }
+
+    // Redraw every frame even if nothing changed
+    void setSkipUnchanged(const bool skip) { skipUnchanged = skip; }
+
+    Uint64 getSkippedFrames() { return skippedFrames; }
+
+#ifdef PROFILE_ENABLE
+    void toggleProfiler()
+    {
+        showProfiler = !showProfiler;
+        markDirty();
+    };
+#endif
 
     void setShowMwnd();
     void setHideMwnd();
     bool getShowMwnd() { return showMwnd; }
-    void toggleMwnd() { showMwnd = !showMwnd; };
-
-    void setShowText() { showText = true; };
-    void setHideText() { showText = false; };
+    void toggleMwnd()
+    {
+        showMwnd = !showMwnd;
+        markDirty();
+    };
+
+    void setShowText()
+    {
+        showText = true;
+        markDirty();
+    };
+    void setHideText()
+    {
+        showText = false;
+        markDirty();
+    };
 
     SDL_Renderer *getRenderer() { return renderer; };
 
     TextureCache &getCache() { return textureCache; };
 
+    TextureAtlas &getAtlas() { return atlas; };
+
+    TextRenderer &getTextRenderer() { return textRenderer; };
+
+    TTF_Font *getSelectFont() { return selectFont; };
+
     FileManager &getFileManager() { return fileManager; };
 
     void processImage(byte *, size_t, const ImageData &);
 
+    void processImageFrames(byte *, size_t, const std::vector<ImageData> &);
+
+    void processImageAsync(byte *, size_t, const ImageData &);
+
+    void fetchImage(const ImageData &);
+
+    void waitForImage(const std::string &);
+
+    void processUploads();
+
+    void setUploadBudget(const double ms) { uploadBudgetMs = ms; }
+
     void killRdraw();
 
     void setRdraw(const unsigned int);
@@ -99,15 +171,46 @@ public:
     void fetch(const std::string &);
     void prefetch(const std::string &);
 
+    // Make all queued prefetches stale so they are skipped
+    void cancelPrefetch() { prefetchGeneration++; }
+
 private:
     // Used for synchronizing transitions/animations with the render framerate
     Uint64 framestamp = 0;
     Uint64 rdrawStart = 0;
     unsigned int globalRdraw = 0;
 
+    // Set by anything that changes what is on screen, cleared once drawn
+    bool dirty = true;
+    bool skipUnchanged = true;
+
+    // Frames not drawn as nothing changed
+    Uint64 skippedFrames = 0;
+
     std::vector<Choice> &currChoices;
 
-    TextureCache textureCache;
+    // Shared pages for interface sprites, must outlive the cache
+    TextureAtlas atlas;
+
+    // Glyphs are never released so they are kept apart from pages that can empty
+    TextureAtlas glyphAtlas;
+
+    TextureCache textureCache{atlas};
+
+    // Names of images currently being fetched and decoded in the background
+    // Mapped to the prefetch generation that requested them, 0 if requested on demand
+    std::unordered_map<std::string, unsigned int> pendingImages;
+
+    // Read from worker threads to skip decoding stale prefetches
+    std::atomic<unsigned int> prefetchGeneration{1};
+
+    // Max milliseconds spent on texture uploads per frame
+    double uploadBudgetMs = UPLOAD_BUDGET_MS;
+
+    // Spare decoder contexts and pixel buffers, reused across decodes on any thread
+    std::vector<HGDecoder> decoderPool;
+    std::vector<std::vector<byte>> pixelPool;
+    std::mutex poolMutex;
 
     FileManager &fileManager;
 
@@ -123,8 +226,24 @@ private:
     TTF_Font *font = NULL;
     TTF_Font *selectFont = NULL;
 
+    TextRenderer textRenderer{renderer, glyphAtlas};
+
     SDL_Color textColor = {255, 255, 255, 0};
 
+#ifdef PROFILE_ENABLE
+    bool showProfiler = false;
+
+    // Summary of the recent frames and the stage graphed below the frame times
+    std::string profilerText;
+    PROFILE_STAGE profilerStage = PROFILE_STAGE::TICK;
+
+    void updateProfilerText();
+
+    void renderProfilerGraph(const PROFILE_STAGE, const int);
+
+    void renderProfiler();
+#endif
+
     // Arrays to simulate the current canvas with layers
     ImageLayer<Bg, MAX_BG> bgLayer;
     ImageLayer<Eg, MAX_EG> egLayer;
@@ -132,14 +251,30 @@ private:
     ImageLayer<Fw, MAX_FW> fwLayer;
     ImageLayer<Fg, MAX_FG> fgLayer;
 
-    SDL_Texture *getTextureFromFrame(HGDecoder::Frame);
+    SDL_Texture *getTextureFromPixels(const DecodedImage &);
+
+    void trimCache();
+
+    HGDecoder acquireDecoder();
+
+    void releaseDecoder(HGDecoder &&);
+
+    std::vector<byte> acquirePixels(size_t);
+
+    void releasePixels(std::vector<byte> &&);
+
+    bool decodeImage(byte *, size_t, const ImageData &, DecodedImage &);
+
+    const std::vector<HGDecoder::Frame> *parseImage(HGDecoder &, byte *, size_t, const std::string &);
+
+    bool decodeFrame(HGDecoder &, const std::vector<HGDecoder::Frame> &, const ImageData &, DecodedImage &);
+
+    void cacheImage(const std::string &, const int, DecodedImage &);
 
     void renderChoices();
 
     void setLogo();
 
-    void fetchImage(const Image &, const std::string &);
-
     void renderMessage(const std::string &);
 
     void renderSpeaker(const std::string &);
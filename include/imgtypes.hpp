@@ -1,11 +1,18 @@
 #pragma once
 
 #include <hgdecoder.hpp>
+#include <atlas.hpp>
 #include <utils.hpp>
+#include <kifdb.hpp>
+#include <state.hpp>
 #include <window.hpp>
 
 #include <SDL2/SDL.h>
 
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+
 #define KEY_BG "bg"
 #define KEY_EG "eg"
 #define KEY_FG "fg"
@@ -41,8 +48,95 @@
 // Flip mode when rendering image assets
 #define RENDERER_FLIP_MODE SDL_FLIP_VERTICAL
 
-typedef std::pair<SDL_Texture *, Stdinfo> TextureData;
-typedef std::unordered_map<std::string, TextureData> TextureCache;
+// Default size in bytes of decoded textures to keep before evicting
+#ifdef __EMSCRIPTEN__
+#define TEXTURE_CACHE_BUDGET (128 * 1024 * 1024)
+#else
+#define TEXTURE_CACHE_BUDGET (256 * 1024 * 1024)
+#endif
+
+// Texture and the area of it holding the image
+// Page is the atlas page the image is packed into, -1 if it owns the texture
+typedef struct
+{
+    SDL_Texture *texture;
+    Stdinfo stdinfo;
+    SDL_Rect rect;
+    int page;
+} TextureData;
+
+// Texture cache bounded by the decoded size of its textures
+// Least recently used textures are destroyed once over budget, unless pinned
+class TextureCache
+{
+public:
+    TextureCache(TextureAtlas &atlas, size_t budget = TEXTURE_CACHE_BUDGET) : atlas{atlas}, budget{budget} {}
+
+    // Textures are not destroyed here as the renderer may already be gone at exit
+
+    // Look up a texture and mark it as recently used
+    // Returns NULL if not cached
+    const TextureData *get(const std::string &);
+
+    bool contains(const std::string &name) const { return entries.find(name) != entries.end(); }
+
+    // Store a texture, replacing and destroying any existing one of the same name
+    void insert(const std::string &, SDL_Texture *, const Stdinfo &);
+
+    // Store an image packed into the atlas
+    void insert(const std::string &, const TextureAtlas::Slot &, const Stdinfo &);
+
+    // Never evict a texture, for assets that cannot be fetched again
+    void setPermanent(const std::string &);
+
+    // Evict least recently used textures not in the pinned set until within budget
+    void trim(const std::unordered_set<std::string> &);
+
+    void setBudget(size_t b) { budget = b; }
+
+    size_t getBudget() { return budget; }
+
+    // Atlas pages are charged whole as space freed in them cannot be reused
+    size_t getBytes() { return bytes + atlas.getBytes(); }
+    size_t size() { return entries.size(); }
+
+    uint64 getHits() { return hits; }
+    uint64 getMisses() { return misses; }
+    uint64 getEvictions() { return evictions; }
+
+private:
+    typedef struct
+    {
+        TextureData textureData;
+        size_t bytes;
+        std::list<std::string>::iterator lruPos;
+        bool permanent;
+    } Entry;
+
+    std::unordered_map<std::string, Entry> entries;
+
+    // Most recently used at the front
+    std::list<std::string> lru;
+
+    TextureAtlas &atlas;
+
+    size_t budget;
+
+    // Bytes of textures owned by entries, packed images are counted through the atlas
+    size_t bytes = 0;
+
+    uint64 hits = 0;
+    uint64 misses = 0;
+    uint64 evictions = 0;
+
+    void store(const std::string &, const TextureData &);
+
+    // Destroy a texture or release its atlas space
+    void destroy(const TextureData &);
+};
+
+// Pixels decoded off the main thread waiting to be uploaded as a texture
+typedef std::pair<std::vector<byte>, Stdinfo> DecodedImage;
 
 class ImageManager;
 
@@ -74,20 +168,24 @@ public:
 
     const json dump();
 
+    void snapshot(StateWriter &);
+
     bool isCached();
 
-    void blend(const unsigned int target) { targetAlpha = target; }
+    void blend(const unsigned int);
 
     void move(const unsigned int, const int, const int);
 
     void fade(const unsigned int, const Uint8, const Uint8);
 
+    void collectInUse(std::unordered_set<std::string> &);
+
     virtual void render(int, int);
 
 protected:
     virtual void display(std::string &, long, long, const Uint8, bool=false);
 
-    void set(const std::string &, int, int);
+    void set(const std::string &, int, int, const AssetId = ASSET_NONE);
 
     ImageManager &imageManager;
 
@@ -96,6 +194,9 @@ protected:
     SDL_Renderer *renderer;
 
 private:
+    // ID of the base asset, resolved when the image is updated so fetches need not look it up again
+    AssetId assetId = ASSET_NONE;
+
     bool moving = false;
     bool transitioning = false;
     bool fading = false;
@@ -182,6 +283,8 @@ public:
 
     const json dump();
 
+    void snapshot(StateWriter &);
+
     const std::pair<int, int> getShifts() { return Base::getShifts(); }
 
     bool isActive() { return Base::isActive(); }
@@ -202,6 +305,8 @@ public:
 
     void fade(const unsigned int, const Uint8, const Uint8);
 
+    void collectInUse(std::unordered_set<std::string> &);
+
 private:
     bool isReady();
 };
@@ -219,6 +324,8 @@ typedef struct
     const std::string name; // Cannot be a reference in async
     const int index;
     const Image *image;
+    const unsigned int generation; // Prefetch generation, 0 if the image is needed now
+    const AssetId asset = ASSET_NONE; // Looked up from the name if not already known
 } ImageData;
 
 // Templated wrapper class for array of image objects
@@ -310,6 +417,38 @@ public:
         }
     }
 
+    // Active objects as their index followed by what dump would give
+    void snapshot(StateWriter &writer)
+    {
+        writer.write<uint32>(std::count_if(objects.begin(), objects.end(), [](_Tp &o)
+                                           { return o.isActive(); }));
+
+        for (int i = 0; i < size(); i++)
+        {
+            if (!objects[i].isActive())
+                continue;
+
+            writer.write<uint32>(i);
+            objects[i].snapshot(writer);
+        }
+    }
+
+    void loadSnapshot(StateReader &reader)
+    {
+        for (uint32 n = reader.read<uint32>(); n > 0; n--)
+        {
+            const auto i = reader.read<uint32>();
+            if (i >= size())
+                throw std::runtime_error("Out of range access");
+
+            const auto &rawName = reader.readString();
+            auto xShift = reader.read<int32_t>();
+            auto yShift = reader.read<int32_t>();
+
+            objects[i].update(rawName, xShift, yShift);
+        }
+    }
+
     void clear(size_t i)
     {
         if (i >= size())
@@ -328,4 +467,11 @@ public:
         for (auto &image : objects)
             image.render();
     }
+
+    // Add names of all textures displayed by this layer
+    void collectInUse(std::unordered_set<std::string> &names)
+    {
+        for (auto &image : objects)
+            image.collectInUse(names);
+    }
 };
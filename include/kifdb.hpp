@@ -0,0 +1,161 @@
+#pragma once
+
+#include <asmodean.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Database of the assets in the KIF archives, where each one is stored and how the archives are keyed
+// v1 is written by dumpkif.py, a NUL delimited archive table followed by NUL delimited entries
+// v2 is written by the kifdb tool and is used in place, lookups need no parsing or allocation
+//
+// v2 layout, all fields little-endian and 4 byte aligned:
+//   KifDbHeader
+//   KifDbArchive[ArchiveCount]
+//   KifDbRecord[EntryCount], sorted by hash then name
+//   String pool of NUL terminated names, asset names are lowercase
+//   uint32_t[(1 << BucketBits) + 1], index of the first record whose hash starts with each value of the top bits
+#define KIFDB_SIGNATURE "KDB2"
+#define KIFDB_VERSION 2
+
+// Upper bound on the bucket table, 64 MB
+#define KIFDB_MAX_BUCKET_BITS 24
+
+typedef struct
+{
+    char Signature[4];
+    uint32_t Version;
+    uint32_t ArchiveCount;
+    uint32_t EntryCount;
+    uint32_t ArchiveTableOffset;
+    uint32_t EntryTableOffset;
+    uint32_t StringPoolOffset;
+    uint32_t StringPoolSize;
+    uint32_t BucketTableOffset;
+    uint32_t BucketBits;
+} KifDbHeader;
+
+typedef struct
+{
+    // Filename of the archive in the string pool
+    uint32_t NameOffset;
+    uint32_t NameLength;
+    byte IsEncrypted;
+    byte FileKey[4];
+    byte Padding[3];
+} KifDbArchive;
+
+typedef struct
+{
+    uint32_t Hash;
+    uint32_t NameOffset;
+    uint32_t NameLength;
+
+    // Range of the asset in its archive
+    uint32_t Offset;
+    uint32_t Length;
+
+    // Index of the archive in the archive table
+    uint32_t Index;
+} KifDbRecord;
+
+// Index of an asset's record in the v2 entry table, stable for as long as the DB is open
+typedef uint32_t AssetId;
+#define ASSET_NONE 0xFFFFFFFF
+
+// FNV-1a, also used to order the v2 entry table
+// Continues from a previous hash so a name can be hashed in parts
+inline uint32_t kifDbHash(const std::string_view name, uint32_t hash = 2166136261u)
+{
+    for (const char c : name)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Read-only view of a v2 database that must outlive it
+class KifDbView
+{
+public:
+    // Returns false and leaves the view closed if the buffer is not a valid v2 database
+    bool open(const byte *, const size_t);
+
+    bool isOpen() const { return header != nullptr; }
+
+    uint32_t getArchiveCount() const { return header->ArchiveCount; }
+
+    uint32_t getEntryCount() const { return header->EntryCount; }
+
+    const KifDbArchive &getArchive(const uint32_t index) const { return archives[index]; }
+
+    const KifDbRecord &getRecord(const uint32_t index) const { return records[index]; }
+
+    std::string_view getName(const KifDbArchive &archive) const { return {pool + archive.NameOffset, archive.NameLength}; }
+
+    std::string_view getName(const KifDbRecord &) const;
+
+    AssetId getId(const KifDbRecord &record) const { return &record - records; }
+
+    // Scans the few records in the bucket of the name's hash, NULL if not found
+    // Looks up the name followed by the extension without joining them, folding both to lowercase if asked to
+    const KifDbRecord *find(const std::string_view, const std::string_view = {}, const bool = false) const;
+
+private:
+    const KifDbHeader *header = nullptr;
+    const KifDbArchive *archives = nullptr;
+    const KifDbRecord *records = nullptr;
+    const uint32_t *buckets = nullptr;
+    const char *pool = nullptr;
+};
+
+// Collects archives and entries and writes them as a v2 database
+class KifDbBuilder
+{
+public:
+    void addArchive(const std::string &, const bool, const byte *);
+
+    // Entries of the same name replace earlier ones, as they did in the v1 map
+    void addEntry(const std::string &, const uint32_t, const uint32_t, const uint32_t);
+
+    size_t getArchiveCount() const { return archives.size(); }
+
+    size_t getEntryCount() const { return entries.size(); }
+
+    // Number of entries that replaced an earlier one
+    size_t getDuplicates() const { return duplicates; }
+
+    std::vector<byte> build() const;
+
+private:
+    typedef struct
+    {
+        std::string name;
+        bool encrypted;
+        byte key[4];
+    } Archive;
+
+    typedef struct
+    {
+        std::string name;
+        uint32_t offset;
+        uint32_t length;
+        uint32_t index;
+    } Entry;
+
+    std::vector<Archive> archives;
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, size_t> entryIndices;
+    size_t duplicates = 0;
+};
+
+// Add the contents of a v1 database to a builder, returns false if it is truncated
+bool readKifDbV1(const byte *, const size_t, const bool, KifDbBuilder &);
+
+// Open a database of either version into a view backed by storage
+// v2 is copied as is and v1 is converted, lowercasing names if asked to
+bool loadKifDb(const byte *, const size_t, const bool, std::vector<byte> &, KifDbView &);
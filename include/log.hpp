@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+// Comment out to strip all logging
+#define LOGGING_ENABLE
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+// Lines below this level are compiled out along with the evaluation of their arguments
+// Can be set with `make LOG_LEVEL=0` to get per command and per line logs back
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOGGING_ENABLE
+#undef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_OFF
+#endif
+
+// Lines a single rate limited LOG statement may write per window, the rest are counted and dropped
+#define LOG_RATE_LIMIT 10
+#define LOG_RATE_WINDOW_MS 1000
+
+// Time lines are gathered before the sink writes them together, warnings and errors are written at once
+#define LOG_FLUSH_MS 50
+
+// Leveled logger that formats into a thread-local buffer and hands complete lines to a sink
+// Native builds write from a background thread, WASM builds batch lines into one console call per frame
+class Logger
+{
+public:
+    // Rate limit state of a LOG_*_LIMITED statement, one static per call site
+    typedef struct
+    {
+        std::atomic<uint32_t> windowStart;
+        std::atomic<uint32_t> count;
+        std::atomic<uint32_t> suppressed;
+    } Site;
+
+    // A line being formatted, submitted once the statement ends
+    class Line
+    {
+    public:
+        Line(const int);
+
+        // Rate limited line, for statements that can fire every frame
+        Line(const int, Site &);
+
+        ~Line();
+
+        Line &operator<<(const std::string &v)
+        {
+            if (active)
+                buffer().append(v);
+            return *this;
+        }
+
+        Line &operator<<(const char *v)
+        {
+            if (active)
+                buffer().append(v != NULL ? v : "(null)");
+            return *this;
+        }
+
+        template <class T>
+        Line &operator<<(const T &v)
+        {
+            if (active)
+                append(buffer(), v);
+            return *this;
+        }
+
+    private:
+        const int level;
+
+        // False if the line was rate limited
+        bool active;
+
+        // Offset of the line in the thread's buffer, so lines logged while formatting another stay whole
+        size_t start;
+    };
+
+    // Stands in for a line of a level that is compiled out
+    class Null
+    {
+    public:
+        template <class T>
+        Null &operator<<(const T &) { return *this; }
+    };
+
+    // Write queued lines now, called once per frame on WASM
+    static void flush();
+
+private:
+    static std::string &buffer();
+
+    static void submit(const int, const char *, const size_t);
+
+    template <class T>
+    static void append(std::string &out, const T &v)
+    {
+        if constexpr (std::is_same_v<T, bool>)
+            out += v ? '1' : '0';
+        else if constexpr (std::is_same_v<T, char> || std::is_same_v<T, signed char> || std::is_same_v<T, unsigned char>)
+            out += static_cast<char>(v);
+        else if constexpr (std::is_integral_v<T>)
+        {
+            char tmp[24];
+            const auto res = std::to_chars(tmp, tmp + sizeof(tmp), v);
+            out.append(tmp, res.ptr);
+        }
+        else if constexpr (std::is_floating_point_v<T>)
+        {
+            // Same as the default stream formatting
+            char tmp[32];
+            const int len = snprintf(tmp, sizeof(tmp), "%g", static_cast<double>(v));
+            out.append(tmp, len);
+        }
+        else
+        {
+            // Anything else with a stream operator
+            thread_local std::ostringstream ss;
+            ss.str("");
+            ss << v;
+            out += ss.str();
+        }
+    }
+};
+
+#define LOG_SITE []() -> Logger::Site & { static Logger::Site site; return site; }()
+#define LOG_STRIPPED \
+    if (true)        \
+    {                \
+    }                \
+    else             \
+        Logger::Null()
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG Logger::Line(LOG_LEVEL_DEBUG)
+#define LOG_DEBUG_LIMITED Logger::Line(LOG_LEVEL_DEBUG, LOG_SITE)
+#else
+#define LOG_DEBUG LOG_STRIPPED
+#define LOG_DEBUG_LIMITED LOG_STRIPPED
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO Logger::Line(LOG_LEVEL_INFO)
+#define LOG_INFO_LIMITED Logger::Line(LOG_LEVEL_INFO, LOG_SITE)
+#else
+#define LOG_INFO LOG_STRIPPED
+#define LOG_INFO_LIMITED LOG_STRIPPED
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN Logger::Line(LOG_LEVEL_WARN)
+#define LOG_WARN_LIMITED Logger::Line(LOG_LEVEL_WARN, LOG_SITE)
+#else
+#define LOG_WARN LOG_STRIPPED
+#define LOG_WARN_LIMITED LOG_STRIPPED
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR Logger::Line(LOG_LEVEL_ERROR)
+#define LOG_ERROR_LIMITED Logger::Line(LOG_LEVEL_ERROR, LOG_SITE)
+#else
+#define LOG_ERROR LOG_STRIPPED
+#define LOG_ERROR_LIMITED LOG_STRIPPED
+#endif
+
+#define LOG LOG_INFO
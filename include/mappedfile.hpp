@@ -0,0 +1,44 @@
+#pragma once
+
+#include <asmodean.h>
+
+#include <string>
+
+// Read-only memory mapping of a whole local file
+// Only used on native builds, WASM has no filesystem to map from
+class MappedFile
+{
+public:
+    MappedFile() {}
+
+    MappedFile(const std::string &);
+
+    ~MappedFile();
+
+    // Mappings own OS handles and cannot be copied
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&);
+    MappedFile &operator=(MappedFile &&);
+
+    bool isOpen() const { return base != nullptr; }
+
+    const byte *data() const { return base; }
+
+    uint64 size() const { return length; }
+
+    // Return true if the byte range lies completely within the mapping
+    bool contains(uint64 offset, uint64 len) const { return isOpen() && offset <= length && len <= length - offset; }
+
+private:
+    const byte *base = nullptr;
+    uint64 length = 0;
+
+#ifdef _WIN32
+    void *fileHandle = nullptr;
+    void *mappingHandle = nullptr;
+#endif
+
+    void close();
+};
@@ -1,8 +1,11 @@
+#include <symbols.hpp>
+
 #include <sstream>
 #include <string>
 #include <map>
+#include <vector>
+#include <unordered_map>
 
-typedef std::map<std::string, double> SymbolTable;
 
 enum class Token
 {
@@ -49,47 +52,128 @@ enum class Token
     DivAssign = '/=',
 };
 
+// Compiled expressions kept before the cache is cleared
+#define PARSER_CACHE_SIZE 4096
+
+// Instructions of compiled expressions, operating on a stack of doubles
+enum class Op
+{
+    Push,   // Integer literal in arg
+    Prev,   // Value of `@`
+    Var,    // Variable with an index known when compiled, in arg
+    VarDyn, // Variable named by the popped value
+    Incr,
+    Decr,
+    Neg,
+    Mul,
+    Div,
+    Add,
+    Sub,
+    ToInt,
+    Shl,
+    Shr,
+    Gt,
+    Gte,
+    Lt,
+    Lte,
+    Eq,
+    Neq,
+    Band,
+    Bor,
+    And,
+    Or,
+    Pop,
+    Assign,
+    PlusAssign,
+    MinusAssign,
+    MulAssign,
+    DivAssign,
+    Throw,      // Runtime error, message index in arg
+    ThrowRange, // Out of range literal
+};
+
 class Lexer;
 
+// Compiles expressions once into postfix programs and evaluates them on a stack machine
+// Code is emitted in the order the original recursive descent evaluated,
+// so side effects and errors happen at the same points as before
 class Parser
 {
 public:
     double parse(const std::string &, const int = 0);
 
-    void set_lexer_buffer(std::string &);
+    // Replace all variables with those of a saved table
+    void setSymbolTable(const SymbolTable &);
 
-    // Replace the existing symbol table with a new one
-    void setSymbolTable(const SymbolTable &symbolTable) { symbol_table = symbolTable; }
+    // Variables in the saved format
+    SymbolTable getSymbolTable() const { return symbols.dump(); }
 
-    // Return a reference to the symbol table map object
-    const SymbolTable &getSymbolTable() { return symbol_table; }
+    void snapshotSymbols(StateWriter &writer) const { symbols.snapshot(writer); }
+
+    void loadSymbolSnapshot(StateReader &);
 
     void setVar(const std::string &, const double);
 
 private:
+    typedef struct
+    {
+        Op op;
+        int arg;
+    } Instr;
+
+    typedef struct
+    {
+        std::vector<Instr> code;
+        std::vector<std::string> errors;
+
+        // Stack slots needed to run
+        size_t depth;
+    } Program;
+
+    // Thrown to stop compiling once an error is emitted, as evaluation would stop there
+    struct CompileStop
+    {
+    };
+
     int prevValue = 0;
-    std::string last_var_name; // TODO: Might have better alternative
+
+    // Target of assignments, the variable read last
+    double *lastVar = NULL;
+
+    SymbolStore symbols;
+
+    std::unordered_map<std::string, Program> programs;
+
+    std::vector<double> stack;
+
+    // State while compiling
     Lexer *p_lexer = NULL;
-    SymbolTable symbol_table{};
-
-    double primary();
-    double unary_expr();
-    double mul_expr();
-    double add_expr();
-    double bitshift_expr();
-    double inequality_expr();
-    double equality_expr();
-    double band_expr();
-    double bor_expr();
-    double and_expr();
-    double or_expr();
-    double assign_expr();
+    Program *p_program = NULL;
+    size_t curr_depth = 0;
+
+    Program compile(const std::string &);
+    double run(const Program &);
+
+    void emit(const Op, const int = 0);
+    void fail(const Op, const std::string &);
+    void advance();
+
+    void primary();
+    void unary_expr();
+    void mul_expr();
+    void add_expr();
+    void bitshift_expr();
+    void inequality_expr();
+    void equality_expr();
+    void band_expr();
+    void bor_expr();
+    void and_expr();
+    void or_expr();
+    void assign_expr();
 };
 
 class Lexer
 {
-    friend void Parser::set_lexer_buffer(std::string &);
-
 private:
     Token current_token;
     std::string buffer;
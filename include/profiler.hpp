@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <algorithm>
+
+// Uncomment to time the stages below, the bench target defines it
+// Other targets can be built with it using `make PROFILE=1`
+// #define PROFILE_ENABLE
+
+// Frames kept for the overlay graphs
+#define PROFILE_FRAMES 240
+
+// Trace events recorded before further ones are dropped
+#define PROFILE_TRACE_MAX_EVENTS (1 << 20)
+
+#define PROFILE_TRACE_FILE "trace.json"
+
+// Stages of the engine that are timed, times include any stages nested in them
+enum class PROFILE_STAGE
+{
+    FRAME,      // A whole iteration of the main loop
+    TICK,       // tickScript
+    SECTION,    // tickScript parsing up to a break or wait
+    COMMAND,    // handleCommand
+    EXPRESSION, // Parser::parse
+    SCRIPT,     // Compiling a CST file, which includes its text processing
+    FETCH,      // Reading or decrypting an asset
+    DECODE,     // HG decode, often on worker threads
+    UPLOAD,     // Creating textures from decoded pixels
+    TEXT,       // Text layout
+    GLYPH,      // TTF rendering of glyphs not yet in the atlas
+    RENDER,     // ImageManager::render
+    PRESENT,    // SDL_RenderPresent
+    COUNT
+};
+
+#ifdef PROFILE_ENABLE
+
+// Time spent in each stage, in total since the last reset and per frame for the latest frames
+// Stages can also be recorded as a trace that Chrome's about://tracing and Perfetto can open
+// Safe to add to from any thread
+class Profiler
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Time of each stage in a frame, in nanoseconds
+    typedef std::array<uint64_t, static_cast<int>(PROFILE_STAGE::COUNT)> FrameTimes;
+
+    static void add(const PROFILE_STAGE, const Clock::time_point, const Clock::time_point);
+
+    static uint64_t getNanos(const PROFILE_STAGE stage) { return totals[static_cast<int>(stage)].nanos; }
+
+    static uint64_t getCount(const PROFILE_STAGE stage) { return totals[static_cast<int>(stage)].count; }
+
+    static void reset();
+
+    // Close the current frame, called once per main loop iteration
+    static void endFrame();
+
+    // Times of a recent frame where 0 is the last one closed
+    static const FrameTimes &getFrame(const size_t age) { return frames[(frameCount - 1 - age) % PROFILE_FRAMES]; }
+
+    // Number of frames available to getFrame
+    static size_t getFrameCount() { return std::min<size_t>(frameCount, PROFILE_FRAMES); }
+
+    static void startTrace();
+
+    static bool isTracing() { return tracing; }
+
+    // Stop tracing and write the events as Chrome trace JSON
+    static bool writeTrace(const std::string &);
+
+    // Lowercase name of a stage for reports
+    static const char *getName(const PROFILE_STAGE);
+
+private:
+    typedef struct
+    {
+        std::atomic<uint64_t> nanos;
+        std::atomic<uint64_t> count;
+    } Total;
+
+    typedef struct
+    {
+        PROFILE_STAGE stage;
+        unsigned int thread;
+        Clock::time_point start;
+        Clock::duration duration;
+    } TraceEvent;
+
+    static Total totals[static_cast<int>(PROFILE_STAGE::COUNT)];
+
+    // Time of each stage so far in the current frame
+    static std::atomic<uint64_t> frameNanos[static_cast<int>(PROFILE_STAGE::COUNT)];
+
+    static FrameTimes frames[PROFILE_FRAMES];
+    static size_t frameCount;
+    static Clock::time_point frameStart;
+
+    static std::atomic<bool> tracing;
+    static std::mutex traceMutex;
+    static std::vector<TraceEvent> traceEvents;
+    static Clock::time_point traceStart;
+
+    // Small id of the calling thread for traces
+    static unsigned int threadId();
+};
+
+// Adds the time until the end of its scope to a stage
+class ProfileScope
+{
+public:
+    ProfileScope(const PROFILE_STAGE stage) : stage{stage}, start{Profiler::Clock::now()} {}
+
+    ~ProfileScope() { Profiler::add(stage, start, Profiler::Clock::now()); }
+
+private:
+    const PROFILE_STAGE stage;
+    const Profiler::Clock::time_point start;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(PROFILE_STAGE::stage)
+#define PROFILE_FRAME() Profiler::endFrame()
+
+#else
+
+#define PROFILE_SCOPE(stage)
+#define PROFILE_FRAME()
+
+#endif
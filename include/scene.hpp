@@ -1,20 +1,21 @@
 #pragma once
 
-#include <cstformat.h>
 #include <utils.hpp>
 #include <audio.hpp>
 #include <image.hpp>
 #include <parser.hpp>
 #include <file.hpp>
+#include <script.hpp>
+#include <state.hpp>
+#include <profiler.hpp>
 
 #include <vector>
 #include <cstring>
 #include <string>
 #include <iostream>
-#include <regex>
+#include <unordered_set>
 
 #define SCRIPT_EXT ".cst"
-#define SCRIPT_SIGNATURE "CatScene"
 
 // Should always be start.cst
 #define SCRIPT_ENTRYPOINT "start"
@@ -29,50 +30,58 @@
 #define KEY_OFFSET "offset"
 #define KEY_CHOICE "choice"
 
+// Log every command, only written when LOG_LEVEL includes debug lines
 #define LOG_CMD
 
+// Number of input breaks ahead of the current line to prefetch assets for
+#define PREFETCH_BREAKS 3
+
+// Most scripts reachable from the current one to compile ahead of time
+#define PREFETCH_SCRIPTS 8
+
 typedef struct
 {
     std::string scriptName;
-    byte *offsetFromBase;
+    uint32 offsetFromBase;
 } SaveData;
 
+typedef struct
+{
+    bool isAudio;
+    std::string name;
+} PrefetchData;
+
 class Choice;
 class ImageManager;
 
 class SceneManager
 {
 private:
-    std::deque<json> stateHistory;
+    // Snapshot at each break for going back
+    StateHistory stateHistory;
+
+    // Reused to encode each part of a snapshot
+    StateWriter stateWriter;
 
     unsigned int sectionRdraw = 0;
     Uint64 maxWaitFramestamp = 0;
 
-    // Takes a callback and calls it on every cmdString in the current script
+    // Takes a callback and calls it on every command in the current script
     // Callback should return false to break
     template <typename Functor>
     void iterateScript(Functor functor)
     {
-        ScriptDataHeader *scriptDataHeader = reinterpret_cast<ScriptDataHeader *>(currScriptData.data());
-        byte *tablesStart = reinterpret_cast<byte *>(scriptDataHeader + 1);
-
-        // Locate offset table and string table
-        StringOffsetTable *stringOffsetTable = reinterpret_cast<StringOffsetTable *>(tablesStart + scriptDataHeader->StringOffsetTableOffset);
-        byte *stringTableBase = tablesStart + scriptDataHeader->StringTableOffset;
+        // Hold on to the script in case the callback replaces it
+        auto script = currScript;
+        if (!script)
+            return;
 
-        // Check if pointer exceeded end of script
-        while (reinterpret_cast<byte *>(stringOffsetTable) < stringTableBase)
+        for (const auto &line : script->lines)
         {
-            auto stringTable = reinterpret_cast<StringTable *>(stringTableBase + stringOffsetTable->Offset);
-
-            stringOffsetTable++;
-
-            if (stringTable->Type != 0x30)
+            if (line.type != 0x30)
                 continue;
 
-            const auto &cmdString = std::string(&stringTable->StringStart);
-
-            if (functor(cmdString) == false)
+            if (functor(line) == false)
                 return;
         }
     }
@@ -83,7 +92,27 @@ private:
     bool canProceed();
     bool rdrawWaited();
 
-    void prefetch(std::vector<byte>);
+    void prefetchAhead();
+
+    void resetPrefetch();
+
+    void cancelPrefetch();
+
+    void prefetchScripts();
+
+    void compileScriptAsync(byte *, size_t, const std::string &);
+
+    // Scripts being fetched and compiled in the background
+    std::unordered_set<std::string> pendingScripts;
+
+    // Pending script to start once it is compiled, empty if none
+    std::string awaitedScript;
+
+    // Line up to which upcoming lines have been scanned for assets
+    size_t prefetchLine = 0;
+
+    // Number of breaks between the current line and the prefetch cursor
+    unsigned int prefetchBreaks = 0;
 
     // Pointers to other manager classes
     FileManager &fileManager;
@@ -104,20 +133,29 @@ private:
 
     std::vector<Choice> &currChoices;
 
-    // Vector containing uncompressed script data to be traversed
-    std::vector<byte> currScriptData;
+    ScriptCache scriptCache;
 
-    StringOffsetTable *stringOffsetTable;
-    byte *stringTableBase;
+    // Compiled script being run and the index of its next line
+    std::shared_ptr<const CompiledScript> currScript;
+    size_t currLine = 0;
 
     json getCurrentState();
     void loadStateJson(const json &);
 
+    void pushSnapshot();
+    void loadSnapshot(const StateSnapshot &);
+
+    void resetForLoad();
+
     void wait(unsigned int);
 
-    void handleCommand(const std::string &);
+    void handleCommand(const ScriptLine &);
 
-    void loadScript(byte *, size_t, const std::string &);
+    bool loadScript(byte *, size_t, const std::string &);
+
+    void startScript();
+
+    void startCompiledScript(std::shared_ptr<const CompiledScript>, const std::string &);
 
     void loadScriptStart(byte *, size_t, const std::string &);
 
@@ -129,12 +167,9 @@ private:
 
     void parseLine();
 
-    std::string cleanText(const std::string &);
-
-    std::string sj2utf8(const std::string &);
-
 public:
-    std::deque<std::string> toPrefetch;
+    // Assets found by the lookahead, in script order
+    std::deque<PrefetchData> toPrefetch;
 
     SceneManager(AudioManager &, ImageManager &, FileManager &, std::vector<Choice> &);
 
@@ -146,7 +181,13 @@ public:
 
     void tickScript();
 
-    void start();
+    // Start parsing from the entrypoint, or from any other script
+    void start(const std::string & = SCRIPT_ENTRYPOINT);
+
+    const std::string &getScriptName() { return currScriptName; }
+
+    // Whether the current script has run past its last line
+    bool atEnd() { return currScript && currLine >= currScript->lines.size(); }
 
     void selectChoice(int);
 
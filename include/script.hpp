@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstformat.h>
+#include <command.hpp>
+#include <utils.hpp>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#define SCRIPT_SIGNATURE "CatScene"
+
+// Compiled scripts kept in memory before the least recently used is dropped
+#define SCRIPT_CACHE_SIZE 16
+
+// Uncomment to also keep compiled scripts on disk between runs
+// #define SCRIPT_CACHE_DIR "cache/"
+
+#define SCRIPT_CACHE_EXT ".csb"
+#define SCRIPT_CACHE_SIGNATURE "FS2Scrpt"
+
+// Bump when the layout of compiled scripts changes
+#define SCRIPT_CACHE_VERSION 2
+
+// A script line decoded ahead of time
+typedef struct
+{
+    byte type;
+
+    // Cleaned UTF-8 for messages and speakers, the raw string for commands
+    std::string text;
+
+    // Parsed command of 0x30 lines
+    Command cmd;
+
+    // Index into CompiledScript::branches of the statement run by an `if`, -1 otherwise
+    int branch;
+
+    // Markup removed from the text of messages
+    std::vector<TextSpan> spans;
+} ScriptLine;
+
+typedef struct
+{
+    uint64 hash;
+
+    // Size in bytes of the string offset table, which save offsets count back from
+    uint32 tableBytes;
+
+    std::vector<ScriptLine> lines;
+    std::vector<ScriptLine> branches;
+
+    // Line index for an offset from the end of the string offset table
+    size_t lineFromOffset(const uint32 offset) const { return (tableBytes - offset) / sizeof(StringOffsetTable); }
+
+    uint32 offsetFromLine(const size_t line) const { return tableBytes - line * sizeof(StringOffsetTable); }
+} CompiledScript;
+
+// Turns CST files into lines that need no further string processing to run
+// Compiled scripts are cached by name and checked against a hash of the file they came from
+class ScriptCache
+{
+public:
+    // Compiled script for a raw CST buffer, compiling it if the cache is missing or stale
+    // Returns NULL if the buffer is not a valid script
+    std::shared_ptr<const CompiledScript> get(const std::string &, byte *, size_t);
+
+    // Compiled script already in memory, NULL if there is none
+    std::shared_ptr<const CompiledScript> find(const std::string &);
+
+    // Compile a raw CST buffer without caching it, NULL if it is not a valid script
+    // Touches no cache state so it is safe to call from worker threads
+    static std::shared_ptr<const CompiledScript> build(const std::string &, byte *, size_t);
+
+    // Cache a script compiled by build, replacing any of the same name
+    void add(const std::string &, const std::shared_ptr<const CompiledScript> &);
+
+private:
+    // Most recently used at the front
+    std::list<std::pair<std::string, std::shared_ptr<const CompiledScript>>> scripts;
+    std::unordered_map<std::string, decltype(scripts)::iterator> index;
+
+    static uint64 hash(const byte *, size_t);
+
+    static std::shared_ptr<const CompiledScript> build(const std::string &, byte *, size_t, const uint64);
+
+    static std::shared_ptr<CompiledScript> compile(byte *, size_t, const uint64);
+
+    static void compileLine(CompiledScript &, ScriptLine &);
+
+#ifdef SCRIPT_CACHE_DIR
+    static std::shared_ptr<CompiledScript> readFile(const std::string &, const uint64);
+
+    static void writeFile(const std::string &, const CompiledScript &);
+#endif
+};
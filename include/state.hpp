@@ -0,0 +1,111 @@
+#pragma once
+
+#include <asmodean.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <stdexcept>
+
+// Breaks kept in the history for going back before the oldest is dropped
+#define STATE_HISTORY_SIZE 128
+
+// Appends values to a binary snapshot in native byte order
+// Snapshots only live in memory so they need not be portable
+class StateWriter
+{
+public:
+    std::vector<byte> buf;
+
+    void clear() { buf.clear(); }
+
+    template <typename T>
+    void write(const T value)
+    {
+        const auto *p = reinterpret_cast<const byte *>(&value);
+        buf.insert(buf.end(), p, p + sizeof(T));
+    }
+
+    void write(const std::string &s)
+    {
+        write<uint32>(s.size());
+        buf.insert(buf.end(), s.begin(), s.end());
+    }
+};
+
+// Reads values back in the order they were written
+// Throws std::runtime_error if a value runs past the end
+class StateReader
+{
+public:
+    StateReader(const std::vector<byte> &buf) : pos{buf.data()}, end{buf.data() + buf.size()} {}
+
+    template <typename T>
+    T read()
+    {
+        T value;
+        take(&value, sizeof(T));
+        return value;
+    }
+
+    std::string readString()
+    {
+        std::string s(read<uint32>(), '\0');
+        take(&s[0], s.size());
+        return s;
+    }
+
+private:
+    const byte *pos;
+    const byte *end;
+
+    void take(void *dest, const size_t sz)
+    {
+        if (static_cast<size_t>(end - pos) < sz)
+            throw std::runtime_error("Truncated state snapshot");
+
+        memcpy(dest, pos, sz);
+        pos += sz;
+    }
+};
+
+// Immutable part of a snapshot, shared with neighbouring snapshots while it does not change
+typedef std::shared_ptr<const std::vector<byte>> StatePart;
+
+typedef struct
+{
+    StatePart image;
+    StatePart audio;
+    StatePart symbols;
+
+    // Text, speaker, script position and choices
+    StatePart scene;
+} StateSnapshot;
+
+// Ring buffer of the latest snapshots, for going back through the history
+class StateHistory
+{
+public:
+    StateHistory() : snapshots(STATE_HISTORY_SIZE) {}
+
+    size_t size() const { return count; }
+
+    bool empty() const { return count == 0; }
+
+    // Drops the oldest snapshot if full
+    void push(StateSnapshot &&);
+
+    void pop();
+
+    const StateSnapshot &back() const { return snapshots[(start + count - 1) % snapshots.size()]; }
+
+    // Part holding the bytes written, or the previous part if they are the same
+    static StatePart share(const StateWriter &, const StatePart &);
+
+private:
+    std::vector<StateSnapshot> snapshots;
+
+    size_t start = 0;
+    size_t count = 0;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <state.hpp>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+// Variables as saved, keyed by the names scripts give them e.g. "300.000000"
+typedef std::map<std::string, double> SymbolTable;
+
+// Variable indices below this are kept in a flat array
+#define SYMBOL_DENSE_SIZE 8192
+
+// Script variables keyed by integer index
+// Names that are not integers, which fractional values as names can produce, are kept by string
+class SymbolStore
+{
+public:
+    SymbolStore();
+
+    // Entry of a variable, created as 0 if missing
+    // Pointers stay valid until the store is loaded again
+    double *get(const int);
+
+    // Entry of the variable named by a value, as `#(expr)` names them
+    double *get(const double);
+
+    SymbolTable dump() const;
+
+    // Replace all variables with those of a saved table
+    void load(const SymbolTable &);
+
+    // Binary copy of all variables for the history, without formatting their names
+    void snapshot(StateWriter &) const;
+
+    void loadSnapshot(StateReader &);
+
+private:
+    std::vector<double> dense;
+
+    // Whether each dense entry exists, as saves only list variables that were used
+    std::vector<bool> used;
+
+    std::unordered_map<int, double> sparse;
+
+    std::map<std::string, double> named;
+
+    void clear();
+
+    static bool toIndex(const std::string &, int &);
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atlas.hpp>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+// Laid out strings kept per font and wrap width before the cache is cleared
+#define TEXT_LAYOUT_CACHE 64
+
+// Draws text from glyphs rasterized once into the texture atlas
+// Laid out strings are cached so unchanged text is only a few texture copies per frame
+class TextRenderer
+{
+public:
+    // A glyph placed relative to the origin of its string
+    typedef struct
+    {
+        int page;
+        SDL_Rect src;
+        SDL_Rect dst;
+    } GlyphQuad;
+
+    typedef struct
+    {
+        std::vector<GlyphQuad> quads;
+        int w;
+        int h;
+    } TextLayout;
+
+    TextRenderer(SDL_Renderer *renderer, TextureAtlas &atlas) : renderer{renderer}, atlas{atlas} {}
+
+    // Lay out a UTF-8 string, wrapping lines at wrapWidth pixels unless 0
+    // The reference is valid until the next call
+    const TextLayout &layout(TTF_Font *, const std::string &, const int);
+
+    void draw(const TextLayout &, const int, const int, const SDL_Color &);
+
+private:
+    typedef struct
+    {
+        int page; // -1 for glyphs with nothing to draw
+        SDL_Rect src;
+        int advance;
+    } Glyph;
+
+    SDL_Renderer *renderer;
+    TextureAtlas &atlas;
+
+    // Index of a font in this vector is part of its glyph keys
+    std::vector<TTF_Font *> fonts;
+
+    // Keyed by font index in the upper and codepoint in the lower 32 bits
+    std::unordered_map<uint64, Glyph> glyphs;
+
+    std::map<std::pair<size_t, int>, std::unordered_map<std::string, TextLayout>> layouts;
+
+    size_t getFontIndex(TTF_Font *);
+
+    const Glyph &getGlyph(TTF_Font *, const size_t, const Uint32);
+
+    TextLayout createLayout(TTF_Font *, const size_t, const std::string &, const int);
+
+    static Uint32 nextCodepoint(const std::string &, size_t &);
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <asmodean.h>
+#include <log.hpp>
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
@@ -16,57 +17,33 @@ using json = nlohmann::json;
 #include <vector>
 #include <algorithm>
 
-#define SAVEDATA_FILENAME "savedata.json"
-
-#define LOG Utils::Log()
+// Each save slot is a file of its own in this directory
+#define SAVEDATA_DIR "saves/"
+#define SAVEDATA_EXT ".json"
 
-#define LOGGING_ENABLE
+// Single file all slots used to be saved to, still read for slots without a file
+#define SAVEDATA_FILENAME "savedata.json"
 
-namespace Utils
+// Markup removed from message text that the renderer may want to act on
+enum class TEXT_SPAN
 {
-    class Log
-    {
-        std::stringstream ss;
-
-    public:
-        Log()
-        {
-#ifndef LOGGING_ENABLE
-            return;
-#endif
-#ifdef __EMSCRIPTEN__
-            ss << "console.log(`";
-#else
-            ss << "[LOG] ";
-#endif
-        }
-
-        template <class T>
-        Log &operator<<(const T &v)
-        {
-            ss << v;
-            return *this;
-        }
+    RUBY,
+    LINE_BREAK,
+    PAGE_CLEAR,
+    WAIT
+};
 
-        ~Log()
-        {
-#ifndef LOGGING_ENABLE
-            return;
-#endif
-#ifdef __EMSCRIPTEN__
-            ss << "`)";
-
-            // Sanitize string
-            auto str = ss.str();
-            std::replace(str.begin() + 13, str.end() - 3, '`', '\'');
+typedef struct
+{
+    TEXT_SPAN type;
 
-            emscripten_run_script(str.c_str());
-#else
-            std::cout << ss.str() << std::endl;
-#endif
-        }
-    };
+    // Byte range in the cleaned text, empty for markers that take no space
+    size_t start;
+    size_t length;
+} TextSpan;
 
+namespace Utils
+{
     inline std::string zeroPad(const std::string str, const size_t len)
     {
         return std::string(len - std::min(len, str.length()), '0') + str;
@@ -113,4 +90,15 @@ namespace Utils
     }
 
     const std::vector<std::string> getAssetArgs(const std::string &);
+
+    // Convert Shift-JIS into an output buffer that is reused between calls
+    void sj2utf8(const std::string &, std::string &);
+
+    std::string sj2utf8(const std::string &);
+
+    // Clean text along with spans of the markup that was removed from it
+    // The output may be the input string itself
+    void cleanText(const std::string &, std::string &, std::vector<TextSpan> &);
+
+    std::string cleanText(const std::string &);
 }
@@ -3,6 +3,12 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 
+// Defined by the bench target to run with a hidden window and a software renderer
+// #define HEADLESS
+
+// Frame length used when the display does not report its refresh rate
+#define DEFAULT_FRAME_MS (1000.0 / 60)
+
 #define WINDOW_WIDTH 1024
 #define WINDOW_HEIGHT 576
 
@@ -37,6 +43,8 @@ public:
 
     void toggleFullscreen();
 
+    double getFrameMs();
+
 private:
     void setWindowIcon(SDL_Window *);
 
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <functional>
+#include <deque>
+#include <vector>
+
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// Upper bound on background threads regardless of core count
+#define MAX_WORKERS 4
+
+// Runs jobs on background threads and collects their results into a queue
+// that is drained on the main thread, where SDL calls are allowed
+// WASM builds have no threads so jobs run inline at submission
+class WorkerPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    WorkerPool();
+
+    ~WorkerPool();
+
+    // Run a job on a worker thread
+    // Urgent jobs are started before any queued normal job
+    void submit(Task, const bool = false);
+
+    // Queue a completion to be run on the main thread by drain
+    // Urgent completions are run before any queued normal completion
+    // Safe to call from any thread
+    void post(Task, const bool = false);
+
+    // Run queued completions until the queue is empty or the budget is exceeded
+    // At least one completion is run per call so the queue always makes progress
+    unsigned int drain(double);
+
+    size_t pendingCompletions();
+
+    // Block until a completion is queued or no job is left that could post one
+    void waitCompletion();
+
+    // Return true if no job is queued or running and no completion is waiting
+    bool idle();
+
+private:
+    std::deque<Task> completions;
+    std::deque<Task> urgentCompletions;
+
+#ifndef __EMSCRIPTEN__
+    std::vector<std::thread> workers;
+    std::deque<Task> jobs;
+    std::deque<Task> urgentJobs;
+
+    std::mutex jobMutex;
+    std::condition_variable jobCond;
+    std::mutex completionMutex;
+    std::condition_variable completionCond;
+
+    unsigned int activeJobs = 0;
+    bool stopping = false;
+
+    void work();
+#endif
+};
@@ -11,6 +11,20 @@
 #include <string.h>
 #include <stdio.h>
 
+// SIMD kernels for Undeltafilter, the scalar path is used when none are available
+#if defined(__wasm_simd128__)
+#define HGX_SIMD128
+#include <wasm_simd128.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HGX_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+// AVX2 is compiled per function and only used if the CPU supports it
+#define HGX_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 class BitBuffer {
 private:
 	uint32  index;
@@ -110,6 +124,356 @@ byte UnpackValue(byte c) {
 	return ((c & 1) ? ((c >> 1) ^ 0xFF) : (c >> 1));
 }
 
+/*
+ * Interleaves the 4 bit planes of as many 4-byte groups as the kernel handles
+ * at once and writes the unpacked bytes to out. Returns the number of groups
+ * done, the caller finishes the remainder with the scalar tables.
+ */
+typedef uint32 (*InterleaveKernel)(const byte*, const byte*, const byte*, const byte*, byte*, uint32);
+
+/* Undoes the horizontal delta of the first row and the vertical delta of the rest. */
+typedef void (*RowsKernel)(byte*, uint32, uint32, uint32);
+
+struct UndeltaKernels {
+	InterleaveKernel interleave;
+	RowsKernel       rows;
+};
+
+static uint32 InterleaveScalar(const byte*, const byte*, const byte*, const byte*, byte*, uint32) {
+	return 0;
+}
+
+static void RowsScalar(
+	byte*   rgbaBuffer,
+	uint32  height,
+	uint32  depthBytes,
+	uint32  stride)
+{
+	for (uint32 x = depthBytes; x < stride; x++) {
+		rgbaBuffer[x] += rgbaBuffer[x - depthBytes];
+	}
+
+	for (uint32 y = 1; y < height; y++) {
+		byte* line = rgbaBuffer + y * stride;
+		byte* prev = line - stride;
+
+		for (uint32 x = 0; x < stride; x++) {
+			line[x] += prev[x];
+		}
+	}
+}
+
+#ifdef HGX_SSE2
+
+/* Moves bit pair 2*j of each byte of a plane to bits 6-7, 4-5, 2-3 or 0-1. */
+#define PLANE_BITS(v, j, pos) _mm_and_si128( \
+	(2 * (j) > (pos)) ? _mm_srli_epi16((v), 2 * (j) - (pos)) : _mm_slli_epi16((v), (pos) - 2 * (j)), \
+	_mm_set1_epi8((char) (3 << (pos))))
+
+/* Byte j of every group, already unpacked. */
+static inline __m128i InterleaveByteSSE2(__m128i s1, __m128i s2, __m128i s3, __m128i s4, int j) {
+	__m128i c = _mm_or_si128(
+		_mm_or_si128(PLANE_BITS(s1, j, 6), PLANE_BITS(s2, j, 4)),
+		_mm_or_si128(PLANE_BITS(s3, j, 2), PLANE_BITS(s4, j, 0)));
+
+	// UnpackValue: (c >> 1) ^ (c & 1 ? 0xFF : 0)
+	__m128i one  = _mm_set1_epi8(1);
+	__m128i odd  = _mm_cmpeq_epi8(_mm_and_si128(c, one), one);
+	__m128i half = _mm_and_si128(_mm_srli_epi16(c, 1), _mm_set1_epi8(0x7F));
+	return _mm_xor_si128(half, odd);
+}
+
+static uint32 InterleaveSSE2(const byte* sect1, const byte* sect2, const byte* sect3, const byte* sect4, byte* out, uint32 count) {
+	uint32 i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i s1 = _mm_loadu_si128((const __m128i*) (sect1 + i));
+		__m128i s2 = _mm_loadu_si128((const __m128i*) (sect2 + i));
+		__m128i s3 = _mm_loadu_si128((const __m128i*) (sect3 + i));
+		__m128i s4 = _mm_loadu_si128((const __m128i*) (sect4 + i));
+
+		__m128i b0 = InterleaveByteSSE2(s1, s2, s3, s4, 0);
+		__m128i b1 = InterleaveByteSSE2(s1, s2, s3, s4, 1);
+		__m128i b2 = InterleaveByteSSE2(s1, s2, s3, s4, 2);
+		__m128i b3 = InterleaveByteSSE2(s1, s2, s3, s4, 3);
+
+		// Gather byte 0-3 of each group next to each other
+		__m128i lo01 = _mm_unpacklo_epi8(b0, b1);
+		__m128i hi01 = _mm_unpackhi_epi8(b0, b1);
+		__m128i lo23 = _mm_unpacklo_epi8(b2, b3);
+		__m128i hi23 = _mm_unpackhi_epi8(b2, b3);
+
+		__m128i* dst = (__m128i*) (out + i * 4);
+		_mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(lo01, lo23));
+		_mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo01, lo23));
+		_mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi01, hi23));
+		_mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi01, hi23));
+	}
+	return i;
+}
+
+static void RowsSSE2(
+	byte*   rgbaBuffer,
+	uint32  height,
+	uint32  depthBytes,
+	uint32  stride)
+{
+	uint32 x = 0;
+
+	// Prefix sum of whole pixels, 4 at a time, carrying the last pixel over
+	if (depthBytes == 4) {
+		__m128i carry = _mm_setzero_si128();
+		for (; x + 16 <= stride; x += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*) (rgbaBuffer + x));
+			v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+			v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+			v = _mm_add_epi8(v, carry);
+			_mm_storeu_si128((__m128i*) (rgbaBuffer + x), v);
+			carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+		}
+	}
+
+	for (x = x > depthBytes ? x : depthBytes; x < stride; x++) {
+		rgbaBuffer[x] += rgbaBuffer[x - depthBytes];
+	}
+
+	for (uint32 y = 1; y < height; y++) {
+		byte* line = rgbaBuffer + y * stride;
+		byte* prev = line - stride;
+
+		x = 0;
+		for (; x + 16 <= stride; x += 16) {
+			__m128i v = _mm_add_epi8(_mm_loadu_si128((const __m128i*) (line + x)), _mm_loadu_si128((const __m128i*) (prev + x)));
+			_mm_storeu_si128((__m128i*) (line + x), v);
+		}
+		for (; x < stride; x++) {
+			line[x] += prev[x];
+		}
+	}
+}
+
+#endif /* HGX_SSE2 */
+
+#ifdef HGX_AVX2
+
+#define PLANE_BITS_AVX2(v, j, pos) _mm256_and_si256( \
+	(2 * (j) > (pos)) ? _mm256_srli_epi16((v), 2 * (j) - (pos)) : _mm256_slli_epi16((v), (pos) - 2 * (j)), \
+	_mm256_set1_epi8((char) (3 << (pos))))
+
+__attribute__((target("avx2")))
+static inline __m256i InterleaveByteAVX2(__m256i s1, __m256i s2, __m256i s3, __m256i s4, int j) {
+	__m256i c = _mm256_or_si256(
+		_mm256_or_si256(PLANE_BITS_AVX2(s1, j, 6), PLANE_BITS_AVX2(s2, j, 4)),
+		_mm256_or_si256(PLANE_BITS_AVX2(s3, j, 2), PLANE_BITS_AVX2(s4, j, 0)));
+
+	__m256i one  = _mm256_set1_epi8(1);
+	__m256i odd  = _mm256_cmpeq_epi8(_mm256_and_si256(c, one), one);
+	__m256i half = _mm256_and_si256(_mm256_srli_epi16(c, 1), _mm256_set1_epi8(0x7F));
+	return _mm256_xor_si256(half, odd);
+}
+
+__attribute__((target("avx2")))
+static uint32 InterleaveAVX2(const byte* sect1, const byte* sect2, const byte* sect3, const byte* sect4, byte* out, uint32 count) {
+	uint32 i = 0;
+	for (; i + 32 <= count; i += 32) {
+		__m256i s1 = _mm256_loadu_si256((const __m256i*) (sect1 + i));
+		__m256i s2 = _mm256_loadu_si256((const __m256i*) (sect2 + i));
+		__m256i s3 = _mm256_loadu_si256((const __m256i*) (sect3 + i));
+		__m256i s4 = _mm256_loadu_si256((const __m256i*) (sect4 + i));
+
+		__m256i b0 = InterleaveByteAVX2(s1, s2, s3, s4, 0);
+		__m256i b1 = InterleaveByteAVX2(s1, s2, s3, s4, 1);
+		__m256i b2 = InterleaveByteAVX2(s1, s2, s3, s4, 2);
+		__m256i b3 = InterleaveByteAVX2(s1, s2, s3, s4, 3);
+
+		// Unpacks work within 128-bit lanes, so each result holds
+		// 4 groups from the low half and 4 from the high half
+		__m256i lo01 = _mm256_unpacklo_epi8(b0, b1);
+		__m256i hi01 = _mm256_unpackhi_epi8(b0, b1);
+		__m256i lo23 = _mm256_unpacklo_epi8(b2, b3);
+		__m256i hi23 = _mm256_unpackhi_epi8(b2, b3);
+
+		__m256i g0 = _mm256_unpacklo_epi16(lo01, lo23); // groups 0-3,   16-19
+		__m256i g1 = _mm256_unpackhi_epi16(lo01, lo23); // groups 4-7,   20-23
+		__m256i g2 = _mm256_unpacklo_epi16(hi01, hi23); // groups 8-11,  24-27
+		__m256i g3 = _mm256_unpackhi_epi16(hi01, hi23); // groups 12-15, 28-31
+
+		__m256i* dst = (__m256i*) (out + i * 4);
+		_mm256_storeu_si256(dst + 0, _mm256_permute2x128_si256(g0, g1, 0x20));
+		_mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(g2, g3, 0x20));
+		_mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(g0, g1, 0x31));
+		_mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(g2, g3, 0x31));
+	}
+
+	// Leftover of at least 16 groups can still use SSE2
+	return i + InterleaveSSE2(sect1 + i, sect2 + i, sect3 + i, sect4 + i, out + i * 4, count - i);
+}
+
+__attribute__((target("avx2")))
+static void RowsAVX2(
+	byte*   rgbaBuffer,
+	uint32  height,
+	uint32  depthBytes,
+	uint32  stride)
+{
+	// First row is a short dependency chain, SSE2 is enough
+	RowsSSE2(rgbaBuffer, height > 1 ? 1 : height, depthBytes, stride);
+
+	for (uint32 y = 1; y < height; y++) {
+		byte* line = rgbaBuffer + y * stride;
+		byte* prev = line - stride;
+
+		uint32 x = 0;
+		for (; x + 32 <= stride; x += 32) {
+			__m256i v = _mm256_add_epi8(_mm256_loadu_si256((const __m256i*) (line + x)), _mm256_loadu_si256((const __m256i*) (prev + x)));
+			_mm256_storeu_si256((__m256i*) (line + x), v);
+		}
+		for (; x < stride; x++) {
+			line[x] += prev[x];
+		}
+	}
+}
+
+#endif /* HGX_AVX2 */
+
+#ifdef HGX_SIMD128
+
+static inline v128_t PlaneBitsSIMD128(v128_t v, int j, int pos) {
+	v128_t shifted = (2 * j > pos) ? wasm_u16x8_shr(v, 2 * j - pos) : wasm_i16x8_shl(v, pos - 2 * j);
+	return wasm_v128_and(shifted, wasm_i8x16_splat((int8_t) (3 << pos)));
+}
+
+static inline v128_t InterleaveByteSIMD128(v128_t s1, v128_t s2, v128_t s3, v128_t s4, int j) {
+	v128_t c = wasm_v128_or(
+		wasm_v128_or(PlaneBitsSIMD128(s1, j, 6), PlaneBitsSIMD128(s2, j, 4)),
+		wasm_v128_or(PlaneBitsSIMD128(s3, j, 2), PlaneBitsSIMD128(s4, j, 0)));
+
+	v128_t one  = wasm_i8x16_splat(1);
+	v128_t odd  = wasm_i8x16_eq(wasm_v128_and(c, one), one);
+	v128_t half = wasm_u8x16_shr(c, 1);
+	return wasm_v128_xor(half, odd);
+}
+
+static uint32 InterleaveSIMD128(const byte* sect1, const byte* sect2, const byte* sect3, const byte* sect4, byte* out, uint32 count) {
+	uint32 i = 0;
+	for (; i + 16 <= count; i += 16) {
+		v128_t s1 = wasm_v128_load(sect1 + i);
+		v128_t s2 = wasm_v128_load(sect2 + i);
+		v128_t s3 = wasm_v128_load(sect3 + i);
+		v128_t s4 = wasm_v128_load(sect4 + i);
+
+		v128_t b0 = InterleaveByteSIMD128(s1, s2, s3, s4, 0);
+		v128_t b1 = InterleaveByteSIMD128(s1, s2, s3, s4, 1);
+		v128_t b2 = InterleaveByteSIMD128(s1, s2, s3, s4, 2);
+		v128_t b3 = InterleaveByteSIMD128(s1, s2, s3, s4, 3);
+
+		v128_t lo01 = wasm_i8x16_shuffle(b0, b1, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+		v128_t hi01 = wasm_i8x16_shuffle(b0, b1, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+		v128_t lo23 = wasm_i8x16_shuffle(b2, b3, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+		v128_t hi23 = wasm_i8x16_shuffle(b2, b3, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+
+		byte* dst = out + i * 4;
+		wasm_v128_store(dst + 0,  wasm_i16x8_shuffle(lo01, lo23, 0, 8, 1, 9, 2, 10, 3, 11));
+		wasm_v128_store(dst + 16, wasm_i16x8_shuffle(lo01, lo23, 4, 12, 5, 13, 6, 14, 7, 15));
+		wasm_v128_store(dst + 32, wasm_i16x8_shuffle(hi01, hi23, 0, 8, 1, 9, 2, 10, 3, 11));
+		wasm_v128_store(dst + 48, wasm_i16x8_shuffle(hi01, hi23, 4, 12, 5, 13, 6, 14, 7, 15));
+	}
+	return i;
+}
+
+static void RowsSIMD128(
+	byte*   rgbaBuffer,
+	uint32  height,
+	uint32  depthBytes,
+	uint32  stride)
+{
+	uint32 x = 0;
+
+	if (depthBytes == 4) {
+		v128_t zero  = wasm_i8x16_splat(0);
+		v128_t carry = zero;
+		for (; x + 16 <= stride; x += 16) {
+			v128_t v = wasm_v128_load(rgbaBuffer + x);
+			v = wasm_i8x16_add(v, wasm_i8x16_shuffle(zero, v, 0, 1, 2, 3, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27));
+			v = wasm_i8x16_add(v, wasm_i8x16_shuffle(zero, v, 0, 1, 2, 3, 4, 5, 6, 7, 16, 17, 18, 19, 20, 21, 22, 23));
+			v = wasm_i8x16_add(v, carry);
+			wasm_v128_store(rgbaBuffer + x, v);
+			carry = wasm_i32x4_shuffle(v, v, 3, 3, 3, 3);
+		}
+	}
+
+	for (x = x > depthBytes ? x : depthBytes; x < stride; x++) {
+		rgbaBuffer[x] += rgbaBuffer[x - depthBytes];
+	}
+
+	for (uint32 y = 1; y < height; y++) {
+		byte* line = rgbaBuffer + y * stride;
+		byte* prev = line - stride;
+
+		x = 0;
+		for (; x + 16 <= stride; x += 16) {
+			wasm_v128_store(line + x, wasm_i8x16_add(wasm_v128_load(line + x), wasm_v128_load(prev + x)));
+		}
+		for (; x < stride; x++) {
+			line[x] += prev[x];
+		}
+	}
+}
+
+#endif /* HGX_SIMD128 */
+
+/* Picks the widest kernels the CPU supports. */
+static UndeltaKernels SelectKernels() {
+#ifdef HGX_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return { InterleaveAVX2, RowsAVX2 };
+#endif
+#if defined(HGX_SSE2)
+	return { InterleaveSSE2, RowsSSE2 };
+#elif defined(HGX_SIMD128)
+	return { InterleaveSIMD128, RowsSIMD128 };
+#else
+	return { InterleaveScalar, RowsScalar };
+#endif
+}
+
+/* Looked up on first use as CPU features cannot be checked during static init. */
+static UndeltaKernels& ActiveKernels() {
+	static UndeltaKernels kernels = SelectKernels();
+	return kernels;
+}
+
+bool SetUndeltaKernel(UndeltaKernel kernel) {
+	UndeltaKernels& active = ActiveKernels();
+
+	switch (kernel) {
+	case UndeltaKernel::Auto:
+		active = SelectKernels();
+		return true;
+	case UndeltaKernel::Scalar:
+		active = { InterleaveScalar, RowsScalar };
+		return true;
+#ifdef HGX_SSE2
+	case UndeltaKernel::SSE2:
+		active = { InterleaveSSE2, RowsSSE2 };
+		return true;
+#endif
+#ifdef HGX_AVX2
+	case UndeltaKernel::AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return false;
+		active = { InterleaveAVX2, RowsAVX2 };
+		return true;
+#endif
+#ifdef HGX_SIMD128
+	case UndeltaKernel::SIMD128:
+		active = { InterleaveSIMD128, RowsSIMD128 };
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
 void Undeltafilter(
 	byte*   unrleBuffer,
 	uint32  unrleLength,
@@ -119,6 +483,8 @@ void Undeltafilter(
 	uint32  depthBytes,
 	uint32  stride)
 {
+	const UndeltaKernels kernels = ActiveKernels();
+
 	uint32 table1[TABLE_SIZE];// = { 0 };
 	uint32 table2[TABLE_SIZE];// = { 0 };
 	uint32 table3[TABLE_SIZE];// = { 0 };
@@ -151,6 +517,14 @@ void Undeltafilter(
 	byte*  outP   = rgbaBuffer;
 	byte*  outEnd = rgbaBuffer + unrleLength;
 
+	// Bulk of the groups, the tail is left to the tables below
+	uint32 done = kernels.interleave(sect1, sect2, sect3, sect4, outP, sectLength);
+	sect1 += done;
+	sect2 += done;
+	sect3 += done;
+	sect4 += done;
+	outP  += done * 4;
+
 	while (outP < outEnd) {
 		uint32 val = table1[*sect1++] | table2[*sect2++] | table3[*sect3++] | table4[*sect4++];
 
@@ -160,18 +534,7 @@ void Undeltafilter(
 		*outP++ = UnpackValue((byte) (val >> 24));
 	}
 
-	for (uint32 x = depthBytes; x < stride; x++) {
-		rgbaBuffer[x] += rgbaBuffer[x - depthBytes];
-	}
-
-	for (uint32 y = 1; y < height; y++) {
-		byte* line = rgbaBuffer + y * stride;
-		byte* prev = line - stride;
-
-		for (uint32 x = 0; x < stride; x++) {
-			line[x] += prev[x];
-		}
-	}
+	kernels.rows(rgbaBuffer, height, depthBytes, stride);
 }
 
 ReturnCode ProcessImage(
@@ -224,3 +587,40 @@ ReturnCode ProcessImage(
 
 	return ReturnCode::Success;
 }
+
+ReturnCode ProcessUnrled(
+	byte*   unrleBuffer,
+	uint32  unrleLength,
+	byte*   rgbaBuffer,
+	uint32  rgbaLength,
+	uint32  width,
+	uint32  height,
+	uint32  depthBytes,
+	uint32  stride)
+{
+	// Murphy's law safety checks
+	if (rgbaBuffer == nullptr)
+		return ReturnCode::RgbaBufferIsNull;
+	if (unrleBuffer == nullptr)
+		return ReturnCode::UnrleBufferTooSmall;
+
+	if (rgbaLength > MAX_RGBA_LENGTH)
+		return ReturnCode::DimensionsTooLarge;
+	if (width == 0 || height == 0)
+		return ReturnCode::InvalidDimensions;
+	if (depthBytes == 0 || depthBytes > 4)
+		return ReturnCode::InvalidDepthBytes;
+	if (rgbaLength < unrleLength)
+		return ReturnCode::RgbaBufferTooSmall;
+
+	// Rows past the un-RLEd data are expected to be zero as in ProcessImage
+	uint32 imageLength = height * stride;
+	if (imageLength > rgbaLength)
+		imageLength = rgbaLength;
+	if (imageLength > unrleLength)
+		memset(rgbaBuffer + unrleLength, 0, imageLength - unrleLength);
+
+	Undeltafilter(unrleBuffer, unrleLength, rgbaBuffer, width, height, depthBytes, stride);
+
+	return ReturnCode::Success;
+}
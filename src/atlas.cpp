@@ -0,0 +1,200 @@
+#include <atlas.hpp>
+#include <hgdecoder.hpp>
+#include <utils.hpp>
+
+#include <algorithm>
+#include <climits>
+
+bool TextureAtlas::fits(const Stdinfo &stdinfo) const
+{
+    // Pages are ARGB, other depths would need converting
+    return stdinfo.BitDepth == 32 && stdinfo.Width + ATLAS_PADDING <= ATLAS_SIZE && stdinfo.Height <= ATLAS_MAX_HEIGHT;
+}
+
+bool TextureAtlas::add(SDL_Renderer *renderer, const byte *pixels, const Stdinfo &stdinfo, Slot &slot)
+{
+    if (!fits(stdinfo))
+        return false;
+
+    return add(renderer, pixels, PITCH(stdinfo.Width, stdinfo.BitDepth), stdinfo.Width, stdinfo.Height, slot);
+}
+
+bool TextureAtlas::add(SDL_Renderer *renderer, const void *pixels, const int pitch, const int width, const int height, Slot &slot)
+{
+    if (width <= 0 || height <= 0 || width + ATLAS_PADDING > ATLAS_SIZE || height > ATLAS_MAX_HEIGHT)
+        return false;
+
+    const int w = width + ATLAS_PADDING;
+    const int h = height + ATLAS_PADDING;
+
+    // Try existing pages first, then reuse an emptied slot or add one
+    int found = -1;
+    for (int i = 0; i < pages.size(); i++)
+    {
+        if (pages[i].texture != NULL && pack(pages[i], w, h, slot.rect))
+        {
+            found = i;
+            break;
+        }
+    }
+
+    if (found < 0)
+    {
+        for (int i = 0; i < pages.size(); i++)
+        {
+            if (pages[i].texture == NULL)
+            {
+                found = i;
+                break;
+            }
+        }
+
+        if (found < 0)
+        {
+            found = pages.size();
+            pages.push_back({NULL, {}, 0});
+        }
+
+        if (!createPage(renderer, pages[found]) || !pack(pages[found], w, h, slot.rect))
+            return false;
+    }
+
+    auto &page = pages[found];
+
+    // Padding is part of the packed area but not of the sprite
+    slot.page = found;
+    slot.rect.w = width;
+    slot.rect.h = height;
+
+    SDL_UpdateTexture(page.texture, &slot.rect, pixels, pitch);
+    page.sprites++;
+
+    return true;
+}
+
+void TextureAtlas::release(const int index)
+{
+    auto &page = pages[index];
+    if (page.sprites == 0 || --page.sprites > 0)
+        return;
+
+    SDL_DestroyTexture(page.texture);
+    page.texture = NULL;
+    page.skyline.clear();
+
+    LOG_DEBUG << "Released atlas page " << index;
+}
+
+size_t TextureAtlas::getPages() const
+{
+    size_t n = 0;
+    for (const auto &page : pages)
+    {
+        if (page.texture != NULL)
+            n++;
+    }
+
+    return n;
+}
+
+bool TextureAtlas::createPage(SDL_Renderer *renderer, Page &page)
+{
+    page.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, ATLAS_SIZE, ATLAS_SIZE);
+    if (page.texture == NULL)
+    {
+        LOG_ERROR << "Could not create atlas page: " << SDL_GetError();
+        return false;
+    }
+
+    SDL_SetTextureBlendMode(page.texture, SDL_BLENDMODE_BLEND);
+
+    // Padding must stay transparent in case of filtering
+    std::vector<byte> clear(ATLAS_SIZE * ATLAS_SIZE * 4);
+    SDL_UpdateTexture(page.texture, NULL, clear.data(), ATLAS_SIZE * 4);
+
+    page.skyline = {{0, 0, ATLAS_SIZE}};
+    page.sprites = 0;
+
+    LOG_DEBUG << "Created atlas page";
+    return true;
+}
+
+// Bottom-left skyline placement, picking the lowest position and then the least wasted width
+bool TextureAtlas::pack(Page &page, const int w, const int h, SDL_Rect &rect)
+{
+    auto &skyline = page.skyline;
+
+    int bestIdx = -1;
+    int bestY = INT_MAX;
+    int bestWidth = INT_MAX;
+
+    for (int i = 0; i < skyline.size(); i++)
+    {
+        int x = skyline[i].x;
+        if (x + w > ATLAS_SIZE)
+            break;
+
+        // Rest on the highest node spanned
+        int y = 0;
+        int widthLeft = w;
+        for (int j = i; widthLeft > 0; j++)
+        {
+            y = std::max(y, skyline[j].y);
+            widthLeft -= skyline[j].width;
+        }
+
+        if (y + h > ATLAS_SIZE)
+            continue;
+
+        if (y < bestY || (y == bestY && skyline[i].width < bestWidth))
+        {
+            bestIdx = i;
+            bestY = y;
+            bestWidth = skyline[i].width;
+        }
+    }
+
+    if (bestIdx < 0)
+        return false;
+
+    rect = {skyline[bestIdx].x, bestY, w, h};
+
+    // Raise the skyline over the new rect
+    skyline.insert(skyline.begin() + bestIdx, {rect.x, bestY + h, w});
+
+    // Trim or drop nodes now covered
+    for (int i = bestIdx + 1; i < skyline.size();)
+    {
+        auto &prev = skyline[i - 1];
+        auto &node = skyline[i];
+
+        int overlap = prev.x + prev.width - node.x;
+        if (overlap <= 0)
+            break;
+
+        if (overlap < node.width)
+        {
+            node.x += overlap;
+            node.width -= overlap;
+            break;
+        }
+
+        skyline.erase(skyline.begin() + i);
+    }
+
+    // Merge neighbours of the same height
+    for (int i = 0; i + 1 < skyline.size();)
+    {
+        if (skyline[i].y == skyline[i + 1].y)
+        {
+            skyline[i].width += skyline[i + 1].width;
+            skyline.erase(skyline.begin() + i + 1);
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    return true;
+}
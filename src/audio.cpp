@@ -2,6 +2,7 @@
 #include <utils.hpp>
 
 #include <map>
+#include <memory>
 
 void Sound::free()
 {
@@ -48,7 +49,7 @@ AudioManager::AudioManager(FileManager &fm) : fileManager{fm}
 {
     if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, MIX_DEFAULT_CHANNELS, 1024) == -1)
     {
-        LOG << Mix_GetError();
+        LOG_ERROR << Mix_GetError();
     }
 
     // Set fixed volume for channels
@@ -79,7 +80,8 @@ void AudioManager::stopSound(const int channel)
 void AudioManager::setMusic(const std::string name)
 {
     // Ensure asset exists in database
-    if (!fileManager.inDB(name + MUSIC_EXT))
+    const AssetId asset = fileManager.findAsset(name, ASSET_EXT::MUSIC);
+    if (asset == ASSET_NONE)
         return;
 
     currMusicName = name;
@@ -90,10 +92,14 @@ void AudioManager::setMusic(const std::string name)
         // Play directly from cache
         playMusic(mixMusic, name);
     }
+    else if (playPrefetched(name, -1))
+    {
+        // Played from prefetched buffer
+    }
     else
     {
         // Fetch and store in cache
-        fileManager.fetchAssetAndProcess(name + MUSIC_EXT, this, &AudioManager::playMusicFromMem, name);
+        fileManager.fetchAssetAndProcess(asset, this, &AudioManager::playMusicFromMem, name);
     }
 }
 
@@ -104,7 +110,10 @@ void AudioManager::setPCM(const std::string &name)
     Mix_HaltChannel(CHANNEL_PCM);
     currSounds[CHANNEL_PCM].set(name, 0);
 
-    fileManager.fetchAssetAndProcess(name + PCM_EXT, this, &AudioManager::playSoundFromMem, SoundData{CHANNEL_PCM, name});
+    if (playPrefetched(name, CHANNEL_PCM))
+        return;
+
+    fileManager.fetchAssetAndProcess(fileManager.findAsset(name, ASSET_EXT::PCM), this, &AudioManager::playSoundFromMem, SoundData{CHANNEL_PCM, name});
 }
 
 // Play a specified sound effect asset
@@ -115,13 +124,17 @@ void AudioManager::setSE(const std::string &name, const int channel, const int l
         return;
 
     // Ensure asset exists in database
-    if (!fileManager.inDB(name + SE_EXT))
+    const AssetId asset = fileManager.findAsset(name, ASSET_EXT::SE);
+    if (asset == ASSET_NONE)
         return;
 
     Mix_HaltChannel(channel);
     currSounds[channel].set(name, loops);
 
-    fileManager.fetchAssetAndProcess(name + SE_EXT, this, &AudioManager::playSoundFromMem, SoundData{channel, name});
+    if (playPrefetched(name, channel))
+        return;
+
+    fileManager.fetchAssetAndProcess(asset, this, &AudioManager::playSoundFromMem, SoundData{channel, name});
 }
 
 void AudioManager::playMusic(Mix_Music *mixMusic, const std::string &name)
@@ -217,3 +230,106 @@ const json AudioManager::dump()
 
     return j;
 }
+
+// Music name, then looping SE as channel and name pairs
+void AudioManager::snapshot(StateWriter &writer)
+{
+    writer.write(currMusicName);
+
+    for (int i = 0; i < SOUND_CHANNELS; i++)
+    {
+        auto &name = currSounds[i].getName();
+        if (!name.empty() && currSounds[i].getLoops() == -1)
+        {
+            writer.write<int32_t>(i);
+            writer.write(name);
+        }
+    }
+
+    writer.write<int32_t>(-1);
+}
+
+void AudioManager::loadSnapshot(StateReader &reader)
+{
+    const std::string &musicName = reader.readString();
+
+    stopSounds();
+    for (int i = reader.read<int32_t>(); i >= 0; i = reader.read<int32_t>())
+    {
+        const std::string &name = reader.readString();
+        if (i < SOUND_CHANNELS)
+            setSE(name, i, -1);
+    }
+
+    stopMusic();
+    if (!musicName.empty())
+        setMusic(musicName);
+}
+
+// Fetch an audio file in the background so it can be played without waiting
+void AudioManager::prefetch(const std::string &name)
+{
+    auto cached = musicCache.find(name);
+    if (cached != musicCache.end() && cached->second != NULL)
+        return;
+
+    if (prefetchedAudio.count(name) || pendingAudio.count(name))
+        return;
+
+    // Music, SE and PCM share the same extension
+    const AssetId asset = fileManager.findAsset(name, ASSET_EXT::SE);
+    if (asset == ASSET_NONE)
+        return;
+
+    pendingAudio.insert(name);
+    fileManager.fetchAssetAsync(asset, this, &AudioManager::storePrefetched, PrefetchAudioData{name, prefetchGeneration});
+}
+
+// Drop queued prefetches and any buffers that were never played
+void AudioManager::cancelPrefetch()
+{
+    prefetchGeneration++;
+    prefetchedAudio.clear();
+}
+
+// Worker callback to keep a copy of a prefetched file for the main thread
+void AudioManager::storePrefetched(byte *buf, size_t sz, const PrefetchAudioData &prefetchData)
+{
+    const std::string name = prefetchData.name;
+
+    if (prefetchData.generation != prefetchGeneration)
+    {
+        fileManager.getWorkerPool().post([this, name]()
+                                         { pendingAudio.erase(name); });
+        return;
+    }
+
+    // Shared as tasks must be copyable
+    auto data = std::make_shared<std::vector<byte>>(buf, buf + sz);
+    const unsigned int generation = prefetchData.generation;
+
+    fileManager.getWorkerPool().post([this, name, data, generation]()
+                                     {
+                                         pendingAudio.erase(name);
+                                         if (generation == prefetchGeneration)
+                                             prefetchedAudio[name] = std::move(*data); });
+}
+
+// Play a prefetched buffer as music if channel is -1, or as a sound on the channel
+// Returns false if the audio was not prefetched
+bool AudioManager::playPrefetched(const std::string &name, const int channel)
+{
+    auto got = prefetchedAudio.find(name);
+    if (got == prefetchedAudio.end())
+        return false;
+
+    // Both players copy or decode the buffer so it can be released right after
+    auto &buf = got->second;
+    if (channel == -1)
+        playMusicFromMem(buf.data(), buf.size(), name);
+    else
+        playSoundFromMem(buf.data(), buf.size(), SoundData{channel, name});
+
+    prefetchedAudio.erase(got);
+    return true;
+}
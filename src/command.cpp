@@ -0,0 +1,406 @@
+#include <command.hpp>
+
+#include <cstring>
+#include <algorithm>
+#include <charconv>
+#include <iterator>
+
+namespace
+{
+    // Character classes as std::regex matches them in the C locale
+    bool isSpace(const char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r'; }
+    bool isNonSpace(const char c) { return !isSpace(c); }
+    bool isDigit(const char c) { return c >= '0' && c <= '9'; }
+    bool isWord(const char c) { return isDigit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+    bool isAsset(const char c) { return isWord(c) || c == ',' || c == '$'; }
+
+    // `.` does not match line terminators
+    bool isLineEnd(const char c) { return c == '\n' || c == '\r'; }
+
+    // Cursor over a command string
+    // Matching methods only advance on success, so a copy can be used for optional groups
+    class Reader
+    {
+    public:
+        Reader(const std::string &s) : s{s} {}
+
+        size_t pos = 0;
+
+        bool literal(const char *lit)
+        {
+            size_t len = strlen(lit);
+            if (s.compare(pos, len, lit) != 0)
+                return false;
+
+            pos += len;
+            return true;
+        }
+
+        // Greedy run of at least min matching characters
+        bool run(bool (*pred)(const char), const size_t min, std::string &out)
+        {
+            size_t end = pos;
+            while (end < s.size() && pred(s[end]))
+                end++;
+
+            if (end - pos < min)
+                return false;
+
+            out.assign(s, pos, end - pos);
+            pos = end;
+            return true;
+        }
+
+        // Rest of the string, which must be non-empty and on one line
+        bool rest(std::string &out)
+        {
+            if (pos >= s.size())
+                return false;
+
+            for (size_t i = pos; i < s.size(); i++)
+            {
+                if (isLineEnd(s[i]))
+                    return false;
+            }
+
+            out.assign(s, pos, std::string::npos);
+            pos = s.size();
+            return true;
+        }
+
+        const std::string &s;
+    };
+
+    // ^wait\s?(\d*)
+    bool matchWait(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        if (!r.literal("wait"))
+            return false;
+
+        if (r.pos < s.size() && isSpace(s[r.pos]))
+            r.pos++;
+
+        r.run(isDigit, 0, cmd.args[1]);
+        return true;
+    }
+
+    // ^frameon(?: (\w+) (\d+))? and ^frameoff(?: (\w+) (\d+))?
+    bool matchFrame(const std::string &s, const char *keyword, Command &cmd)
+    {
+        Reader r(s);
+        if (!r.literal(keyword))
+            return false;
+
+        std::string mode, frames;
+        if (r.literal(" ") && r.run(isWord, 1, mode) && r.literal(" ") && r.run(isDigit, 1, frames))
+        {
+            cmd.args[1] = mode;
+            cmd.args[2] = frames;
+        }
+
+        return true;
+    }
+
+    // ^rdraw (\d+)
+    bool matchRdraw(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        return r.literal("rdraw ") && r.run(isDigit, 1, cmd.args[1]);
+    }
+
+    // ^r?wipe2? (\w+) (\d+)
+    bool matchWipe(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        r.literal("r");
+        if (!r.literal("wipe"))
+            return false;
+
+        r.literal("2");
+        return r.literal(" ") && r.run(isWord, 1, cmd.args[1]) && r.literal(" ") && r.run(isDigit, 1, cmd.args[2]);
+    }
+
+    // ^pcm (\S+)
+    bool matchPcm(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        return r.literal("pcm ") && r.run(isNonSpace, 1, cmd.args[1]);
+    }
+
+    // ^bgm (\d+) (\S+)
+    bool matchBgm(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        return r.literal("bgm ") && r.run(isDigit, 1, cmd.args[1]) && r.literal(" ") && r.run(isNonSpace, 1, cmd.args[2]);
+    }
+
+    // ^se (\d)(?: (\w+)(?: (\w+)(?: (\w+)(?: (\w+))?)?)?)?
+    bool matchSe(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        if (!r.literal("se ") || r.pos >= s.size() || !isDigit(s[r.pos]))
+            return false;
+
+        cmd.args[1] = s[r.pos++];
+
+        // Each optional group is nested in the previous one
+        for (int i = 2; i <= 5; i++)
+        {
+            Reader t = r;
+            std::string arg;
+            if (!t.literal(" ") || !t.run(isWord, 1, arg))
+                break;
+
+            cmd.args[i] = arg;
+            r.pos = t.pos;
+        }
+
+        return true;
+    }
+
+    // ^(bg|eg|fg|cg|fw)(?: (\d)(?: ([\w,$]+)(?: ([^\s]*)(?: ([^\s]*)(?: ([^\s]*)(?: ([^\s]*))?)?)?)?)?)?
+    bool matchImage(const std::string &s, Command &cmd)
+    {
+        if (s.size() < 2)
+            return false;
+
+        cmd.args[1] = s.substr(0, 2);
+        const auto &t = cmd.args[1];
+        if (t != "bg" && t != "eg" && t != "fg" && t != "cg" && t != "fw")
+        {
+            cmd.args[1].clear();
+            return false;
+        }
+
+        Reader r(s);
+        r.pos = 2;
+
+        if (!r.literal(" ") || r.pos >= s.size() || !isDigit(s[r.pos]))
+            return true;
+        cmd.args[2] = s[r.pos++];
+
+        {
+            Reader t = r;
+            std::string asset;
+            if (!t.literal(" ") || !t.run(isAsset, 1, asset))
+                return true;
+
+            cmd.args[3] = asset;
+            r.pos = t.pos;
+        }
+
+        // Later arguments may be empty
+        for (int i = 4; i <= 7; i++)
+        {
+            if (!r.literal(" "))
+                break;
+
+            r.run(isNonSpace, 0, cmd.args[i]);
+        }
+
+        return true;
+    }
+
+    // ^if\s*\((.+)\)\s+(.+)
+    bool matchIf(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        if (!r.literal("if"))
+            return false;
+
+        std::string skipped;
+        r.run(isSpace, 0, skipped);
+        if (!r.literal("("))
+            return false;
+
+        const size_t open = r.pos;
+
+        size_t lineEnd = open;
+        while (lineEnd < s.size() && !isLineEnd(s[lineEnd]))
+            lineEnd++;
+
+        // Greedy condition, so try the last closing bracket first
+        for (size_t p = lineEnd; p-- > open + 1;)
+        {
+            if (s[p] != ')')
+                continue;
+
+            const size_t q = p + 1;
+            size_t spaces = 0;
+            while (q + spaces < s.size() && isSpace(s[q + spaces]))
+                spaces++;
+
+            // Whitespace gives back characters until the statement can start
+            for (size_t k = spaces; k >= 1; k--)
+            {
+                const size_t start = q + k;
+                if (start >= s.size() || isLineEnd(s[start]))
+                    continue;
+
+                size_t end = start;
+                while (end < s.size() && !isLineEnd(s[end]))
+                    end++;
+
+                cmd.args[1] = s.substr(open, p - open);
+                cmd.args[2] = s.substr(start, end - start);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // ^next (\S+)
+    bool matchNext(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        return r.literal("next ") && r.run(isNonSpace, 1, cmd.args[1]);
+    }
+
+    // ^(\d+) (\w+) (.+) matching the whole string
+    bool matchChoice(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        return r.run(isDigit, 1, cmd.args[1]) && r.literal(" ") && r.run(isWord, 1, cmd.args[2]) && r.literal(" ") && r.rest(cmd.args[3]);
+    }
+
+    // ^auto (\w+)
+    bool matchAuto(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        return r.literal("auto ") && r.run(isWord, 1, cmd.args[1]);
+    }
+
+    // ^#.+ matching the whole string
+    bool matchAssign(const std::string &s, Command &cmd)
+    {
+        Reader r(s);
+        std::string rest;
+        return r.literal("#") && r.rest(rest);
+    }
+
+    bool found(Command &cmd, const COMMAND_TYPE type)
+    {
+        cmd.type = type;
+
+        // Integers are converted once here instead of by every handler
+        for (int i = 1; i < MAX_COMMAND_ARGS; i++)
+        {
+            const auto &arg = cmd.args[i];
+            if (arg.empty() || !std::all_of(arg.begin(), arg.end(), isDigit))
+                continue;
+
+            // Values that do not fit are left at 0
+            int value = 0;
+            const auto result = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+            if (result.ec == std::errc())
+                cmd.values[i] = value;
+        }
+
+        return true;
+    }
+}
+
+bool CommandParser::parse(const std::string &s, Command &cmd)
+{
+    cmd.type = COMMAND_TYPE::NONE;
+    for (auto &arg : cmd.args)
+        arg.clear();
+    std::fill(std::begin(cmd.values), std::end(cmd.values), 0);
+
+    if (s.empty())
+        return false;
+
+    // Failed matches may leave partial captures, which are cleared before the next candidate
+    auto reset = [&cmd]()
+    {
+        for (auto &arg : cmd.args)
+            arg.clear();
+    };
+
+    switch (s[0])
+    {
+    case 'w':
+        if (matchWait(s, cmd))
+            return found(cmd, COMMAND_TYPE::WAIT);
+        reset();
+        if (matchWipe(s, cmd))
+            return found(cmd, COMMAND_TYPE::WIPE);
+        break;
+
+    case 'f':
+        if (matchFrame(s, "frameon", cmd))
+            return found(cmd, COMMAND_TYPE::FRAMEON);
+        reset();
+        if (matchFrame(s, "frameoff", cmd))
+            return found(cmd, COMMAND_TYPE::FRAMEOFF);
+        reset();
+        if (matchImage(s, cmd))
+            return found(cmd, COMMAND_TYPE::IMAGE);
+        reset();
+        if (Reader(s).literal("fselect"))
+            return found(cmd, COMMAND_TYPE::FSELECT);
+        break;
+
+    case 'r':
+        if (matchRdraw(s, cmd))
+            return found(cmd, COMMAND_TYPE::RDRAW);
+        reset();
+        if (matchWipe(s, cmd))
+            return found(cmd, COMMAND_TYPE::WIPE);
+        break;
+
+    case 'p':
+        if (matchPcm(s, cmd))
+            return found(cmd, COMMAND_TYPE::PCM);
+        break;
+
+    case 'b':
+        if (matchBgm(s, cmd))
+            return found(cmd, COMMAND_TYPE::BGM);
+        reset();
+        if (matchImage(s, cmd))
+            return found(cmd, COMMAND_TYPE::IMAGE);
+        break;
+
+    case 's':
+        if (matchSe(s, cmd))
+            return found(cmd, COMMAND_TYPE::SE);
+        break;
+
+    case 'e':
+    case 'c':
+        if (matchImage(s, cmd))
+            return found(cmd, COMMAND_TYPE::IMAGE);
+        break;
+
+    case 'i':
+        if (matchIf(s, cmd))
+            return found(cmd, COMMAND_TYPE::IF);
+        break;
+
+    case 'n':
+        if (matchNext(s, cmd))
+            return found(cmd, COMMAND_TYPE::NEXT);
+        break;
+
+    case 'a':
+        if (matchAuto(s, cmd))
+            return found(cmd, COMMAND_TYPE::AUTO);
+        break;
+
+    case '#':
+        if (matchAssign(s, cmd))
+            return found(cmd, COMMAND_TYPE::ASSIGN);
+        break;
+
+    default:
+        if (isDigit(s[0]) && matchChoice(s, cmd))
+            return found(cmd, COMMAND_TYPE::CHOICE);
+        break;
+    }
+
+    reset();
+    return false;
+}
@@ -9,74 +9,100 @@ FileManager::FileManager()
 {
 }
 
+#ifdef LOWERCASE_ASSETS
+#define KIF_DB_LOWERCASE true
+#else
+#define KIF_DB_LOWERCASE false
+#endif
+
 // Assign pointer to SceneManager and start game by fetching KIF db
 void FileManager::init(SceneManager *sceneManager)
 {
+#ifndef __EMSCRIPTEN__
+    // A v2 DB is used straight from its mapping
+    kifDbMap = MappedFile(KIF_DB);
+    if (kifDbMap.isOpen() && kifDb.open(kifDbMap.data(), kifDbMap.size()))
+    {
+        openKifTable(sceneManager);
+        return;
+    }
+    kifDbMap = MappedFile();
+#endif
+
     fetchFileAndProcess(KIF_DB, this, &FileManager::parseKifDb, sceneManager);
 }
 
-// Parse a raw KIF database file and populate the KIF DB and table
-void FileManager::parseKifDb(byte *buf, size_t sz, SceneManager* sceneManager)
+// Keep a fetched KIF DB, converting it first if it is a v1 DB
+void FileManager::parseKifDb(byte *buf, size_t sz, SceneManager *sceneManager)
 {
-    std::vector<uint32> entryCountVec;
-
-    // Parse archive table
-    for (;;)
+    if (!loadKifDb(buf, sz, KIF_DB_LOWERCASE, kifDbData, kifDb))
     {
-        std::string fname(reinterpret_cast<const char *>(buf));
-        buf += fname.size() + 1;
-        if (fname.size() == 0)
-            // End of table
-            break;
-
-        entryCountVec.push_back(*(reinterpret_cast<uint32 *>(buf)));
-        buf += 4;
+        LOG_ERROR << "Invalid KIF DB";
+        return;
+    }
 
-        KifTableEntry kte{fname, *(reinterpret_cast<unsigned char *>(buf))};
-        buf += 1;
+    openKifTable(sceneManager);
+}
 
-        if (kte.IsEncrypted == '\x01')
-        {
-            // Copy key
-            memcpy(kte.FileKey, buf, 4);
-            buf += 4;
-        }
+// Populate the KIF table from the DB and start the game
+void FileManager::openKifTable(SceneManager *sceneManager)
+{
+    for (uint32_t i = 0; i < kifDb.getArchiveCount(); i++)
+    {
+        const auto &archive = kifDb.getArchive(i);
 
+        KifTableEntry kte{std::string(kifDb.getName(archive)), archive.IsEncrypted};
+        memcpy(kte.FileKey, archive.FileKey, 4);
         kifTable.push_back(kte);
-    }
 
-    // Parse archive item entries
-    for (std::size_t archiveIdx = 0; archiveIdx < entryCountVec.size(); archiveIdx++)
-    {
-        for (uint32 itemIdx = 0; itemIdx < entryCountVec[archiveIdx]; itemIdx++)
-        {
-            std::string fname(reinterpret_cast<const char *>(buf));
-            buf += fname.size() + 1;
+        // Key schedule is expensive, only do it once per archive
+        Blowfish bf;
+        if (kte.IsEncrypted == '\x01')
+            bf.SetKey(kte.FileKey, 4);
+        kifCiphers.push_back(bf);
+    }
 
-            KifDbEntry kde;
-            kde.Offset = *(reinterpret_cast<uint32 *>(buf));
-            buf += 4;
-            kde.Length = *(reinterpret_cast<uint32 *>(buf));
-            buf += 4;
-            kde.Index = archiveIdx;
+    LOG_INFO << "Opened " << kifDb.getEntryCount() << " KIF entries";
 
-#ifdef LOWERCASE_ASSETS
-            Utils::lowercase(fname);
+#ifndef __EMSCRIPTEN__
+    mapArchives();
 #endif
-            kifDb[fname] = kde;
-        }
-    }
-
-    LOG << "Parsed " << kifDb.size() << " KIF entries";
 
     // Start game
     sceneManager->start();
 }
 
+static std::string_view getExtension(const ASSET_EXT ext)
+{
+    switch (ext)
+    {
+    case ASSET_EXT::IMAGE:
+        return IMAGE_EXT;
+    case ASSET_EXT::SCRIPT:
+        return SCRIPT_EXT;
+    case ASSET_EXT::MUSIC:
+        return MUSIC_EXT;
+    case ASSET_EXT::PCM:
+        return PCM_EXT;
+    case ASSET_EXT::SE:
+        return SE_EXT;
+    default:
+        return {};
+    }
+}
+
+AssetId FileManager::findAsset(const std::string_view name, const ASSET_EXT ext) const
+{
+    const KifDbRecord *got = kifDb.find(name, getExtension(ext), KIF_DB_LOWERCASE);
+    return got != NULL ? kifDb.getId(*got) : ASSET_NONE;
+}
+
 // Read a local file and return its contents as a vector
 // Support optional starting offset and length
 std::vector<byte> FileManager::readFile(const std::string &fpath, uint64_t offset, uint64_t length)
 {
+    PROFILE_SCOPE(FETCH);
+
     // Use C-style for compatibility
     FILE *fp = fopen(fpath.c_str(), "rb");
     if (fp == NULL)
@@ -101,3 +127,48 @@ std::vector<byte> FileManager::readFile(const std::string &fpath, uint64_t offse
 
     return buf;
 }
+
+#ifndef __EMSCRIPTEN__
+
+// Map every archive in the KIF table once so assets can be served without reading
+// Archives that fail to map are left closed and fall back to readFile
+void FileManager::mapArchives()
+{
+    kifMaps.clear();
+    kifMaps.reserve(kifTable.size());
+
+    for (const auto &kte : kifTable)
+    {
+        kifMaps.emplace_back(ASSETS + kte.Filename);
+        if (!kifMaps.back().isOpen())
+            LOG_WARN << "Could not map archive " << kte.Filename;
+    }
+}
+
+// Take a buffer of at least the given size from the pool
+std::vector<byte> FileManager::acquireScratch(size_t sz)
+{
+    std::vector<byte> buf;
+    {
+        // Fetches may run on worker threads
+        std::lock_guard<std::mutex> lock(scratchMutex);
+        if (!scratchPool.empty())
+        {
+            buf = std::move(scratchPool.back());
+            scratchPool.pop_back();
+        }
+    }
+
+    // Does not reallocate once the buffer has grown to the largest asset size
+    buf.resize(sz);
+    return buf;
+}
+
+// Return a buffer to the pool for the next fetch
+void FileManager::releaseScratch(std::vector<byte> &&buf)
+{
+    std::lock_guard<std::mutex> lock(scratchMutex);
+    scratchPool.push_back(std::move(buf));
+}
+
+#endif
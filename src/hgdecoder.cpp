@@ -2,50 +2,286 @@
 #include <utils.hpp>
 #include <hgx2bmp.h>
 
+#include <zlib.h>
+
 #include <stdio.h>
 #include <string.h>
 
-// Decodes a frame and returns a vector of pixels rgbaBuffer
-std::vector<byte> HGDecoder::getPixelsFromFrame(Frame frame)
+// Pulls bytes out of a zlib stream through a small chunk buffer
+// The z_stream must not move once initialized so it lives on the heap
+struct HGDecoder::Inflater
 {
-    // Get locations of Data and Cmd
-    byte *RleData = reinterpret_cast<byte *>(frame.Img + 1);
-    byte *RleCmd = RleData + frame.Img->CompressedDataLength;
+    z_stream strm;
+    bool ready = false;
+    bool finished = true;
 
-    // Zlib decompress
-    auto RleDataDecompressed = Utils::zlibUncompress(frame.Img->DecompressedDataLength, RleData, frame.Img->CompressedDataLength);
-    if (RleDataDecompressed.empty())
+    byte chunk[INFLATE_CHUNK];
+    byte *pos = chunk;
+    byte *end = chunk;
+
+    Inflater()
     {
-        LOG << "RleData uncompress error";
-        return {};
+        memset(&strm, 0, sizeof(strm));
+        ready = inflateInit(&strm) == Z_OK;
     }
 
-    auto RleCmdDecompressed = Utils::zlibUncompress(frame.Img->DecompressedCmdLength, RleCmd, frame.Img->CompressedCmdLength);
-    if (RleCmdDecompressed.empty())
+    ~Inflater()
     {
-        LOG << "RleCmd uncompress error";
-        return {};
+        if (ready)
+            inflateEnd(&strm);
     }
 
-    // Calculate byte depth
-    int depthBytes = BYTE_DEPTH(frame.Stdinfo->BitDepth);
+    // Start reading a new stream, keeping zlib's internal state allocated
+    bool reset(byte *source, uint32 sourceLen)
+    {
+        if (!ready || inflateReset(&strm) != Z_OK)
+            return false;
+
+        strm.next_in = source;
+        strm.avail_in = sourceLen;
+        pos = end = chunk;
+        finished = false;
+        return true;
+    }
+
+    // Inflate up to len bytes into dest and return how many were produced
+    uint32 inflateInto(byte *dest, uint32 len)
+    {
+        if (finished)
+            return 0;
+
+        strm.next_out = dest;
+        strm.avail_out = len;
+
+        // Any error ends the stream, callers see it as running out of data
+        if (inflate(&strm, Z_NO_FLUSH) != Z_OK)
+            finished = true;
+
+        return len - strm.avail_out;
+    }
+
+    bool next(byte &b)
+    {
+        if (pos == end)
+        {
+            pos = chunk;
+            end = chunk + inflateInto(chunk, sizeof(chunk));
+            if (pos == end)
+                return false;
+        }
+
+        b = *pos++;
+        return true;
+    }
+
+    bool read(byte *dest, uint32 len)
+    {
+        while (len)
+        {
+            if (pos == end)
+            {
+                // Long runs skip the chunk buffer entirely
+                if (len >= sizeof(chunk))
+                {
+                    uint32 got = inflateInto(dest, len);
+                    if (got == 0)
+                        return false;
+
+                    dest += got;
+                    len -= got;
+                    continue;
+                }
+
+                pos = chunk;
+                end = chunk + inflateInto(chunk, sizeof(chunk));
+                if (pos == end)
+                    return false;
+            }
+
+            uint32 n = end - pos < len ? end - pos : len;
+            memcpy(dest, pos, n);
+            pos += n;
+            dest += n;
+            len -= n;
+        }
+
+        return true;
+    }
+};
+
+// Reads RLE commands bit by bit from an inflating stream
+// Mirrors asmodean's BitBuffer, including its handling of the end of the buffer
+class HGDecoder::StreamBitBuffer
+{
+public:
+    StreamBitBuffer(Inflater &stream, uint32 declaredLength) : stream{stream}, length{(int32)declaredLength}
+    {
+        // Empty stream, the first getBit reports the end instead of reading bits of no byte
+        if (!stream.next(current))
+        {
+            length = 0;
+            index = 8;
+        }
+    }
+
+    bool getBit()
+    {
+        if (index > 7)
+        {
+            if (--length <= 0)
+            {
+                length = 0;
+                return true;
+            }
+
+            // Stream ended before its declared length
+            if (!stream.next(current))
+            {
+                length = 0;
+                return true;
+            }
+
+            index = 0;
+        }
+
+        return (current >> index++) & 1;
+    }
+
+    uint32 getEliasGammaValue()
+    {
+        uint32 value, digits = 0;
+
+        while (!getBit())
+            digits++;
+
+        value = 1 << digits;
+
+        while (digits--)
+        {
+            if (getBit())
+                value |= 1 << digits;
+        }
+
+        if (length)
+            return value;
+        return INVALID_ELIAS_GAMMA;
+    }
 
-    uint32 szRgbaBuffer = frame.Stdinfo->Width * frame.Stdinfo->Height * depthBytes;
+private:
+    Inflater &stream;
+    int32 length;
+    uint32 index = 0;
+    byte current = 0;
+};
+
+HGDecoder::HGDecoder() : dataStream{new Inflater}, cmdStream{new Inflater}
+{
+}
+
+HGDecoder::~HGDecoder() = default;
+
+HGDecoder::HGDecoder(HGDecoder &&) = default;
+
+HGDecoder &HGDecoder::operator=(HGDecoder &&) = default;
+
+uint32 HGDecoder::getPixelsLength(const Frame &frame)
+{
+    uint32 szRgbaBuffer = frame.Stdinfo->Width * frame.Stdinfo->Height * BYTE_DEPTH(frame.Stdinfo->BitDepth);
     if (szRgbaBuffer < 1024)
     {
         szRgbaBuffer = 1024;
     }
-    std::vector<byte> rgbaBuffer(szRgbaBuffer);
+
+    return szRgbaBuffer;
+}
+
+// Decodes a frame into rgbaBuffer using the context's scratch buffers
+bool HGDecoder::decodeFrame(const Frame &frame, byte *rgbaBuffer, uint32 szRgbaBuffer)
+{
+    // Calculate byte depth
+    int depthBytes = BYTE_DEPTH(frame.Stdinfo->BitDepth);
+
+    if (szRgbaBuffer < getPixelsLength(frame))
+    {
+        LOG_ERROR << "Pixel buffer too small";
+        return false;
+    }
+
+    // Un-RLE buffer holds the whole image before the delta filter
+    if (unrleArena.size() < szRgbaBuffer)
+        unrleArena.resize(szRgbaBuffer);
+
+    uint32 unrleLength = 0;
+    if (!unrle(frame, unrleLength))
+    {
+        LOG_ERROR << "Unrle error";
+        return false;
+    }
 
     // Decode image
-    ReturnCode ret = ProcessImage(&RleDataDecompressed[0], frame.Img->DecompressedDataLength, &RleCmdDecompressed[0], frame.Img->DecompressedCmdLength, &rgbaBuffer[0], szRgbaBuffer, frame.Stdinfo->Width, frame.Stdinfo->Height, depthBytes, STRIDE(frame.Stdinfo->Width, depthBytes));
+    ReturnCode ret = ProcessUnrled(unrleArena.data(), unrleLength, rgbaBuffer, szRgbaBuffer, frame.Stdinfo->Width, frame.Stdinfo->Height, depthBytes, STRIDE(frame.Stdinfo->Width, depthBytes));
     if (ReturnCode::Success != ret)
     {
-        LOG << "ProcessImage error " << static_cast<int>(ret);
-        return {};
+        LOG_ERROR << "ProcessImage error " << static_cast<int>(ret);
+        return false;
+    }
+
+    return true;
+}
+
+// Inflates the RLE data and commands together and expands the runs into unrleArena
+// Neither stream is ever fully materialized
+bool HGDecoder::unrle(const Frame &frame, uint32 &unrleLength)
+{
+    // Get locations of Data and Cmd
+    byte *RleData = reinterpret_cast<byte *>(frame.Img + 1);
+    byte *RleCmd = RleData + frame.Img->CompressedDataLength;
+
+    if (!dataStream->reset(RleData, frame.Img->CompressedDataLength) || !cmdStream->reset(RleCmd, frame.Img->CompressedCmdLength))
+    {
+        LOG_ERROR << "Inflate init error";
+        return false;
+    }
+
+    StreamBitBuffer cmdBits(*cmdStream, frame.Img->DecompressedCmdLength);
+
+    bool copyFlag = cmdBits.getBit();
+
+    unrleLength = cmdBits.getEliasGammaValue();
+    if (unrleLength == INVALID_ELIAS_GAMMA || unrleLength > unrleArena.size())
+        return false;
+
+    byte *unrleBuffer = unrleArena.data();
+
+    uint32 n;
+    uint32 unrleLeft = unrleLength;
+    uint32 dataLeft = frame.Img->DecompressedDataLength;
+    for (uint32 i = 0; i < unrleLength; i += n)
+    {
+        n = cmdBits.getEliasGammaValue();
+
+        if (copyFlag)
+        {
+            // Out-of-range checks
+            if (unrleLeft < n || dataLeft < n)
+                return false;
+            dataLeft -= n;
+
+            if (!dataStream->read(unrleBuffer + i, n))
+                return false;
+        }
+        else
+        {
+            // Arena holds data from the previous decode
+            uint32 left = unrleLength - i;
+            memset(unrleBuffer + i, 0, n < left ? n : left);
+        }
+
+        unrleLeft -= n;
+        copyFlag = !copyFlag;
     }
 
-    return rgbaBuffer;
+    return true;
 }
 
 // Parses frame tags and returns a Frame struct pointing to the frame data
@@ -84,9 +320,10 @@ HGDecoder::Frame HGDecoder::getFrame(FrameTag *frameTag)
 }
 
 // Get a vector of Frame structures that contain pointers to frame data
-std::vector<HGDecoder::Frame> HGDecoder::getFrames(FrameHeader *frameHeader)
+// The vector is owned by the context and reused
+const std::vector<HGDecoder::Frame> &HGDecoder::parseFrames(FrameHeader *frameHeader)
 {
-    std::vector<Frame> frames;
+    frames.clear();
 
     while (1)
     {
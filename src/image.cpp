@@ -7,6 +7,9 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdio>
 
 // Clear the entire canvas
 void ImageManager::clearCanvas()
@@ -43,6 +46,24 @@ const json ImageManager::dump()
         {KEY_FW, fwLayer.dump()}};
 }
 
+void ImageManager::snapshot(StateWriter &writer)
+{
+    bgLayer.snapshot(writer);
+    egLayer.snapshot(writer);
+    cgLayer.snapshot(writer);
+    fwLayer.snapshot(writer);
+}
+
+void ImageManager::loadSnapshot(StateReader &reader)
+{
+    clearCanvas();
+
+    bgLayer.loadSnapshot(reader);
+    egLayer.loadSnapshot(reader);
+    cgLayer.loadSnapshot(reader);
+    fwLayer.loadSnapshot(reader);
+}
+
 ImageManager::ImageManager(FileManager &fm, SDL_Renderer *renderer, std::vector<Choice> &currChoices) : fileManager{fm}, renderer{renderer}, bgLayer{*this}, egLayer{*this}, cgLayer{*this}, fwLayer{*this}, fgLayer{*this}, currChoices{currChoices}
 {
     // Background color when rendering transparent textures
@@ -69,99 +90,125 @@ ImageManager::ImageManager(FileManager &fm, SDL_Renderer *renderer, std::vector<
         throw std::runtime_error("Could not open font");
     }
 
+    selectFont = TTF_OpenFont(SELECT_FONT_PATH, SELECT_FONT_SIZE);
+    if (selectFont == NULL)
+    {
+        throw std::runtime_error("Could not open select font");
+    }
+
     // Decode and cache choice selection asset
     processImage(sys_sel, sizeof(sys_sel), {SEL, 2});
 
-    // Decode and cache message window assets
-    processImage(sys_mwnd, sizeof(sys_mwnd), {MWND, 43});
-    processImage(sys_mwnd, sizeof(sys_mwnd), {MWND_DECO, 42});
+    // Decode and cache message window assets from the same file
+    processImageFrames(sys_mwnd, sizeof(sys_mwnd), {{MWND, 43}, {MWND_DECO, 42}});
+
+    // Embedded assets cannot be fetched again if evicted
+    textureCache.setPermanent(SEL);
+    textureCache.setPermanent(MWND);
+    textureCache.setPermanent(MWND_DECO);
 
     // LOG << "ImageManager initialized";
 }
 
-// Returns a pointer to a texture from a given frame
+// Returns a pointer to a texture created from decoded pixels
 // Caller is responsible for freeing the texture
-SDL_Texture *ImageManager::getTextureFromFrame(HGDecoder::Frame frame)
+SDL_Texture *ImageManager::getTextureFromPixels(const DecodedImage &decoded)
 {
-    auto rgbaVec = HGDecoder::getPixelsFromFrame(frame);
-    if (rgbaVec.empty())
+    const auto &pixels = decoded.first;
+    const auto &stdinfo = decoded.second;
+
+    // Same format an RGB surface with these masks would have, without creating one
+    Uint32 format = SDL_MasksToPixelFormatEnum(stdinfo.BitDepth, RMASK, GMASK, BMASK, AMASK);
+
+    SDL_Texture *texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STATIC, stdinfo.Width, stdinfo.Height);
+    if (texture == NULL)
     {
-        LOG << "Could not get pixels from frame";
+        LOG_ERROR << "Could not create texture: " << SDL_GetError();
         return NULL;
     }
 
-    // Pixel buffer must remain alive when using surface
-    SDL_Surface *surface = SDL_CreateRGBSurfaceFrom(rgbaVec.data(), frame.Stdinfo->Width, frame.Stdinfo->Height, frame.Stdinfo->BitDepth, PITCH(frame.Stdinfo->Width, frame.Stdinfo->BitDepth), RMASK, GMASK, BMASK, AMASK);
-
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+    // SDL_CreateTextureFromSurface enables blending for formats with alpha
+    if (SDL_ISPIXELFORMAT_ALPHA(format))
+    {
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    }
 
-    SDL_FreeSurface(surface);
+    SDL_UpdateTexture(texture, NULL, pixels.data(), PITCH(stdinfo.Width, stdinfo.BitDepth));
 
     return texture;
 }
 
-// Render the current speaker name
-void ImageManager::renderSpeaker(const std::string &text)
+// Take a decoder context from the pool
+HGDecoder ImageManager::acquireDecoder()
 {
-    if (text.empty())
-    {
-        return;
-    }
+    // Decoding runs on worker threads
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if (decoderPool.empty())
+        return HGDecoder();
+
+    HGDecoder decoder = std::move(decoderPool.back());
+    decoderPool.pop_back();
+    return decoder;
+}
 
-    // Render text
-    SDL_Surface *surface = TTF_RenderUTF8_Blended_Wrapped(font, ("[ " + text + " ]").c_str(), textColor, 0);
-    if (surface == NULL)
-    {
-        LOG << "TTF Surface failed!";
-        return;
-    }
+// Return a decoder context and its grown scratch buffers to the pool
+void ImageManager::releaseDecoder(HGDecoder &&decoder)
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    decoderPool.push_back(std::move(decoder));
+}
 
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    if (texture == NULL)
+// Take a pixel buffer of at least the given size from the pool
+std::vector<byte> ImageManager::acquirePixels(size_t sz)
+{
+    std::vector<byte> buf;
     {
-        LOG << "TTF texture failed!";
-        SDL_FreeSurface(surface);
-        return;
+        std::lock_guard<std::mutex> lock(poolMutex);
+        if (!pixelPool.empty())
+        {
+            buf = std::move(pixelPool.back());
+            pixelPool.pop_back();
+        }
     }
 
-    // Horizontally center text
-    SDL_Rect rect = {SPEAKER_XPOS, SPEAKER_YPOS, surface->w, surface->h};
-    SDL_RenderCopy(renderer, texture, NULL, &rect);
+    // Does not reallocate once the buffer has grown to the largest image size
+    buf.resize(sz);
+    return buf;
+}
 
-    SDL_DestroyTexture(texture);
-    SDL_FreeSurface(surface);
+// Return a pixel buffer once its texture has been uploaded
+void ImageManager::releasePixels(std::vector<byte> &&buf)
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+
+    // Many uploads can be queued at once, only keep enough buffers for steady state
+    if (pixelPool.size() < MAX_PIXEL_BUFFERS)
+        pixelPool.push_back(std::move(buf));
 }
 
-// Render text onto the message window
-void ImageManager::renderMessage(const std::string &text)
+// Render the current speaker name
+void ImageManager::renderSpeaker(const std::string &text)
 {
     if (text.empty())
     {
         return;
     }
 
-    // Render text
-    SDL_Surface *surface = TTF_RenderUTF8_Blended_Wrapped(font, text.c_str(), textColor, TEXTBOX_WIDTH);
-    if (surface == NULL)
-    {
-        LOG << "TTF Surface failed!";
-        return;
-    }
+    // Laid out once per speaker and drawn from cached glyphs after
+    const auto &layout = textRenderer.layout(font, "[ " + text + " ]", 0);
+    textRenderer.draw(layout, SPEAKER_XPOS, SPEAKER_YPOS, textColor);
+}
 
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    if (texture == NULL)
+// Render text onto the message window
+void ImageManager::renderMessage(const std::string &text)
+{
+    if (text.empty())
     {
-        LOG << "TTF texture failed!";
-        SDL_FreeSurface(surface);
         return;
     }
 
-    // Horizontally center text
-    SDL_Rect rect = {TEXT_XPOS, TEXT_YPOS, surface->w, surface->h};
-    SDL_RenderCopy(renderer, texture, NULL, &rect);
-
-    SDL_DestroyTexture(texture);
-    SDL_FreeSurface(surface);
+    const auto &layout = textRenderer.layout(font, text, TEXTBOX_WIDTH);
+    textRenderer.draw(layout, TEXT_XPOS, TEXT_YPOS, textColor);
 }
 
 // Render choice textures
@@ -181,11 +228,154 @@ void ImageManager::renderChoices()
     }
 }
 
+#ifdef PROFILE_ENABLE
+
+// Summarize the recent frames and pick the stage with the worst spikes to graph
+void ImageManager::updateProfilerText()
+{
+    const size_t count = Profiler::getFrameCount();
+    if (count == 0)
+        return;
+
+    constexpr int stageCount = static_cast<int>(PROFILE_STAGE::COUNT);
+    std::array<uint64_t, stageCount> maxNanos{};
+    std::array<uint64_t, stageCount> sumNanos{};
+
+    for (size_t age = 0; age < count; age++)
+    {
+        const auto &frame = Profiler::getFrame(age);
+        for (int i = 0; i < stageCount; i++)
+        {
+            maxNanos[i] = std::max(maxNanos[i], frame[i]);
+            sumNanos[i] += frame[i];
+        }
+    }
+
+    // The frame and tick contain most other stages so they would always rank first
+    std::vector<int> stages;
+    for (int i = static_cast<int>(PROFILE_STAGE::SECTION); i < stageCount; i++)
+    {
+        if (maxNanos[i] > 0)
+            stages.push_back(i);
+    }
+
+    std::sort(stages.begin(), stages.end(), [&maxNanos](const int a, const int b)
+              { return maxNanos[a] > maxNanos[b]; });
+
+    if (stages.size() > PROFILER_WORST_STAGES)
+        stages.resize(PROFILER_WORST_STAGES);
+
+    profilerStage = stages.empty() ? PROFILE_STAGE::TICK : static_cast<PROFILE_STAGE>(stages.front());
+
+    char line[64];
+    auto addLine = [&](const int i)
+    {
+        snprintf(line, sizeof(line), "%-10s avg %6.2f  max %6.2f ms\n",
+                 Profiler::getName(static_cast<PROFILE_STAGE>(i)), sumNanos[i] / 1e6 / count, maxNanos[i] / 1e6);
+        profilerText += line;
+    };
+
+    profilerText.clear();
+    addLine(static_cast<int>(PROFILE_STAGE::FRAME));
+    addLine(static_cast<int>(PROFILE_STAGE::TICK));
+    for (const int i : stages)
+        addLine(i);
+
+    if (Profiler::isTracing())
+        profilerText += "Tracing, press T to write " PROFILE_TRACE_FILE;
+}
+
+// Draw the time of a stage in each recent frame as bars, newest on the right
+void ImageManager::renderProfilerGraph(const PROFILE_STAGE stage, const int y)
+{
+    const size_t count = Profiler::getFrameCount();
+    const int width = PROFILE_FRAMES * PROFILER_BAR_WIDTH;
+    const double scale = PROFILER_GRAPH_HEIGHT / (2 * PROFILER_TARGET_MS);
+
+    SDL_Rect background = {0, y, width, PROFILER_GRAPH_HEIGHT};
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+    SDL_RenderFillRect(renderer, &background);
+
+    for (size_t age = 0; age < count; age++)
+    {
+        const double ms = Profiler::getFrame(age)[static_cast<int>(stage)] / 1e6;
+        const int h = std::min(PROFILER_GRAPH_HEIGHT, static_cast<int>(ms * scale));
+
+        // Bars over the frame target are red
+        if (ms > PROFILER_TARGET_MS)
+            SDL_SetRenderDrawColor(renderer, 230, 60, 60, 255);
+        else
+            SDL_SetRenderDrawColor(renderer, 80, 200, 120, 255);
+
+        SDL_Rect bar = {width - static_cast<int>(age + 1) * PROFILER_BAR_WIDTH, y + PROFILER_GRAPH_HEIGHT - h, PROFILER_BAR_WIDTH, h};
+        SDL_RenderFillRect(renderer, &bar);
+    }
+
+    const int targetY = y + PROFILER_GRAPH_HEIGHT / 2;
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 200);
+    SDL_RenderDrawLine(renderer, 0, targetY, width, targetY);
+
+    const auto &layout = textRenderer.layout(selectFont, Profiler::getName(stage), 0);
+    textRenderer.draw(layout, 4, y + 2, textColor);
+}
+
+// Draw frame times, the worst stage and a summary over the canvas
+void ImageManager::renderProfiler()
+{
+    if (Profiler::getFrameCount() == 0)
+        return;
+
+    if (profilerText.empty() || framestamp % PROFILER_REFRESH_FRAMES == 0)
+        updateProfilerText();
+
+    // Draw state is shared with the rest of rendering, so it is put back afterwards
+    SDL_BlendMode blendMode;
+    Uint8 r, g, b, a;
+    SDL_GetRenderDrawBlendMode(renderer, &blendMode);
+    SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
+
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+
+    renderProfilerGraph(PROFILE_STAGE::FRAME, 0);
+    renderProfilerGraph(profilerStage, PROFILER_GRAPH_HEIGHT + 4);
+
+    const int textY = 2 * PROFILER_GRAPH_HEIGHT + 8;
+    const auto &layout = textRenderer.layout(selectFont, profilerText, 0);
+
+    SDL_Rect background = {0, textY, layout.w + 8, layout.h + 4};
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+    SDL_RenderFillRect(renderer, &background);
+
+    textRenderer.draw(layout, 4, textY + 2, textColor);
+
+    // Restore the blend mode and clear color set at startup
+    SDL_SetRenderDrawBlendMode(renderer, blendMode);
+    SDL_SetRenderDrawColor(renderer, r, g, b, a);
+
+    // Keep redrawing so the graphs move
+    markDirty();
+}
+
+#endif
+
 // Render images in order of type precedence and z-index
-void ImageManager::render()
+// Returns false if the frame was skipped as nothing changed since the last one
+bool ImageManager::render()
 {
+    PROFILE_SCOPE(RENDER);
+
+    // Still counts as a frame so timings based on framestamps are kept
     framestamp++;
 
+    if (skipUnchanged && !dirty)
+    {
+        skippedFrames++;
+        return false;
+    }
+
+    // Images still animating mark the next frame dirty as they are rendered
+    dirty = false;
+
     // Clear render canvas
     SDL_RenderClear(renderer);
 
@@ -211,8 +401,18 @@ void ImageManager::render()
 
     renderChoices();
 
+#ifdef PROFILE_ENABLE
+    if (showProfiler)
+        renderProfiler();
+#endif
+
     // Update screen
-    SDL_RenderPresent(renderer);
+    {
+        PROFILE_SCOPE(PRESENT);
+        SDL_RenderPresent(renderer);
+    }
+
+    return true;
 }
 
 // Clear image of type at specified z index
@@ -423,45 +623,255 @@ void ImageManager::setImage(const IMAGE_TYPE type, const int zIndex, std::string
 void ImageManager::processImage(byte *buf, size_t sz, const ImageData &imageData)
 {
     const auto &name = imageData.name;
-    const auto &frameIdx = imageData.index;
     const Image *image = imageData.image;
 
     // Do not process if image was already passed
     if (image != NULL && image->baseName != name)
         return;
 
-    // Decode a raw HG buffer and cache the texture
+    DecodedImage decoded;
+    if (!decodeImage(buf, sz, imageData, decoded))
+        return;
+
+    cacheImage(name, imageData.index, decoded);
+}
+
+// Decode several frames of one HG buffer, caching each under its own name
+// The header is parsed once and all frames share a decoder context
+void ImageManager::processImageFrames(byte *buf, size_t sz, const std::vector<ImageData> &frames)
+{
+    if (frames.empty())
+        return;
+
+    HGDecoder decoder = acquireDecoder();
+
+    const auto *parsed = parseImage(decoder, buf, sz, frames.front().name);
+    if (parsed != NULL)
+    {
+        for (const auto &imageData : frames)
+        {
+            // Upload each frame before decoding the next so only one pixel buffer is held
+            DecodedImage decoded;
+            if (decodeFrame(decoder, *parsed, imageData, decoded))
+                cacheImage(imageData.name, imageData.index, decoded);
+        }
+    }
+
+    releaseDecoder(std::move(decoder));
+}
+
+// Worker callback when image has been fetched
+// Decodes off the main thread and posts the texture upload back to it
+void ImageManager::processImageAsync(byte *buf, size_t sz, const ImageData &imageData)
+{
+    const std::string name = imageData.name;
+    const int frameIdx = imageData.index;
+
+    // Skip decoding prefetches made stale by a script change
+    if (imageData.generation != 0 && imageData.generation != prefetchGeneration)
+    {
+        fileManager.getWorkerPool().post([this, name]()
+                                         {
+                                             // Image was requested on demand while the prefetch was in flight,
+                                             // and the demand fetch will complete it
+                                             auto got = pendingImages.find(name);
+                                             if (got != pendingImages.end() && got->second != 0)
+                                                 pendingImages.erase(got); });
+        return;
+    }
+
+    // Shared as tasks must be copyable
+    auto decoded = std::make_shared<DecodedImage>();
+    bool success = decodeImage(buf, sz, imageData, *decoded);
+
+    // Demand fetches are uploaded ahead of finished prefetches
+    fileManager.getWorkerPool().post([this, name, frameIdx, decoded, success]()
+                                     {
+                                         pendingImages.erase(name);
+
+                                         // A prefetch and a demand fetch of the same image may both finish
+                                         if (success && isCached(name))
+                                             releasePixels(std::move(decoded->first));
+
+                                         // Cache even if the requesting image has moved on as decoding is already done
+                                         else if (success)
+                                             cacheImage(name, frameIdx, *decoded); },
+                                     imageData.generation == 0);
+}
+
+// Decode a raw HG buffer into pixels of the requested frame
+// Does not touch SDL or the cache so it is safe to call from worker threads
+bool ImageManager::decodeImage(byte *buf, size_t sz, const ImageData &imageData, DecodedImage &decoded)
+{
+    // Scratch buffers of a pooled context are already sized from earlier decodes
+    HGDecoder decoder = acquireDecoder();
+
+    const auto *frames = parseImage(decoder, buf, sz, imageData.name);
+    bool success = frames != NULL && decodeFrame(decoder, *frames, imageData, decoded);
+
+    releaseDecoder(std::move(decoder));
+    return success;
+}
+
+// Verify a raw HG buffer and parse its frames into the decoder
+// Returns NULL if the buffer is not a valid image
+const std::vector<HGDecoder::Frame> *ImageManager::parseImage(HGDecoder &decoder, byte *buf, size_t sz, const std::string &name)
+{
     HGHeader *hgHeader = reinterpret_cast<HGHeader *>(buf);
 
     // Verify signature
     if (strncmp(hgHeader->FileSignature, IMAGE_SIGNATURE, sizeof(hgHeader->FileSignature)) != 0)
     {
-        LOG << "Invalid image file signature for " << name;
-        return;
+        LOG_ERROR << "Invalid image file signature for " << name;
+        return NULL;
     }
 
     // Retrieve frames
     FrameHeader *frameHeader = reinterpret_cast<FrameHeader *>(hgHeader + 1);
-    const auto &frames = HGDecoder::getFrames(frameHeader);
+    const auto &frames = decoder.parseFrames(frameHeader);
     if (frames.empty())
     {
-        LOG << "No frames found";
-        return;
+        LOG_ERROR << "No frames found";
+        return NULL;
     }
 
     if (frames.size() > 1)
     {
-        LOG << name << " contains " << frames.size() << " frames; Size: " << sz;
+        LOG_DEBUG << name << " contains " << frames.size() << " frames; Size: " << sz;
     }
 
-    auto &frame = frames[frameIdx];
+    return &frames;
+}
 
-    SDL_Texture *texture = getTextureFromFrame(frame);
+// Decode one of the parsed frames into a pooled pixel buffer
+bool ImageManager::decodeFrame(HGDecoder &decoder, const std::vector<HGDecoder::Frame> &frames, const ImageData &imageData, DecodedImage &decoded)
+{
+    const auto &name = imageData.name;
+    const auto &frameIdx = imageData.index;
 
-    // Store texture in cache
-    textureCache[name] = {texture, *frame.Stdinfo};
+    if (frameIdx < 0 || frameIdx >= frames.size())
+    {
+        LOG_WARN << "Frame " << frameIdx << " out of range for " << name;
+        return false;
+    }
+
+    const auto &frame = frames[frameIdx];
+
+    PROFILE_SCOPE(DECODE);
+    auto pixels = acquirePixels(HGDecoder::getPixelsLength(frame));
+    if (!decoder.decodeFrame(frame, pixels.data(), pixels.size()))
+    {
+        LOG_ERROR << "Could not get pixels from frame";
+        releasePixels(std::move(pixels));
+        return false;
+    }
 
-    LOG << "Cached: " << name << "[" << frameIdx << "]";
+    decoded = {std::move(pixels), *frame.Stdinfo};
+    return true;
+}
+
+// Upload decoded pixels and store the texture in cache
+// The pixel buffer is returned to the pool afterwards
+void ImageManager::cacheImage(const std::string &name, const int frameIdx, DecodedImage &decoded)
+{
+    PROFILE_SCOPE(UPLOAD);
+
+    // Interface sprites share atlas pages so consecutive draws can be batched
+    TextureAtlas::Slot slot;
+    if (name.compare(0, strlen(ATLAS_PREFIX), ATLAS_PREFIX) == 0 && atlas.add(renderer, decoded.first.data(), decoded.second, slot))
+    {
+        textureCache.insert(name, slot, decoded.second);
+    }
+    else
+    {
+        SDL_Texture *texture = getTextureFromPixels(decoded);
+        textureCache.insert(name, texture, decoded.second);
+    }
+
+    releasePixels(std::move(decoded.first));
+
+    LOG_DEBUG << "Cached: " << name << "[" << frameIdx << "]";
+
+    // Images waiting on this texture can now be drawn
+    markDirty();
+
+    trimCache();
+}
+
+// Evict textures over the cache budget, keeping any that are currently displayed
+void ImageManager::trimCache()
+{
+    if (textureCache.getBytes() <= textureCache.getBudget())
+        return;
+
+    std::unordered_set<std::string> inUse;
+    bgLayer.collectInUse(inUse);
+    egLayer.collectInUse(inUse);
+    cgLayer.collectInUse(inUse);
+    fwLayer.collectInUse(inUse);
+    fgLayer.collectInUse(inUse);
+    mwnd.collectInUse(inUse);
+    mwndDeco.collectInUse(inUse);
+
+    textureCache.trim(inUse);
+
+    LOG_DEBUG << "Texture cache: " << textureCache.getBytes() << " bytes, " << textureCache.getEvictions() << " evictions";
+}
+
+// Fetch and decode an image in the background
+// The texture is cached once its upload is run by processUploads
+void ImageManager::fetchImage(const ImageData &imageData)
+{
+    const auto &name = imageData.name;
+
+    // A prefetch may still be queued behind others, so a demand fetch of it starts its own
+    // Whichever finishes first is cached, and the demand survives cancellation of the prefetch
+    auto pending = pendingImages.find(name);
+    if (pending != pendingImages.end() && (imageData.generation != 0 || pending->second == 0))
+        return;
+
+    if (isCached(name))
+        return;
+
+    // Assets missing from the DB never complete so must not be marked pending
+    const AssetId asset = imageData.asset != ASSET_NONE ? imageData.asset : fileManager.findAsset(name, ASSET_EXT::IMAGE);
+    if (asset == ASSET_NONE)
+        return;
+
+    pendingImages[name] = imageData.generation;
+    fileManager.fetchAssetAsync(asset, this, &ImageManager::processImageAsync, imageData, imageData.generation == 0);
+}
+
+// Block until a background decode of the image has been uploaded
+// Needed where commands read image info right after setting it
+// WASM cannot block on the main thread and returns immediately
+void ImageManager::waitForImage(const std::string &name)
+{
+#ifndef __EMSCRIPTEN__
+    auto &workerPool = fileManager.getWorkerPool();
+    while (pendingImages.count(name))
+    {
+        // The demand fetch is uploaded first as its completion is urgent
+        if (workerPool.drain(uploadBudgetMs) > 0)
+            continue;
+
+        // Nothing left in flight so the fetch must have failed, allow retrying later
+        if (workerPool.idle())
+        {
+            pendingImages.erase(name);
+            break;
+        }
+
+        workerPool.waitCompletion();
+    }
+#endif
+}
+
+// Upload textures decoded in the background within the per-frame budget
+// Called once per main loop iteration
+void ImageManager::processUploads()
+{
+    fileManager.getWorkerPool().drain(uploadBudgetMs);
 }
 
 // Forcefully complete any transition/animation
@@ -477,6 +887,7 @@ void ImageManager::setRdraw(const unsigned int rdraw)
 {
     rdrawStart = getFramestamp();
     globalRdraw = rdraw;
+    markDirty();
 }
 
 void ImageManager::setShowMwnd()
@@ -484,11 +895,13 @@ void ImageManager::setShowMwnd()
     mwnd.blend(MWND_ALPHA);
     mwndDeco.blend(MAX_ALPHA);
     showMwnd = true;
+    markDirty();
 }
 
 void ImageManager::setHideMwnd()
 {
     showMwnd = false;
+    markDirty();
 }
 
 void ImageManager::setFrameon(const unsigned int frames)
@@ -505,11 +918,7 @@ void ImageManager::setFrameoff(const unsigned int frames)
 
 bool ImageManager::isCached(const std::string &name)
 {
-    auto pos = textureCache.find(name);
-    if (pos != textureCache.end())
-        return true;
-
-    return false;
+    return textureCache.contains(name);
 }
 
 // Create a new solid rectangle texture and cache it
@@ -521,31 +930,39 @@ void ImageManager::createSolid(const std::string &name, const int width, const i
     SDL_Surface *surface = SDL_CreateRGBSurface(0, width, height, 32, 0xFF0000, 0xFF00, 0xFF, 0xFF000000);
     SDL_FillRect(surface, NULL, color);
 
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+    SDL_Texture *texture;
+    {
+        PROFILE_SCOPE(UPLOAD);
+        texture = SDL_CreateTextureFromSurface(renderer, surface);
+    }
     Stdinfo stdinfo = {static_cast<uint32>(width), static_cast<uint32>(height)};
 
-    textureCache[name] = {texture, stdinfo};
+    textureCache.insert(name, texture, stdinfo);
 
     SDL_FreeSurface(surface);
+
+    markDirty();
+
+    trimCache();
 }
 
 void ImageManager::fetch(const std::string &baseName)
 {
-    if (isCached(baseName))
-        return;
-
-    getFileManager().fetchAssetAndProcess(baseName + IMAGE_EXT, this, &ImageManager::processImage, ImageData{baseName, 0, NULL});
+    fetchImage(ImageData{baseName, 0, NULL});
 }
 
+// Fetch an image ahead of time, or the parts of a CG given its raw name
+// Skipped if cancelled before decoding starts
 void ImageManager::prefetch(const std::string &asset)
 {
-    fetch(asset);
+    const unsigned int generation = prefetchGeneration;
+
+    fetchImage(ImageData{asset, 0, NULL, generation});
 
     const auto cgArgs = Cg::getCgArgs(asset);
     if (cgArgs.size() != 3)
         return;
 
-    fetch(cgArgs[0]);
-    fetch(cgArgs[1]);
-    fetch(cgArgs[2]);
+    for (const auto &cgArg : cgArgs)
+        fetchImage(ImageData{cgArg, 0, NULL, generation});
 }
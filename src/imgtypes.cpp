@@ -18,13 +18,14 @@ Choice::Choice(ImageManager &imageManager, const std::string &t, const std::stri
 void Image::update(const std::string &name, int x, int y)
 {
     // Ensure that the asset exists in db
-    if (!imageManager.getFileManager().inDB(name + IMAGE_EXT))
+    const AssetId asset = imageManager.getFileManager().findAsset(name, ASSET_EXT::IMAGE);
+    if (asset == ASSET_NONE)
     {
         // clear();
         return;
     }
 
-    set(name, x, y);
+    set(name, x, y, asset);
     fetch();
 }
 
@@ -37,7 +38,7 @@ void Image::clear()
     blend(255);
 }
 
-void Image::set(const std::string &name, int x, int y)
+void Image::set(const std::string &name, int x, int y, const AssetId asset)
 {
     if (name != baseName)
         transitioning = true;
@@ -51,8 +52,11 @@ void Image::set(const std::string &name, int x, int y)
     moving = false;
 
     baseName = name;
+    assetId = asset;
     xShift = x;
     yShift = y;
+
+    imageManager.markDirty();
 }
 
 bool Image::isCached()
@@ -63,14 +67,8 @@ bool Image::isCached()
 // Fetch and cache the current image
 void Image::fetch()
 {
-    // Prevent fetching already cached images
-    if (isCached())
-        return;
-
-    // Initialize cache entry with NULL (more efficient but prevents failed fetches from retrying)
-    // textureCache[name];
-
-    imageManager.getFileManager().fetchAssetAndProcess(baseName + IMAGE_EXT, &imageManager, &ImageManager::processImage, ImageData{baseName, 0, this});
+    // Already cached or pending images are skipped
+    imageManager.fetchImage(ImageData{baseName, 0, this, 0, assetId});
 }
 
 void Choice::render(const int y)
@@ -80,6 +78,12 @@ void Choice::render(const int y)
     renderText(xShift, y);
 }
 
+void Image::blend(const unsigned int target)
+{
+    targetAlpha = target;
+    imageManager.markDirty();
+}
+
 void Image::fade(const unsigned int frames, const Uint8 start, const Uint8 end)
 {
     fadeFrames = frames;
@@ -87,6 +91,8 @@ void Image::fade(const unsigned int frames, const Uint8 start, const Uint8 end)
     startAlpha = start;
     targetAlpha = end;
     fading = true;
+
+    imageManager.markDirty();
 }
 
 void Image::move(const unsigned int rdraw, const int x, const int y)
@@ -96,6 +102,8 @@ void Image::move(const unsigned int rdraw, const int x, const int y)
     targetXShift = x;
     targetYShift = y;
     moving = true;
+
+    imageManager.markDirty();
 }
 
 // Internal function to render the image
@@ -105,25 +113,25 @@ void Image::display(std::string &name, long xPos, long yPos, const Uint8 alpha,
         return;
 
     // Look for texture in cache
-    auto got = textureCache.find(name);
-    if (got == textureCache.end())
+    const auto *textureDataPtr = textureCache.get(name);
+    if (textureDataPtr == NULL)
     {
-        LOG << "Cannot find in cache " << name;
+        LOG_WARN_LIMITED << "Cannot find in cache " << name;
         return;
     }
 
-    const auto &textureData = got->second;
+    const auto &textureData = *textureDataPtr;
 
-    auto texture = textureData.first;
+    auto texture = textureData.texture;
     if (texture == NULL)
     {
-        LOG << "NULL texture in cache";
+        LOG_WARN_LIMITED << "NULL texture in cache";
         return;
     }
 
     SDL_SetTextureAlphaMod(texture, alpha);
 
-    auto &stdinfo = textureData.second;
+    auto &stdinfo = textureData.stdinfo;
 
     if (!absolute)
     {
@@ -137,7 +145,7 @@ void Image::display(std::string &name, long xPos, long yPos, const Uint8 alpha,
 
     // Render onto canvas
     SDL_Rect DestR{xPos, yPos, static_cast<int>(stdinfo.Width), static_cast<int>(stdinfo.Height)};
-    SDL_RenderCopyEx(renderer, texture, NULL, &DestR, 0, 0, RENDERER_FLIP_MODE);
+    SDL_RenderCopyEx(renderer, texture, &textureData.rect, &DestR, 0, 0, RENDERER_FLIP_MODE);
 }
 
 const Stdinfo Image::getStdinfo()
@@ -145,13 +153,14 @@ const Stdinfo Image::getStdinfo()
     if (baseName.empty())
         return {};
 
-    auto got = textureCache.find(baseName);
-    if (got == textureCache.end())
-        return {};
+    // Info is only known once the image is decoded
+    imageManager.waitForImage(baseName);
 
-    const auto &textureData = got->second;
+    const auto *textureData = textureCache.get(baseName);
+    if (textureData == NULL)
+        return {};
 
-    return textureData.second;
+    return textureData->stdinfo;
 }
 
 double easeInOutQuad(double x)
@@ -208,8 +217,14 @@ void Image::render(int x, int y)
     }
 
     // LOG << baseName << prevTargetAlpha << prevBaseName << prevAlphaInverse;
-    display(prevBaseName, prevXShift, prevYShift, prevTargetAlpha - prevAlphaInverse);
+    // Previous image is fully faded out once the transition ends
+    if (transitioning)
+        display(prevBaseName, prevXShift, prevYShift, prevTargetAlpha - prevAlphaInverse);
     display(baseName, x, y, alpha);
+
+    // Keep drawing until the animation is done
+    if (transitioning || fading || moving)
+        imageManager.markDirty();
 }
 
 // Render image with the member offsets by default
@@ -218,6 +233,17 @@ void Image::render()
     render(xShift, yShift);
 }
 
+// Add the names of textures this image currently displays
+// The previous image is only displayed while transitioning
+void Image::collectInUse(std::unordered_set<std::string> &names)
+{
+    if (!baseName.empty())
+        names.insert(baseName);
+
+    if (transitioning && !prevBaseName.empty())
+        names.insert(prevBaseName);
+}
+
 const json Image::dump()
 {
     return {
@@ -235,36 +261,31 @@ const json Cg::dump()
         {KEY_YSHIFT, Base::yShift}};
 }
 
+void Image::snapshot(StateWriter &writer)
+{
+    writer.write(baseName);
+    writer.write<int32_t>(xShift);
+    writer.write<int32_t>(yShift);
+}
+
+void Cg::snapshot(StateWriter &writer)
+{
+    writer.write(rawName);
+    writer.write<int32_t>(Base::xShift);
+    writer.write<int32_t>(Base::yShift);
+}
+
 // Render text for a selection box
 void Choice::renderText(const int xShift, const int yShift)
 {
-    static TTF_Font *selectFont = TTF_OpenFont(SELECT_FONT_PATH, SELECT_FONT_SIZE);
-
     if (prompt.empty())
         return;
 
-    // Render text
-    SDL_Surface *surface = TTF_RenderUTF8_Blended_Wrapped(selectFont, prompt.c_str(), {0, 0, 0, 255}, 0);
-    if (surface == NULL)
-    {
-        LOG << "TTF Surface failed!";
-        return;
-    }
-
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-    if (texture == NULL)
-    {
-        LOG << "TTF texture failed!";
-        SDL_FreeSurface(surface);
-        return;
-    }
+    auto &textRenderer = imageManager.getTextRenderer();
+    const auto &layout = textRenderer.layout(imageManager.getSelectFont(), prompt, 0);
 
     // Center text in select box
-    SDL_Rect rect = {xShift + (SEL_WIDTH / 2 - surface->w / 2), yShift + (SEL_HEIGHT / 2 - surface->h / 2), surface->w, surface->h};
-    SDL_RenderCopy(renderer, texture, NULL, &rect);
-
-    SDL_DestroyTexture(texture);
-    SDL_FreeSurface(surface);
+    textRenderer.draw(layout, xShift + (SEL_WIDTH / 2 - layout.w / 2), yShift + (SEL_HEIGHT / 2 - layout.h / 2), {0, 0, 0, 255});
 }
 
 void Cg::render()
@@ -278,6 +299,13 @@ void Cg::render()
     Part2::render();
 }
 
+void Cg::collectInUse(std::unordered_set<std::string> &names)
+{
+    Base::collectInUse(names);
+    Part1::collectInUse(names);
+    Part2::collectInUse(names);
+}
+
 void Cg::clear()
 {
     rawName.clear();
@@ -355,3 +383,97 @@ void Cg::update(const std::string &rawName, int x, int y)
     Part1::update(cgArgs[1], x, y);
     Part2::update(cgArgs[2], x, y);
 }
+
+const TextureData *TextureCache::get(const std::string &name)
+{
+    auto got = entries.find(name);
+    if (got == entries.end())
+    {
+        misses++;
+        return NULL;
+    }
+
+    hits++;
+
+    // Move to front as most recently used
+    auto &entry = got->second;
+    lru.splice(lru.begin(), lru, entry.lruPos);
+
+    return &entry.textureData;
+}
+
+void TextureCache::insert(const std::string &name, SDL_Texture *texture, const Stdinfo &stdinfo)
+{
+    store(name, {texture, stdinfo, {0, 0, static_cast<int>(stdinfo.Width), static_cast<int>(stdinfo.Height)}, -1});
+}
+
+void TextureCache::insert(const std::string &name, const TextureAtlas::Slot &slot, const Stdinfo &stdinfo)
+{
+    store(name, {atlas.getTexture(slot.page), stdinfo, slot.rect, slot.page});
+}
+
+void TextureCache::store(const std::string &name, const TextureData &textureData)
+{
+    const auto &stdinfo = textureData.stdinfo;
+
+    // Solid colors have no bit depth, assume 32 bits
+    // Packed images are charged with their page instead
+    const size_t depthBytes = stdinfo.BitDepth ? BYTE_DEPTH(stdinfo.BitDepth) : 4;
+    const size_t sz = textureData.page >= 0 ? 0 : static_cast<size_t>(stdinfo.Width) * stdinfo.Height * depthBytes;
+
+    auto got = entries.find(name);
+    if (got != entries.end())
+    {
+        auto &entry = got->second;
+        if (entry.textureData.page >= 0 || entry.textureData.texture != textureData.texture)
+            destroy(entry.textureData);
+
+        bytes = bytes - entry.bytes + sz;
+        entry.textureData = textureData;
+        entry.bytes = sz;
+        lru.splice(lru.begin(), lru, entry.lruPos);
+        return;
+    }
+
+    lru.push_front(name);
+    entries.emplace(name, Entry{textureData, sz, lru.begin(), false});
+    bytes += sz;
+}
+
+void TextureCache::destroy(const TextureData &textureData)
+{
+    if (textureData.page >= 0)
+        atlas.release(textureData.page);
+    else if (textureData.texture != NULL)
+        SDL_DestroyTexture(textureData.texture);
+}
+
+void TextureCache::setPermanent(const std::string &name)
+{
+    auto got = entries.find(name);
+    if (got != entries.end())
+        got->second.permanent = true;
+}
+
+void TextureCache::trim(const std::unordered_set<std::string> &pinned)
+{
+    // Walk from least recently used
+    auto it = lru.end();
+    while (getBytes() > budget && it != lru.begin())
+    {
+        --it;
+
+        auto got = entries.find(*it);
+        auto &entry = got->second;
+        if (entry.permanent || pinned.count(*it))
+            continue;
+
+        destroy(entry.textureData);
+
+        bytes -= entry.bytes;
+        evictions++;
+
+        entries.erase(got);
+        it = lru.erase(it);
+    }
+}
@@ -0,0 +1,307 @@
+#include <kifdb.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+// Buckets are the top bits of the hash so they follow the order of the entry table
+static uint32_t bucketOf(const uint32_t hash, const uint32_t bits)
+{
+    return bits == 0 ? 0 : hash >> (32 - bits);
+}
+
+// Check a range of the pool holds a NUL terminated name
+static bool validName(const uint32_t offset, const uint32_t length, const char *pool, const uint32_t poolSize)
+{
+    return static_cast<uint64_t>(offset) + length < poolSize && pool[offset + length] == '\0';
+}
+
+bool KifDbView::open(const byte *buf, const size_t sz)
+{
+    header = nullptr;
+
+    if (sz < sizeof(KifDbHeader))
+        return false;
+
+    const auto *h = reinterpret_cast<const KifDbHeader *>(buf);
+    if (memcmp(h->Signature, KIFDB_SIGNATURE, sizeof(h->Signature)) != 0 || h->Version != KIFDB_VERSION)
+        return false;
+
+    // Tables must lie within the buffer and stay aligned for in place access
+    const uint64_t archivesEnd = h->ArchiveTableOffset + static_cast<uint64_t>(h->ArchiveCount) * sizeof(KifDbArchive);
+    const uint64_t recordsEnd = h->EntryTableOffset + static_cast<uint64_t>(h->EntryCount) * sizeof(KifDbRecord);
+    const uint64_t poolEnd = h->StringPoolOffset + static_cast<uint64_t>(h->StringPoolSize);
+    if (archivesEnd > sz || recordsEnd > sz || poolEnd > sz || h->BucketBits > KIFDB_MAX_BUCKET_BITS)
+        return false;
+
+    const uint64_t bucketsEnd = h->BucketTableOffset + ((1ull << h->BucketBits) + 1) * sizeof(uint32_t);
+    if (bucketsEnd > sz || (h->ArchiveTableOffset | h->EntryTableOffset | h->BucketTableOffset) % 4 != 0)
+        return false;
+
+    const auto *a = reinterpret_cast<const KifDbArchive *>(buf + h->ArchiveTableOffset);
+    const auto *p = reinterpret_cast<const char *>(buf + h->StringPoolOffset);
+
+    // Only a handful of archives so they are checked up front, entries are checked as they are looked up
+    for (uint32_t i = 0; i < h->ArchiveCount; i++)
+    {
+        if (!validName(a[i].NameOffset, a[i].NameLength, p, h->StringPoolSize))
+            return false;
+    }
+
+    header = h;
+    archives = a;
+    records = reinterpret_cast<const KifDbRecord *>(buf + h->EntryTableOffset);
+    buckets = reinterpret_cast<const uint32_t *>(buf + h->BucketTableOffset);
+    pool = p;
+    return true;
+}
+
+std::string_view KifDbView::getName(const KifDbRecord &record) const
+{
+    if (!validName(record.NameOffset, record.NameLength, pool, header->StringPoolSize))
+        return {};
+
+    return {pool + record.NameOffset, record.NameLength};
+}
+
+// ASCII only, same as tolower in the C locale the v1 names are lowercased in
+static char foldCase(const char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// Hash of a name as if it were lowercased first
+static uint32_t foldedHash(const std::string_view name, uint32_t hash)
+{
+    for (const char c : name)
+    {
+        hash ^= static_cast<unsigned char>(foldCase(c));
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool foldedEqual(const char *stored, const std::string_view name)
+{
+    for (size_t i = 0; i < name.size(); i++)
+    {
+        if (stored[i] != foldCase(name[i]))
+            return false;
+    }
+    return true;
+}
+
+const KifDbRecord *KifDbView::find(const std::string_view name, const std::string_view ext, const bool fold) const
+{
+    if (!isOpen())
+        return NULL;
+
+    const uint32_t hash = fold ? foldedHash(ext, foldedHash(name, 2166136261u)) : kifDbHash(ext, kifDbHash(name));
+    const uint32_t bucket = bucketOf(hash, header->BucketBits);
+
+    // Bucket bounds are only trusted as far as the entry table goes
+    const uint32_t last = std::min(buckets[bucket + 1], header->EntryCount);
+    for (uint32_t i = buckets[bucket]; i < last && records[i].Hash <= hash; i++)
+    {
+        const auto &record = records[i];
+        if (record.Hash != hash || record.NameLength != name.size() + ext.size() || record.Index >= header->ArchiveCount)
+            continue;
+
+        // Names that run outside the pool come back empty
+        const auto stored = getName(record);
+        if (stored.size() != record.NameLength)
+            continue;
+
+        const bool equal = fold ? foldedEqual(stored.data(), name) && foldedEqual(stored.data() + name.size(), ext)
+                                : stored.compare(0, name.size(), name) == 0 && stored.compare(name.size(), ext.size(), ext) == 0;
+        if (equal)
+            return &record;
+    }
+
+    return NULL;
+}
+
+void KifDbBuilder::addArchive(const std::string &name, const bool encrypted, const byte *key)
+{
+    Archive archive{name, encrypted, {}};
+    if (encrypted)
+        memcpy(archive.key, key, sizeof(archive.key));
+
+    archives.push_back(archive);
+}
+
+void KifDbBuilder::addEntry(const std::string &name, const uint32_t offset, const uint32_t length, const uint32_t index)
+{
+    const auto got = entryIndices.find(name);
+    if (got != entryIndices.end())
+    {
+        entries[got->second] = {name, offset, length, index};
+        duplicates++;
+        return;
+    }
+
+    entryIndices.emplace(name, entries.size());
+    entries.push_back({name, offset, length, index});
+}
+
+std::vector<byte> KifDbBuilder::build() const
+{
+    KifDbHeader header = {};
+    memcpy(header.Signature, KIFDB_SIGNATURE, sizeof(header.Signature));
+    header.Version = KIFDB_VERSION;
+    header.ArchiveCount = archives.size();
+    header.EntryCount = entries.size();
+    header.ArchiveTableOffset = sizeof(KifDbHeader);
+    header.EntryTableOffset = header.ArchiveTableOffset + header.ArchiveCount * sizeof(KifDbArchive);
+    header.StringPoolOffset = header.EntryTableOffset + header.EntryCount * sizeof(KifDbRecord);
+
+    std::string pool;
+    auto addName = [&pool](const std::string &name)
+    {
+        const uint32_t offset = pool.size();
+        pool += name;
+        pool += '\0';
+        return offset;
+    };
+
+    std::vector<KifDbArchive> archiveTable;
+    for (const auto &archive : archives)
+    {
+        KifDbArchive kda = {};
+        kda.NameOffset = addName(archive.name);
+        kda.NameLength = archive.name.size();
+        kda.IsEncrypted = archive.encrypted ? 1 : 0;
+        memcpy(kda.FileKey, archive.key, sizeof(kda.FileKey));
+        archiveTable.push_back(kda);
+    }
+
+    std::vector<KifDbRecord> recordTable;
+    for (const auto &entry : entries)
+    {
+        const uint32_t offset = addName(entry.name);
+        recordTable.push_back({kifDbHash(entry.name), offset, static_cast<uint32_t>(entry.name.size()), entry.offset, entry.length, entry.index});
+    }
+
+    // Names only break ties between equal hashes so lookups can stop at the first mismatch
+    std::sort(recordTable.begin(), recordTable.end(), [&pool](const KifDbRecord &a, const KifDbRecord &b)
+              {
+                  if (a.Hash != b.Hash)
+                      return a.Hash < b.Hash;
+                  return strcmp(pool.c_str() + a.NameOffset, pool.c_str() + b.NameOffset) < 0; });
+
+    header.StringPoolSize = pool.size();
+
+    // About one record per bucket
+    while (header.BucketBits < KIFDB_MAX_BUCKET_BITS && (1u << header.BucketBits) < recordTable.size())
+        header.BucketBits++;
+
+    std::vector<uint32_t> bucketTable((1u << header.BucketBits) + 1);
+    size_t next = 0;
+    for (uint32_t b = 0; b < bucketTable.size(); b++)
+    {
+        while (next < recordTable.size() && bucketOf(recordTable[next].Hash, header.BucketBits) < b)
+            next++;
+        bucketTable[b] = next;
+    }
+
+    header.BucketTableOffset = (header.StringPoolOffset + pool.size() + 3) & ~3u;
+
+    std::vector<byte> out(header.BucketTableOffset + bucketTable.size() * sizeof(uint32_t));
+    memcpy(out.data(), &header, sizeof(header));
+    memcpy(out.data() + header.ArchiveTableOffset, archiveTable.data(), archiveTable.size() * sizeof(KifDbArchive));
+    memcpy(out.data() + header.EntryTableOffset, recordTable.data(), recordTable.size() * sizeof(KifDbRecord));
+    memcpy(out.data() + header.StringPoolOffset, pool.data(), pool.size());
+    memcpy(out.data() + header.BucketTableOffset, bucketTable.data(), bucketTable.size() * sizeof(uint32_t));
+
+    return out;
+}
+
+bool readKifDbV1(const byte *buf, const size_t sz, const bool lowercase, KifDbBuilder &builder)
+{
+    const byte *end = buf + sz;
+
+    // Read a NUL terminated string, false if it runs past the end
+    auto readString = [&buf, end](std::string &s)
+    {
+        const byte *nul = static_cast<const byte *>(memchr(buf, '\0', end - buf));
+        if (nul == NULL)
+            return false;
+
+        s.assign(reinterpret_cast<const char *>(buf), nul - buf);
+        buf = nul + 1;
+        return true;
+    };
+
+    auto readU32 = [&buf, end](uint32_t &v)
+    {
+        if (end - buf < 4)
+            return false;
+
+        memcpy(&v, buf, 4);
+        buf += 4;
+        return true;
+    };
+
+    // Archive table
+    std::vector<uint32_t> entryCounts;
+    std::string name;
+    for (;;)
+    {
+        if (!readString(name))
+            return false;
+
+        // End of table
+        if (name.empty())
+            break;
+
+        uint32_t count;
+        if (!readU32(count) || buf == end)
+            return false;
+        entryCounts.push_back(count);
+
+        const bool encrypted = *buf++ == '\x01';
+        if (encrypted && end - buf < 4)
+            return false;
+
+        builder.addArchive(name, encrypted, buf);
+        if (encrypted)
+            buf += 4;
+    }
+
+    // Entries of each archive
+    for (uint32_t archiveIdx = 0; archiveIdx < entryCounts.size(); archiveIdx++)
+    {
+        for (uint32_t itemIdx = 0; itemIdx < entryCounts[archiveIdx]; itemIdx++)
+        {
+            uint32_t offset, length;
+            if (!readString(name) || !readU32(offset) || !readU32(length))
+                return false;
+
+            if (lowercase)
+            {
+                for (auto &c : name)
+                    c = tolower(static_cast<unsigned char>(c));
+            }
+
+            builder.addEntry(name, offset, length, archiveIdx);
+        }
+    }
+
+    return true;
+}
+
+bool loadKifDb(const byte *buf, const size_t sz, const bool lowercase, std::vector<byte> &storage, KifDbView &view)
+{
+    if (sz >= sizeof(KifDbHeader) && memcmp(buf, KIFDB_SIGNATURE, 4) == 0)
+    {
+        storage.assign(buf, buf + sz);
+        return view.open(storage.data(), storage.size());
+    }
+
+    KifDbBuilder builder;
+    if (!readKifDbV1(buf, sz, lowercase, builder))
+        return false;
+
+    storage = builder.build();
+    return view.open(storage.data(), storage.size());
+}
@@ -0,0 +1,236 @@
+#include <log.hpp>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+#include <chrono>
+
+static const char *levelPrefix(const int level)
+{
+    switch (level)
+    {
+    case LOG_LEVEL_DEBUG:
+        return "[DEBUG] ";
+    case LOG_LEVEL_WARN:
+        return "[WARN] ";
+    case LOG_LEVEL_ERROR:
+        return "[ERROR] ";
+    default:
+        return "[LOG] ";
+    }
+}
+
+static uint32_t nowMs()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Set once the sink is destroyed at exit so later lines are written directly
+static std::atomic<bool> sinkClosed{false};
+
+static void writeLines(const std::string &lines)
+{
+    if (lines.empty())
+        return;
+
+#ifdef __EMSCRIPTEN__
+    // Lines end in a newline that console.log adds itself
+    EM_ASM(
+        {
+            console.log(Module.UTF8ToString($0, $1));
+        },
+        lines.c_str(), lines.size() - 1);
+#else
+    fwrite(lines.data(), 1, lines.size(), stdout);
+    fflush(stdout);
+#endif
+}
+
+// Collects submitted lines and writes them in batches
+class LogSink
+{
+public:
+#ifdef __EMSCRIPTEN__
+    ~LogSink()
+    {
+        sinkClosed = true;
+        writeLines(pending);
+    }
+
+    void submit(const int level, const char *line, const size_t len)
+    {
+        pending.append(line, len);
+        pending += '\n';
+
+        if (level >= LOG_LEVEL_ERROR)
+            flush();
+    }
+
+    void flush()
+    {
+        writeLines(pending);
+        pending.clear();
+    }
+#else
+    LogSink() : thread{&LogSink::run, this} {}
+
+    ~LogSink()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cond.notify_one();
+        thread.join();
+
+        sinkClosed = true;
+    }
+
+    void submit(const int level, const char *line, const size_t len)
+    {
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            wake = pending.empty() || level >= LOG_LEVEL_WARN;
+            if (level >= LOG_LEVEL_WARN)
+                urgent = true;
+
+            pending.append(line, len);
+            pending += '\n';
+        }
+
+        // The sink is already awake if lines were pending
+        if (wake)
+            cond.notify_one();
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        writeLines(pending);
+        pending.clear();
+    }
+#endif
+
+private:
+    std::string pending;
+
+#ifndef __EMSCRIPTEN__
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stopping = false;
+    bool urgent = false;
+
+    // Swapped with the pending lines so both keep their capacity
+    std::string writing;
+
+    std::thread thread;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            cond.wait(lock, [this]
+                      { return stopping || !pending.empty(); });
+
+            // Let a burst of lines gather so they are written together
+            cond.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS), [this]
+                          { return stopping || urgent; });
+
+            writing.swap(pending);
+            urgent = false;
+
+            lock.unlock();
+            writeLines(writing);
+            writing.clear();
+            lock.lock();
+
+            if (stopping && pending.empty())
+                return;
+        }
+    }
+#endif
+};
+
+// Created on first use so lines logged while other statics are constructed are kept
+static LogSink &getSink()
+{
+    static LogSink sink;
+    return sink;
+}
+
+std::string &Logger::buffer()
+{
+    thread_local std::string buf;
+    return buf;
+}
+
+Logger::Line::Line(const int level) : level{level}, active{true}, start{buffer().size()}
+{
+    buffer() += levelPrefix(level);
+}
+
+Logger::Line::Line(const int level, Site &site) : level{level}, active{true}, start{buffer().size()}
+{
+    const uint32_t now = nowMs();
+    uint32_t dropped = 0;
+
+    // First line of a new window reports how many were dropped in the last one
+    uint32_t windowStart = site.windowStart;
+    if (now - windowStart >= LOG_RATE_WINDOW_MS && site.windowStart.compare_exchange_strong(windowStart, now))
+    {
+        site.count = 0;
+        dropped = site.suppressed.exchange(0);
+    }
+
+    if (++site.count > LOG_RATE_LIMIT)
+    {
+        site.suppressed++;
+        active = false;
+        return;
+    }
+
+    auto &buf = buffer();
+    buf += levelPrefix(level);
+    if (dropped > 0)
+    {
+        buf += "(";
+        append(buf, dropped);
+        buf += " similar lines dropped) ";
+    }
+}
+
+Logger::Line::~Line()
+{
+    if (!active)
+        return;
+
+    auto &buf = buffer();
+    submit(level, buf.data() + start, buf.size() - start);
+    buf.resize(start);
+}
+
+void Logger::submit(const int level, const char *line, const size_t len)
+{
+    if (sinkClosed)
+    {
+        fwrite(line, 1, len, stdout);
+        fputc('\n', stdout);
+        return;
+    }
+
+    getSink().submit(level, line, len);
+}
+
+void Logger::flush()
+{
+    if (!sinkClosed)
+        getSink().flush();
+}
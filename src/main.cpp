@@ -3,6 +3,7 @@
 #include <image.hpp>
 #include <scene.hpp>
 #include <file.hpp>
+#include <profiler.hpp>
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
@@ -25,6 +26,31 @@ static AudioManager audioManager(fileManager);
 static ImageManager imageManager(fileManager, windowManager.getRenderer(), currChoices);
 static SceneManager sceneManager(audioManager, imageManager, fileManager, currChoices);
 
+#ifndef __EMSCRIPTEN__
+// Performance counter when the last frame ended
+static Uint64 frameEnd = 0;
+
+// Hold a frame skipped as unchanged for as long as vsync holds a presented one
+// Input does not end the wait early so each framestamp lasts one display frame whatever the event traffic
+static void waitIdleFrame()
+{
+    const Uint64 freq = SDL_GetPerformanceFrequency();
+    const Uint64 deadline = frameEnd + static_cast<Uint64>(freq * windowManager.getFrameMs() / 1000);
+    const Uint64 now = SDL_GetPerformanceCounter();
+
+    // Running behind, start counting from now
+    if (now >= deadline)
+    {
+        frameEnd = now;
+        return;
+    }
+
+    // Sleeps are only to the millisecond, the rest is made up by the next frame
+    SDL_Delay(static_cast<Uint32>((deadline - now) * 1000 / freq));
+    frameEnd = deadline;
+}
+#endif
+
 void main_loop()
 {
     SDL_Event event;
@@ -33,6 +59,10 @@ void main_loop()
 
     while (SDL_PollEvent(&event))
     {
+        // Input and window events may change what is shown, pointer movement alone does not
+        if (event.type != SDL_MOUSEMOTION)
+            imageManager.markDirty();
+
         switch (event.type)
         {
         case SDL_USEREVENT:
@@ -71,6 +101,20 @@ void main_loop()
                 windowManager.toggleFullscreen();
                 break;
 
+#ifdef PROFILE_ENABLE
+            case SDLK_p:
+                imageManager.toggleProfiler();
+                break;
+
+            case SDLK_t:
+                // Press once to start a trace and again to write it
+                if (!Profiler::isTracing())
+                    Profiler::startTrace();
+                else if (Profiler::writeTrace(PROFILE_TRACE_FILE))
+                    LOG_INFO << "Trace written to " << PROFILE_TRACE_FILE;
+                break;
+#endif
+
             case SDLK_1:
             case SDLK_2:
             case SDLK_3:
@@ -103,8 +147,27 @@ void main_loop()
         }
     }
 
+    // Upload any images decoded in the background
+    imageManager.processUploads();
+
     // Render the canvas
+#ifdef __EMSCRIPTEN__
+    // The browser paces the loop
     imageManager.render();
+#else
+    // Skipped frames have no vsync to wait on so they are paced here
+    if (imageManager.render())
+        frameEnd = SDL_GetPerformanceCounter();
+    else
+        waitIdleFrame();
+#endif
+
+#ifdef __EMSCRIPTEN__
+    // Lines logged this frame are written to the console together
+    Logger::flush();
+#endif
+
+    PROFILE_FRAME();
 }
 
 int main(int argc, char **argv)
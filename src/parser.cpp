@@ -1,6 +1,9 @@
 #include <parser.hpp>
+#include <profiler.hpp>
 
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
 
 #define BASE_EXPR or_expr
 
@@ -160,375 +163,621 @@ void Lexer::advance()
     }
 }
 
-void Parser::set_lexer_buffer(std::string &buffer)
+void Parser::emit(const Op op, const int arg)
 {
-    p_lexer->buffer = buffer;
+    p_program->code.push_back({op, arg});
+
+    // Track the deepest the stack gets
+    switch (op)
+    {
+    case Op::Push:
+    case Op::Prev:
+    case Op::Var:
+        curr_depth++;
+        p_program->depth = std::max(p_program->depth, curr_depth);
+        break;
+
+    case Op::Mul:
+    case Op::Div:
+    case Op::Add:
+    case Op::Sub:
+    case Op::Shl:
+    case Op::Shr:
+    case Op::Gt:
+    case Op::Gte:
+    case Op::Lt:
+    case Op::Lte:
+    case Op::Eq:
+    case Op::Neq:
+    case Op::Band:
+    case Op::Bor:
+    case Op::And:
+    case Op::Or:
+    case Op::Pop:
+        curr_depth--;
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Emit an error and stop compiling, anything after it would never have been evaluated
+void Parser::fail(const Op op, const std::string &message)
+{
+    emit(op, p_program->errors.size());
+    p_program->errors.push_back(message);
+    throw CompileStop();
+}
+
+// Lexing errors surface where the next token is read
+void Parser::advance()
+{
+    try
+    {
+        p_lexer->advance();
+    }
+    catch (const std::runtime_error &error)
+    {
+        fail(Op::Throw, error.what());
+    }
 }
 
-double Parser::primary()
+void Parser::primary()
 {
     std::string buffer;
-    double result = 0.0;
+    size_t mark;
+    int value;
 
     switch (p_lexer->get_current_token())
     {
     case Token::Id:
-        p_lexer->advance();
+        advance();
 
         // Evaluate variable name
-        last_var_name = std::to_string(primary());
-        set_lexer_buffer(last_var_name);
+        mark = p_program->code.size();
+        primary();
+
+        // Indices of literals are known now, e.g. #300
+        if (p_program->code.size() == mark + 1 && p_program->code.back().op == Op::Push)
+        {
+            p_program->code.back().op = Op::Var;
+        }
+        else
+        {
+            emit(Op::VarDyn);
+        }
 
-        // Store initial result, assume post increment/decrement
-        result = symbol_table[last_var_name];
+        // Post increment/decrement, the value read stays on the stack
         for (;;)
         {
             switch (p_lexer->get_current_token())
             {
             case (Token::Decr):
-                // std::cout << "DECREMENT" << std::endl;
-                p_lexer->advance();
-                symbol_table[last_var_name]--;
+                advance();
+                emit(Op::Decr);
                 break;
             case (Token::Incr):
-                // std::cout << "INCREMENT" << std::endl;
-                p_lexer->advance();
-                symbol_table[last_var_name]++;
+                advance();
+                emit(Op::Incr);
                 break;
             default:
-                return result;
+                return;
             }
         }
     case Token::Prev:
-        p_lexer->advance();
-        return prevValue;
+        advance();
+        emit(Op::Prev);
+        return;
     case Token::Number:
         buffer = p_lexer->get_curr_buffer();
-        // std::cout << "NUM " << buffer << std::endl;
-        p_lexer->advance();
-        return std::stoi(buffer);
+        advance();
+        try
+        {
+            value = std::stoi(buffer);
+        }
+        catch (const std::out_of_range &error)
+        {
+            fail(Op::ThrowRange, error.what());
+        }
+        emit(Op::Push, value);
+        return;
     case Token::Lp:
-        p_lexer->advance();
-        result = BASE_EXPR();
+        advance();
+        or_expr();
         if (p_lexer->get_current_token() != Token::Rp)
-            throw std::runtime_error("No closing parentheses!");
-        p_lexer->advance();
-        return result;
+            fail(Op::Throw, "No closing parentheses!");
+        advance();
+        return;
 
     default:
         auto token = static_cast<char>(p_lexer->get_current_token());
         if (token == -1)
-            throw std::runtime_error("Unexpected EOF!");
+            fail(Op::Throw, "Unexpected EOF!");
 
         // IGNORE ALL UNSUPPORTED TOKENS
-        return result;
-        // throw std::runtime_error(std::string("Invalid primary operand! Token: ") + token);
+        emit(Op::Push, 0);
+        return;
     }
 }
 
-double Parser::unary_expr()
+void Parser::unary_expr()
 {
     switch (p_lexer->get_current_token())
     {
     case Token::Plus:
-        p_lexer->advance();
-        return +primary();
+        advance();
+        primary();
+        return;
     case Token::Minus:
-        p_lexer->advance();
-        return -primary();
+        advance();
+        primary();
+        emit(Op::Neg);
+        return;
     default:
-        return primary();
+        primary();
+        return;
     }
 }
 
-double Parser::mul_expr()
+void Parser::mul_expr()
 {
-    double result = unary_expr();
-    double operand;
+    unary_expr();
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case (Token::Mul):
-            // std::cout << "MUL" << std::endl;
-            p_lexer->advance();
-            result *= unary_expr();
+            advance();
+            unary_expr();
+            emit(Op::Mul);
             break;
         case (Token::Div):
-            // std::cout << "DIV" << std::endl;
-            p_lexer->advance();
-            operand = unary_expr();
-            if (operand == 0)
-                throw(std::runtime_error("Division by 0!"));
-            result /= operand;
+            advance();
+            unary_expr();
+            emit(Op::Div);
             break;
         default:
-            return result;
+            return;
         }
     }
 }
 
-double Parser::add_expr()
+void Parser::add_expr()
 {
-    double result = mul_expr();
+    mul_expr();
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case Token::Plus:
-            p_lexer->advance();
-            result += mul_expr();
+            advance();
+            mul_expr();
+            emit(Op::Add);
             break;
         case Token::Minus:
-            p_lexer->advance();
-            result -= mul_expr();
+            advance();
+            mul_expr();
+            emit(Op::Sub);
             break;
         default:
-            return result;
+            return;
         }
     }
 }
 
-double Parser::bitshift_expr()
+// Operands are truncated to int from here on
+// Later levels only see integers so they need no conversion of their own
+void Parser::bitshift_expr()
 {
-    int result = add_expr();
+    add_expr();
+    emit(Op::ToInt);
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case Token::Shl:
-            p_lexer->advance();
-            result <<= static_cast<int>(add_expr());
+            advance();
+            add_expr();
+            emit(Op::ToInt);
+            emit(Op::Shl);
             break;
         case Token::Shr:
-            p_lexer->advance();
-            result >>= static_cast<int>(add_expr());
+            advance();
+            add_expr();
+            emit(Op::ToInt);
+            emit(Op::Shr);
             break;
         default:
-            return result;
+            return;
         }
     }
 }
 
-double Parser::inequality_expr()
+void Parser::inequality_expr()
 {
-    auto result = bitshift_expr();
+    bitshift_expr();
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case Token::Gt:
-            p_lexer->advance();
-            result = result > bitshift_expr();
+            advance();
+            bitshift_expr();
+            emit(Op::Gt);
             break;
         case Token::Gte:
-            p_lexer->advance();
-            result = result >= bitshift_expr();
+            advance();
+            bitshift_expr();
+            emit(Op::Gte);
             break;
         case Token::Lt:
-            p_lexer->advance();
-            result = result < bitshift_expr();
+            advance();
+            bitshift_expr();
+            emit(Op::Lt);
             break;
         case Token::Lte:
-            p_lexer->advance();
-            result = result <= bitshift_expr();
+            advance();
+            bitshift_expr();
+            emit(Op::Lte);
             break;
         default:
-            return result;
+            return;
         }
     }
 }
 
-double Parser::equality_expr()
+void Parser::equality_expr()
 {
-    auto result = inequality_expr();
-    // auto tmp = result;
-    // int boolean = -1;
+    inequality_expr();
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case Token::Eq:
-            p_lexer->advance();
-            result = result == inequality_expr(); // C-style
-
-            // Python-style operator chaining (ANDed)
-            // boolean &= result == (tmp = inequality_expr());
-            // result = tmp;
+            advance();
+            inequality_expr(); // C-style
+            emit(Op::Eq);
             break;
         case Token::Neq:
-            p_lexer->advance();
-            result = result != inequality_expr();
+            advance();
+            inequality_expr();
+            emit(Op::Neq);
             break;
         default:
-            return result;
-            // return boolean == -1 ? result : boolean;
+            return;
         }
     }
 }
 
-double Parser::band_expr()
+void Parser::band_expr()
 {
-    int result = equality_expr();
+    equality_expr();
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case Token::Band:
-            p_lexer->advance();
-            result &= static_cast<int>(equality_expr());
+            advance();
+            equality_expr();
+            emit(Op::Band);
             break;
         default:
-            return result;
+            return;
         }
     }
 }
 
-double Parser::bor_expr()
+void Parser::bor_expr()
 {
-    int result = band_expr();
+    band_expr();
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case Token::Bor:
-            p_lexer->advance();
-            result |= static_cast<int>(band_expr());
+            advance();
+            band_expr();
+            emit(Op::Bor);
             break;
         default:
-            return result;
+            return;
         }
     }
 }
 
-double Parser::and_expr()
+// Both sides are always evaluated, there is no short-circuiting
+void Parser::and_expr()
 {
-    int result = bor_expr();
-    int result_rhs;
+    bor_expr();
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case Token::And:
-            p_lexer->advance();
-            // Evaluate separately to ensure function is called instead of short-circuiting
-            result_rhs = bor_expr();
-            result = result && result_rhs;
+            advance();
+            bor_expr();
+            emit(Op::And);
             break;
         default:
-            return result;
+            return;
         }
     }
 }
 
-double Parser::or_expr()
+void Parser::or_expr()
 {
-    int result = and_expr();
-    int result_rhs;
+    and_expr();
 
     for (;;)
     {
         switch (p_lexer->get_current_token())
         {
         case Token::Or:
-            p_lexer->advance();
-            // Evaluate separately to ensure function is called instead of short-circuiting
-            result_rhs = and_expr();
-            result = result || result_rhs;
+            advance();
+            and_expr();
+            emit(Op::Or);
             break;
         default:
-            return result;
+            return;
         }
     }
 }
 
-double Parser::assign_expr()
+void Parser::assign_expr()
 {
     Token t = p_lexer->get_current_token();
-    auto result = BASE_EXPR();
+    BASE_EXPR();
 
     if (t == Token::Id)
     {
-        // Evaluate RHS
+        // The left side is discarded, the target is whichever variable is read last,
+        // which includes those on the right side
+        Op op;
         switch (p_lexer->get_current_token())
         {
         case Token::Assign:
-            // Verify valid LHS (Not working for dynamic variable names)
-            // Prevents expressions like #300+12345=100
-            // auto buffer = p_lexer->get_curr_buffer();
-            // if (buffer != last_var_name)
-            //     throw(std::runtime_error("Invalid '" + buffer + "' on LHS of assignment!"));
-
-            p_lexer->advance();
-            result = BASE_EXPR();
-            // LOG << "SETVAR #" << last_var_name << "=" << result << std::endl;
-            symbol_table[last_var_name] = result;
+            op = Op::Assign;
             break;
-
         case Token::PlusAssign:
-            p_lexer->advance();
-            result = BASE_EXPR();
-            symbol_table[last_var_name] += result;
+            op = Op::PlusAssign;
             break;
-
         case Token::MinusAssign:
-            p_lexer->advance();
-            result = BASE_EXPR();
-            symbol_table[last_var_name] -= result;
+            op = Op::MinusAssign;
             break;
-
         case Token::MulAssign:
-            p_lexer->advance();
-            result = BASE_EXPR();
-            symbol_table[last_var_name] *= result;
+            op = Op::MulAssign;
             break;
-
         case Token::DivAssign:
-            p_lexer->advance();
-            result = BASE_EXPR();
-            symbol_table[last_var_name] /= result;
+            op = Op::DivAssign;
             break;
-
         default:
+            op = Op::Pop;
             break;
         }
+
+        if (op != Op::Pop)
+        {
+            advance();
+            emit(Op::Pop);
+            BASE_EXPR();
+            emit(op);
+        }
     }
 
     if (p_lexer->get_current_token() != Token::Eof)
     {
-        throw std::runtime_error(std::string("Unexpected before EOF: ") + static_cast<char>(p_lexer->get_current_token()));
+        fail(Op::Throw, std::string("Unexpected before EOF: ") + static_cast<char>(p_lexer->get_current_token()));
+    }
+}
+
+Parser::Program Parser::compile(const std::string &s)
+{
+    Program program = {{}, {}, 0};
+    p_program = &program;
+    curr_depth = 0;
+
+    try
+    {
+        try
+        {
+            // Initialize the lexer with the string
+            Lexer lexer = Lexer{s};
+            p_lexer = &lexer;
+
+            // Begin with expression of least precedence
+            assign_expr();
+        }
+        catch (const std::runtime_error &error)
+        {
+            // Only the first token is read outside of advance
+            fail(Op::Throw, error.what());
+        }
+    }
+    catch (const CompileStop &)
+    {
     }
 
-    return result;
+    p_lexer = NULL;
+    p_program = NULL;
+
+    // Errors may leave nothing to return
+    program.depth = std::max<size_t>(program.depth, 1);
+    return program;
+}
+
+double Parser::run(const Program &program)
+{
+    if (stack.size() < program.depth)
+        stack.resize(program.depth);
+
+    double *sp = stack.data();
+
+    for (const auto &instr : program.code)
+    {
+        switch (instr.op)
+        {
+        case Op::Push:
+            *sp++ = instr.arg;
+            break;
+        case Op::Prev:
+            *sp++ = prevValue;
+            break;
+        case Op::Var:
+            lastVar = symbols.get(instr.arg);
+            *sp++ = *lastVar;
+            break;
+        case Op::VarDyn:
+            lastVar = symbols.get(sp[-1]);
+            sp[-1] = *lastVar;
+            break;
+        case Op::Incr:
+            (*lastVar)++;
+            break;
+        case Op::Decr:
+            (*lastVar)--;
+            break;
+        case Op::Neg:
+            sp[-1] = -sp[-1];
+            break;
+        case Op::Mul:
+            sp--;
+            sp[-1] *= sp[0];
+            break;
+        case Op::Div:
+            sp--;
+            if (sp[0] == 0)
+                throw(std::runtime_error("Division by 0!"));
+            sp[-1] /= sp[0];
+            break;
+        case Op::Add:
+            sp--;
+            sp[-1] += sp[0];
+            break;
+        case Op::Sub:
+            sp--;
+            sp[-1] -= sp[0];
+            break;
+        case Op::ToInt:
+            sp[-1] = static_cast<int>(sp[-1]);
+            break;
+        case Op::Shl:
+            sp--;
+            sp[-1] = static_cast<int>(sp[-1]) << static_cast<int>(sp[0]);
+            break;
+        case Op::Shr:
+            sp--;
+            sp[-1] = static_cast<int>(sp[-1]) >> static_cast<int>(sp[0]);
+            break;
+        case Op::Gt:
+            sp--;
+            sp[-1] = sp[-1] > sp[0];
+            break;
+        case Op::Gte:
+            sp--;
+            sp[-1] = sp[-1] >= sp[0];
+            break;
+        case Op::Lt:
+            sp--;
+            sp[-1] = sp[-1] < sp[0];
+            break;
+        case Op::Lte:
+            sp--;
+            sp[-1] = sp[-1] <= sp[0];
+            break;
+        case Op::Eq:
+            sp--;
+            sp[-1] = sp[-1] == sp[0];
+            break;
+        case Op::Neq:
+            sp--;
+            sp[-1] = sp[-1] != sp[0];
+            break;
+        case Op::Band:
+            sp--;
+            sp[-1] = static_cast<int>(sp[-1]) & static_cast<int>(sp[0]);
+            break;
+        case Op::Bor:
+            sp--;
+            sp[-1] = static_cast<int>(sp[-1]) | static_cast<int>(sp[0]);
+            break;
+        case Op::And:
+            sp--;
+            sp[-1] = static_cast<int>(sp[-1]) && static_cast<int>(sp[0]);
+            break;
+        case Op::Or:
+            sp--;
+            sp[-1] = static_cast<int>(sp[-1]) || static_cast<int>(sp[0]);
+            break;
+        case Op::Pop:
+            sp--;
+            break;
+        case Op::Assign:
+            *lastVar = sp[-1];
+            break;
+        case Op::PlusAssign:
+            *lastVar += sp[-1];
+            break;
+        case Op::MinusAssign:
+            *lastVar -= sp[-1];
+            break;
+        case Op::MulAssign:
+            *lastVar *= sp[-1];
+            break;
+        case Op::DivAssign:
+            *lastVar /= sp[-1];
+            break;
+        case Op::Throw:
+            throw std::runtime_error(program.errors[instr.arg]);
+        case Op::ThrowRange:
+            throw std::out_of_range(program.errors[instr.arg]);
+        }
+    }
+
+    return sp[-1];
 }
 
 // Evaluate a lhs variable name and assign rhs to it
 void Parser::setVar(const std::string &lhs, const double rhs)
 {
-    const std::string &varName = std::to_string(parse(lhs));
-    symbol_table[varName] = rhs;
+    *symbols.get(parse(lhs)) = rhs;
+}
+
+void Parser::setSymbolTable(const SymbolTable &symbolTable)
+{
+    symbols.load(symbolTable);
+    lastVar = NULL;
+}
+
+void Parser::loadSymbolSnapshot(StateReader &reader)
+{
+    symbols.loadSnapshot(reader);
+    lastVar = NULL;
 }
 
-// Evaluate a single string
+// Evaluate a single string, compiling it the first time it is seen
 double Parser::parse(const std::string &s, const int prev)
 {
-    // Initialize the lexer with the string
-    Lexer lexer = Lexer{s};
-    p_lexer = &lexer;
+    PROFILE_SCOPE(EXPRESSION);
 
-    prevValue = prev;
+    auto got = programs.find(s);
+    if (got == programs.end())
+    {
+        if (programs.size() >= PARSER_CACHE_SIZE)
+            programs.clear();
+
+        got = programs.emplace(s, compile(s)).first;
+    }
 
-    // Begin with expression of least precedence
-    double result = assign_expr();
+    prevValue = prev;
 
-    p_lexer = NULL;
-    return result;
+    return run(got->second);
 }
@@ -0,0 +1,137 @@
+#include <profiler.hpp>
+
+#ifdef PROFILE_ENABLE
+
+#include <fstream>
+
+Profiler::Total Profiler::totals[static_cast<int>(PROFILE_STAGE::COUNT)] = {};
+std::atomic<uint64_t> Profiler::frameNanos[static_cast<int>(PROFILE_STAGE::COUNT)] = {};
+
+Profiler::FrameTimes Profiler::frames[PROFILE_FRAMES] = {};
+size_t Profiler::frameCount = 0;
+Profiler::Clock::time_point Profiler::frameStart = Profiler::Clock::now();
+
+std::atomic<bool> Profiler::tracing{false};
+std::mutex Profiler::traceMutex;
+std::vector<Profiler::TraceEvent> Profiler::traceEvents;
+Profiler::Clock::time_point Profiler::traceStart;
+
+void Profiler::add(const PROFILE_STAGE stage, const Clock::time_point start, const Clock::time_point end)
+{
+    const uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+    auto &total = totals[static_cast<int>(stage)];
+    total.nanos += nanos;
+    total.count++;
+
+    frameNanos[static_cast<int>(stage)] += nanos;
+
+    if (!tracing)
+        return;
+
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (traceEvents.size() < PROFILE_TRACE_MAX_EVENTS)
+        traceEvents.push_back({stage, threadId(), start, end - start});
+}
+
+void Profiler::reset()
+{
+    for (auto &total : totals)
+    {
+        total.nanos = 0;
+        total.count = 0;
+    }
+}
+
+void Profiler::endFrame()
+{
+    const auto now = Clock::now();
+    add(PROFILE_STAGE::FRAME, frameStart, now);
+    frameStart = now;
+
+    // Stages still running on workers are counted in the frame they end in
+    auto &frame = frames[frameCount % PROFILE_FRAMES];
+    for (size_t i = 0; i < frame.size(); i++)
+        frame[i] = frameNanos[i].exchange(0);
+
+    frameCount++;
+}
+
+void Profiler::startTrace()
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEvents.clear();
+    traceStart = Clock::now();
+    tracing = true;
+}
+
+bool Profiler::writeTrace(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+    tracing = false;
+
+    std::ofstream ofs(path);
+    if (!ofs.is_open())
+        return false;
+
+    // Complete events with times in microseconds
+    ofs << "{\"traceEvents\":[";
+    for (size_t i = 0; i < traceEvents.size(); i++)
+    {
+        const auto &event = traceEvents[i];
+        ofs << (i ? ",\n" : "\n")
+            << "{\"name\":\"" << getName(event.stage)
+            << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+            << ",\"ts\":" << std::chrono::duration<double, std::micro>(event.start - traceStart).count()
+            << ",\"dur\":" << std::chrono::duration<double, std::micro>(event.duration).count() << "}";
+    }
+    ofs << "\n]}\n";
+
+    traceEvents.clear();
+    traceEvents.shrink_to_fit();
+    return static_cast<bool>(ofs);
+}
+
+unsigned int Profiler::threadId()
+{
+    static std::atomic<unsigned int> nextId{0};
+    thread_local const unsigned int id = nextId++;
+    return id;
+}
+
+const char *Profiler::getName(const PROFILE_STAGE stage)
+{
+    switch (stage)
+    {
+    case PROFILE_STAGE::FRAME:
+        return "frame";
+    case PROFILE_STAGE::TICK:
+        return "tick";
+    case PROFILE_STAGE::SECTION:
+        return "section";
+    case PROFILE_STAGE::COMMAND:
+        return "command";
+    case PROFILE_STAGE::EXPRESSION:
+        return "expression";
+    case PROFILE_STAGE::SCRIPT:
+        return "script";
+    case PROFILE_STAGE::FETCH:
+        return "fetch";
+    case PROFILE_STAGE::DECODE:
+        return "decode";
+    case PROFILE_STAGE::UPLOAD:
+        return "upload";
+    case PROFILE_STAGE::TEXT:
+        return "text";
+    case PROFILE_STAGE::GLYPH:
+        return "glyph";
+    case PROFILE_STAGE::RENDER:
+        return "render";
+    case PROFILE_STAGE::PRESENT:
+        return "present";
+    default:
+        return "unknown";
+    }
+}
+
+#endif
@@ -1,5 +1,5 @@
 #include <scene.hpp>
-#include <convtable.hpp>
+#include <command.hpp>
 
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
@@ -11,200 +11,258 @@ SceneManager::SceneManager(AudioManager &mm, ImageManager &im, FileManager &fm,
     fileManager.init(this);
 }
 
-// Parse a raw CST file from a memory buffer and store the uncompressed script
-void SceneManager::loadScript(byte *buf, size_t sz, const std::string &scriptName)
+// Compile a raw CST file from a memory buffer, or reuse it from the cache, and make it current
+bool SceneManager::loadScript(byte *buf, size_t sz, const std::string &scriptName)
 {
-    CSTHeader *scriptHeader = reinterpret_cast<CSTHeader *>(buf);
+    auto script = scriptCache.get(scriptName, buf, sz);
+    if (!script)
+        return false;
 
-    // Verify signature
-    if (strncmp(scriptHeader->FileSignature, SCRIPT_SIGNATURE, sizeof(scriptHeader->FileSignature)) != 0)
-    {
-        LOG << "Invalid CST file signature!";
+    currScript = std::move(script);
+    currLine = 0;
+
+    // Store loaded script name
+    currScriptName = scriptName;
+    return true;
+}
+
+// Scan upcoming lines from the prefetch line until it is PREFETCH_BREAKS breaks ahead
+// and warm the caches with any assets found, in the order they will be used
+void SceneManager::prefetchAhead()
+{
+    if (!currScript)
         return;
-    }
 
-    // Get pointer to start of raw data
-    auto *scriptDataRaw = reinterpret_cast<byte *>(scriptHeader + 1);
+    const auto &lines = currScript->lines;
 
-    if (scriptHeader->CompressedSize == 0)
-    {
-        // Uncompressed script
-        currScriptData = std::vector<byte>(scriptDataRaw, scriptDataRaw + scriptHeader->DecompressedSize);
-    }
-    else
+    while (prefetchBreaks < PREFETCH_BREAKS && prefetchLine < lines.size())
     {
-        currScriptData = Utils::zlibUncompress(scriptHeader->DecompressedSize, scriptDataRaw, scriptHeader->CompressedSize);
-        if (currScriptData.empty())
+        const auto &line = lines[prefetchLine++];
+
+        if (line.type == 0x02 || line.type == 0x03)
         {
-            LOG << "Script uncompress error";
-            return;
+            prefetchBreaks++;
+            continue;
         }
-    }
 
-// #ifdef __EMSCRIPTEN__
-//     iterateScript([this](const std::string &cmdString)
-//                   {
-//         std::smatch matches;
-//         if (std::regex_search(cmdString, matches, std::regex("^(bg|eg|fg|cg|fw)(?: (\\d)(?: ([\\w,$]+)(?: ([^\\s]*)(?: ([^\\s]*)(?: ([^\\s]*)(?: ([^\\s]*))?)?)?)?)?)?")))
-//         {
-//             const std::string &asset = matches[3].str();
-//             if (asset.empty())
-//                 return true;
+        if (line.type != 0x30)
+            continue;
 
-//             toPrefetch.push_back(asset);
-//         } return true; });
-// #endif
+        const auto &cmd = line.cmd;
 
-    // Init script data
-    ScriptDataHeader *scriptDataHeader = reinterpret_cast<ScriptDataHeader *>(currScriptData.data());
-    byte *tablesStart = reinterpret_cast<byte *>(scriptDataHeader + 1);
+        // Keywords like `fade` are also captured but are never found in the DB
+        switch (cmd.type)
+        {
+        case COMMAND_TYPE::IMAGE:
+            if (!cmd.args[3].empty())
+                toPrefetch.push_back({false, cmd.args[3]});
+            break;
 
-    // Locate offset table and string table
-    stringOffsetTable = reinterpret_cast<StringOffsetTable *>(tablesStart + scriptDataHeader->StringOffsetTableOffset);
-    stringTableBase = tablesStart + scriptDataHeader->StringTableOffset;
+        case COMMAND_TYPE::BGM:
+            toPrefetch.push_back({true, cmd.args[2]});
+            break;
 
-    // Store loaded script name
-    currScriptName = scriptName;
+        case COMMAND_TYPE::PCM:
+            toPrefetch.push_back({true, cmd.args[1]});
+            break;
+
+        case COMMAND_TYPE::SE:
+            if (cmd.args[2] == "loop" && !cmd.args[3].empty())
+                toPrefetch.push_back({true, cmd.args[3]});
+            else if (!cmd.args[2].empty())
+                toPrefetch.push_back({true, cmd.args[2]});
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // Fetches are queued in order and run in the background
+    while (!toPrefetch.empty())
+    {
+        auto &asset = toPrefetch.front();
+#ifdef LOWERCASE_ASSETS
+        Utils::lowercase(asset.name);
+#endif
+        if (asset.isAudio)
+            audioManager.prefetch(asset.name);
+        else
+            imageManager.prefetch(asset.name);
+
+        toPrefetch.pop_front();
+    }
 }
 
-void SceneManager::prefetch(std::vector<byte> scriptData)
+// Restart the lookahead from the current line of a newly loaded script
+void SceneManager::resetPrefetch()
 {
-    ScriptDataHeader *scriptDataHeader = reinterpret_cast<ScriptDataHeader *>(scriptData.data());
-    byte *tablesStart = reinterpret_cast<byte *>(scriptDataHeader + 1);
+    toPrefetch.clear();
+    prefetchLine = currLine;
+    prefetchBreaks = 0;
 
-    // Locate offset table and string table
-    StringOffsetTable *stringOffsetTable = reinterpret_cast<StringOffsetTable *>(tablesStart + scriptDataHeader->StringOffsetTableOffset);
-    byte *stringTableBase = tablesStart + scriptDataHeader->StringTableOffset;
+    prefetchAhead();
+    prefetchScripts();
+}
 
-    // Check if pointer exceeded end of script
-    while (reinterpret_cast<byte *>(stringOffsetTable) < stringTableBase)
+// Compile the scripts that `next` and choices of the current script lead to in the background
+// so that moving on to them does not wait for a fetch
+void SceneManager::prefetchScripts()
+{
+    if (!currScript)
+        return;
+
+    std::vector<std::string> targets;
+    auto addTarget = [&targets](const ScriptLine &line)
     {
-        auto stringTable = reinterpret_cast<StringTable *>(stringTableBase + stringOffsetTable->Offset);
+        if (line.cmd.type == COMMAND_TYPE::NEXT)
+            targets.push_back(line.cmd.args[1]);
+        else if (line.cmd.type == COMMAND_TYPE::CHOICE)
+            targets.push_back(line.cmd.args[2]);
+    };
 
-        stringOffsetTable++;
+    for (const auto &line : currScript->lines)
+    {
+        if (line.type == 0x30)
+            addTarget(line);
+    }
 
-        if (stringTable->Type != 0x30)
-            continue;
+    // Statements of ifs are usually where `next` is found
+    for (const auto &line : currScript->branches)
+        addTarget(line);
 
-        const auto &cmdString = std::string(&stringTable->StringStart);
+    unsigned int fetched = 0;
+    for (const auto &name : targets)
+    {
+        if (fetched >= PREFETCH_SCRIPTS)
+            break;
 
-        std::smatch matches;
-        if (std::regex_search(cmdString, matches, std::regex("^(bg|eg|fg|cg|fw)(?: (\\d)(?: ([\\w,$]+)(?: ([^\\s]*)(?: ([^\\s]*)(?: ([^\\s]*)(?: ([^\\s]*))?)?)?)?)?)?")))
-        {
-            const std::string &asset = matches[3].str();
-            if (asset.empty())
-                continue;
+        if (name == currScriptName || pendingScripts.count(name) || scriptCache.find(name))
+            continue;
 
-            // imageManager.prefetch(asset);
-            toPrefetch.push_back(asset);
-        }
+        // Scripts missing from the DB never complete so must not be marked pending
+        const AssetId asset = fileManager.findAsset(name, ASSET_EXT::SCRIPT);
+        if (asset == ASSET_NONE)
+            continue;
+
+        pendingScripts.insert(name);
+        fileManager.fetchAssetAsync(asset, this, &SceneManager::compileScriptAsync, name);
+        fetched++;
     }
 }
 
-// Load a script from a raw buffer and parse it from the start
-void SceneManager::loadScriptStart(byte *buf, size_t sz, const std::string &scriptName)
+// Worker callback when a prefetched script has been fetched
+// Compiles off the main thread and posts the result back to the cache
+void SceneManager::compileScriptAsync(byte *buf, size_t sz, const std::string &name)
 {
-    loadScript(buf, sz, scriptName);
+    auto script = ScriptCache::build(name, buf, sz);
+
+    fileManager.getWorkerPool().post([this, name, script]()
+                                     {
+                                         pendingScripts.erase(name);
+                                         if (script)
+                                             scriptCache.add(name, script);
+
+                                         if (awaitedScript != name)
+                                             return;
+                                         awaitedScript.clear();
+
+                                         // Invalid scripts are fetched again so the usual errors are logged
+                                         if (script)
+                                             startCompiledScript(script, name);
+                                         else
+                                             fileManager.fetchAssetAndProcess(fileManager.findAsset(name, ASSET_EXT::SCRIPT), this, &SceneManager::loadScriptStart, name); });
+}
+
+// Begin parsing the current script from its current line
+void SceneManager::startScript()
+{
+    resetPrefetch();
 
     // Allow ticker to start parsing
     parseScript = true;
 }
 
-void SceneManager::loadScriptOffset(byte *buf, size_t sz, const SaveData &saveData)
+// Load a script from a raw buffer and parse it from the start
+void SceneManager::loadScriptStart(byte *buf, size_t sz, const std::string &scriptName)
 {
-    loadScript(buf, sz, saveData.scriptName);
-    stringOffsetTable = reinterpret_cast<StringOffsetTable *>(stringTableBase - saveData.offsetFromBase);
+    if (loadScript(buf, sz, scriptName))
+        startScript();
 }
 
-// Fetch and load script and offset specified in SaveData
-void SceneManager::setScriptOffset(const SaveData &saveData)
+void SceneManager::loadScriptOffset(byte *buf, size_t sz, const SaveData &saveData)
 {
-    fileManager.fetchAssetAndProcess(saveData.scriptName + SCRIPT_EXT, this, &SceneManager::loadScriptOffset, saveData);
-}
+    if (!loadScript(buf, sz, saveData.scriptName))
+        return;
 
-// Fetch the specified script and begin parsing
-void SceneManager::setScript(const std::string &name)
-{
-    fileManager.fetchAssetAndProcess(name + SCRIPT_EXT, this, &SceneManager::loadScriptStart, name);
+    currLine = currScript->lineFromOffset(saveData.offsetFromBase);
+    resetPrefetch();
 }
 
-// Fetch and parse entrypoint script
-void SceneManager::start()
+// Drop prefetches for the current script as it is about to be replaced
+void SceneManager::cancelPrefetch()
 {
-    setScript(SCRIPT_ENTRYPOINT);
+    imageManager.cancelPrefetch();
+    audioManager.cancelPrefetch();
 }
 
-std::string SceneManager::sj2utf8(const std::string &input)
+// Fetch and load script and offset specified in SaveData
+void SceneManager::setScriptOffset(const SaveData &saveData)
 {
-    std::string output(3 * input.length(), ' '); // ShiftJis won't give 4byte UTF8, so max. 3 byte per input char are needed
-    size_t indexInput = 0, indexOutput = 0;
+    cancelPrefetch();
+    awaitedScript.clear();
 
-    while (indexInput < input.length())
+    // Scripts compiled earlier in this run need not be fetched again
+    auto script = scriptCache.find(saveData.scriptName);
+    if (script)
     {
-        char arraySection = ((uint8_t)input[indexInput]) >> 4;
+        currScript = std::move(script);
+        currLine = currScript->lineFromOffset(saveData.offsetFromBase);
+        currScriptName = saveData.scriptName;
+        resetPrefetch();
+        return;
+    }
 
-        size_t arrayOffset;
-        if (arraySection == 0x8)
-            arrayOffset = 0x100; // these are two-byte shiftjis
-        else if (arraySection == 0x9)
-            arrayOffset = 0x1100;
-        else if (arraySection == 0xE)
-            arrayOffset = 0x2100;
-        else
-            arrayOffset = 0; // this is one byte shiftjis
+    fileManager.fetchAssetAndProcess(fileManager.findAsset(saveData.scriptName, ASSET_EXT::SCRIPT), this, &SceneManager::loadScriptOffset, saveData);
+}
 
-        // determining real array offset
-        if (arrayOffset)
-        {
-            arrayOffset += (((uint8_t)input[indexInput]) & 0xf) << 8;
-            indexInput++;
-            if (indexInput >= input.length())
-                break;
-        }
-        arrayOffset += (uint8_t)input[indexInput++];
-        arrayOffset <<= 1;
+// Make a compiled script current and parse it from the start
+void SceneManager::startCompiledScript(std::shared_ptr<const CompiledScript> script, const std::string &name)
+{
+    currScript = std::move(script);
+    currLine = 0;
+    currScriptName = name;
+    startScript();
+}
 
-        // unicode number is...
-        uint16_t unicodeValue = (shiftJIS_convTable[arrayOffset] << 8) | shiftJIS_convTable[arrayOffset + 1];
+// Fetch the specified script and begin parsing
+void SceneManager::setScript(const std::string &name)
+{
+    cancelPrefetch();
+    awaitedScript.clear();
 
-        // converting to UTF8
-        if (unicodeValue < 0x80)
-        {
-            output[indexOutput++] = unicodeValue;
-        }
-        else if (unicodeValue < 0x800)
-        {
-            output[indexOutput++] = 0xC0 | (unicodeValue >> 6);
-            output[indexOutput++] = 0x80 | (unicodeValue & 0x3f);
-        }
-        else
-        {
-            output[indexOutput++] = 0xE0 | (unicodeValue >> 12);
-            output[indexOutput++] = 0x80 | ((unicodeValue & 0xfff) >> 6);
-            output[indexOutput++] = 0x80 | (unicodeValue & 0x3f);
-        }
+    auto script = scriptCache.find(name);
+    if (script)
+    {
+        startCompiledScript(std::move(script), name);
+        return;
     }
 
-    output.resize(indexOutput); // remove the unnecessary bytes
-    return output;
+    // Already on its way from prefetchScripts, so stop here until it arrives
+    if (pendingScripts.count(name))
+    {
+        awaitedScript = name;
+        parseScript = false;
+        return;
+    }
+
+    fileManager.fetchAssetAndProcess(fileManager.findAsset(name, ASSET_EXT::SCRIPT), this, &SceneManager::loadScriptStart, name);
 }
 
-// Removes formatting symbols from text
-// TODO: Move to utils
-std::string SceneManager::cleanText(const std::string &rawText)
+// Fetch and parse entrypoint script
+void SceneManager::start(const std::string &name)
 {
-    std::string text = std::regex_replace(sj2utf8(rawText), std::regex("\\[(.*?)\\]"), "$1");
-    text = std::regex_replace(text, std::regex("¥'"), "'");
-    text = std::regex_replace(text, std::regex("¥pc"), "");
-    text = std::regex_replace(text, std::regex("¥fn"), "");
-    text = std::regex_replace(text, std::regex("¥fs"), " ");
-    text = std::regex_replace(text, std::regex("¥n"), " ");
-    text = std::regex_replace(text, std::regex("¥@"), "");
-    // text = std::regex_replace(text, std::regex("\\\\fn"), "");
-    // text = std::regex_replace(text, std::regex("\\\\fs"), "");
-    // text = std::regex_replace(text, std::regex("\\\\"), "");
-    // text = std::regex_replace(text, std::regex("@"), "");
-    return text;
+    setScript(name);
 }
 
 // Block script from proceeding for a number of frames
@@ -226,19 +284,22 @@ bool SceneManager::canProceed()
 // Called from main loop to proceed script if needed
 void SceneManager::tickScript()
 {
+    PROFILE_SCOPE(TICK);
+
     // LOG << imageManager.getFramestamp() << " : " << waitTargetFrames;
 
     if (!canProceed())
         return;
 
-    LOG << "Start section";
+    LOG_DEBUG << "Start section";
+    PROFILE_SCOPE(SECTION);
 
     // Parse a `section` of commands until encountering break or wait command
     // Iterative instead of recursive to avoid stack overflow
     while (canProceed())
         parseLine();
 
-    LOG << "End section";
+    LOG_DEBUG << "End section";
     // End of section
     imageManager.setRdraw(sectionRdraw);
     sectionRdraw = 0;
@@ -250,12 +311,11 @@ void SceneManager::prevScene()
 
 void SceneManager::nextScene()
 {
-    iterateScript([this](const std::string &cmdString)
+    iterateScript([this](const ScriptLine &line)
                   {
-                      std::smatch matches;
-                      if (std::regex_search(cmdString, matches, std::regex("^next (\\S+)")))
+                      if (line.cmd.type == COMMAND_TYPE::NEXT)
                       {
-                          setScript(matches[1].str());
+                          setScript(line.cmd.args[1]);
                           return false;
                       } 
                       return true; });
@@ -266,8 +326,8 @@ void SceneManager::back()
     if (stateHistory.size() < 2)
         return;
 
-    stateHistory.pop_back();
-    loadStateJson(stateHistory.back());
+    stateHistory.pop();
+    loadSnapshot(stateHistory.back());
 }
 
 // User input initiated parse
@@ -297,37 +357,42 @@ void SceneManager::parse()
 // Return 0 on success
 void SceneManager::parseLine()
 {
-    if (currScriptData.empty())
+    // Hold on to the script as commands may replace it
+    auto script = currScript;
+    if (!script)
     {
-        LOG << "Script not loaded!";
+        LOG_WARN << "Script not loaded!";
 
         // Break loop to prevent blocking other processes (e.g. fetching next script)
         parseScript = false;
         return;
     }
 
-    // Check if pointer exceeded end of script
-    if (reinterpret_cast<byte *>(stringOffsetTable) >= stringTableBase)
+    // Check if exceeded end of script
+    if (currLine >= script->lines.size())
     {
-        LOG << "End of script!";
+        LOG_INFO << "End of script!";
         parseScript = false;
         return;
     }
 
-    // Parse script
-    auto stringTable = reinterpret_cast<StringTable *>(stringTableBase + stringOffsetTable->Offset);
-
-    stringOffsetTable++;
+    // Lines are compiled so no string processing is left to do here
+    const auto &line = script->lines[currLine++];
 
-    switch (stringTable->Type)
+    switch (line.type)
     {
     case 0x02: // Wait for input after message
     case 0x03: // Novel page break and wait for input after message
         imageManager.setShowText();
         imageManager.setShowMwnd();
-        LOG << "Break";
+        LOG_DEBUG << "Break";
+
+        pushSnapshot();
 
-        stateHistory.push_back(getCurrentState());
+        // Slide the lookahead window past this break
+        if (prefetchBreaks > 0)
+            prefetchBreaks--;
+        prefetchAhead();
 
         switch (autoMode)
         {
@@ -344,14 +409,11 @@ void SceneManager::parseLine()
         break;
 
     case 0x20: // Display a message
-        if (stringTable->StringStart == '\0')
-            break;
-
         if (speakerCounter == 0)
             imageManager.currSpeaker.clear();
 
-        LOG << std::string(&stringTable->StringStart);
-        imageManager.currText = cleanText(std::string(&stringTable->StringStart));
+        LOG_DEBUG << line.text;
+        imageManager.currText = line.text;
         speakerCounter--;
 
         // Also show here in cases of appended text without break in-between
@@ -361,13 +423,14 @@ void SceneManager::parseLine()
         break;
 
     case 0x21: // Set speaker of the message
-        LOG << std::string(&stringTable->StringStart);
-        imageManager.currSpeaker = cleanText(std::string(&stringTable->StringStart));
+        LOG_DEBUG << line.text;
+        imageManager.currSpeaker = line.text;
+        imageManager.markDirty();
         speakerCounter = 1;
         break;
 
     case 0x30: // Perform any other command
-        handleCommand(&stringTable->StringStart);
+        handleCommand(line);
         break;
 
     // Debug commands:
@@ -394,20 +457,24 @@ void SceneManager::addSectionFrames(unsigned int rdraw)
 }
 
 // Parse command and dispatch to respective handlers
-void SceneManager::handleCommand(const std::string &cmdString)
+void SceneManager::handleCommand(const ScriptLine &line)
 {
+    PROFILE_SCOPE(COMMAND);
 
 #ifdef LOG_CMD
-    LOG << "'" << cmdString << "'";
+    LOG_DEBUG << "'" << line.text << "'";
 #endif
-    std::smatch matches;
-    if (std::regex_search(cmdString, matches, std::regex("^wait\\s?(\\d*)")))
+    const Command &cmd = line.cmd;
+
+    switch (cmd.type)
+    {
+    case COMMAND_TYPE::WAIT:
     {
-        const std::string &arg = matches[1].str();
+        const std::string &arg = cmd.args[1];
         if (!arg.empty())
         {
             // Wait for x frames
-            wait(std::stoi(arg));
+            wait(cmd.values[1]);
         }
         else
         {
@@ -417,29 +484,33 @@ void SceneManager::handleCommand(const std::string &cmdString)
             wait();
         }
     }
-    else if (std::regex_search(cmdString, matches, std::regex("^frameon(?: (\\w+) (\\d+))?")))
+    break;
+
+    case COMMAND_TYPE::FRAMEON:
     {
         imageManager.setShowMwnd();
 
-        const auto &framesStr = matches[2].str();
+        const auto &framesStr = cmd.args[2];
         if (framesStr.empty())
             return;
 
-        unsigned int frames = std::stoi(framesStr);
-        const auto &mode = matches[1].str();
+        unsigned int frames = cmd.values[2];
+        const auto &mode = cmd.args[1];
 
         // Assume only fade
         imageManager.setFrameon(frames);
         addSectionFrames(frames);
         // wait();
     }
-    else if (std::regex_search(cmdString, matches, std::regex("^frameoff(?: (\\w+) (\\d+))?")))
+    break;
+
+    case COMMAND_TYPE::FRAMEOFF:
     {
-        const auto &framesStr = matches[2].str();
+        const auto &framesStr = cmd.args[2];
         if (!framesStr.empty())
         {
-            unsigned int frames = std::stoi(framesStr);
-            const auto &mode = matches[1].str();
+            unsigned int frames = cmd.values[2];
+            const auto &mode = cmd.args[1];
 
             // Assume only fade
             imageManager.setFrameoff(frames);
@@ -450,40 +521,47 @@ void SceneManager::handleCommand(const std::string &cmdString)
         // Verified
         imageManager.setHideMwnd();
     }
-    else if (std::regex_search(cmdString, matches, std::regex("^rdraw (\\d+)")))
+    break;
+
+    case COMMAND_TYPE::RDRAW:
     {
         // Number of frames to spend fading from one sprite to the next
         // Default is 1 frame - no fade effect (alpha 0 to 255 within 1 frame)
         // Set frames taken to transition images
-        // currRdraw = std::stoi(matches[1].str());
-        unsigned int rdraw = std::stoi(matches[1].str());
+        // currRdraw = std::stoi(cmd.args[1]);
+        unsigned int rdraw = cmd.values[1];
         sectionRdraw = rdraw;
     }
-    else if (std::regex_search(cmdString, matches, std::regex("^r?wipe2? (\\w+) (\\d+)")))
+    break;
+
+    case COMMAND_TYPE::WIPE:
     {
         // Use transition for wipes
-        sectionRdraw = std::stoi(matches[2].str());
+        sectionRdraw = cmd.values[2];
         imageManager.setHideText();
     }
-    else if (std::regex_search(cmdString, matches, std::regex("^pcm (\\S+)")))
+    break;
+
+    case COMMAND_TYPE::PCM:
     {
-        std::string asset = matches[1].str();
-#ifdef LOWERCASE_ASSETS
-        Utils::lowercase(asset);
-#endif
-        audioManager.setPCM(asset);
+        // Asset names are lowercased when compiled
+        audioManager.setPCM(cmd.args[1]);
     }
-    else if (std::regex_search(cmdString, matches, std::regex("^bgm (\\d+) (\\S+)")))
+    break;
+
+    case COMMAND_TYPE::BGM:
     {
-        audioManager.setMusic(matches[2].str());
+        audioManager.setMusic(cmd.args[2]);
     }
-    else if (std::regex_search(cmdString, matches, std::regex("^se (\\d)(?: (\\w+)(?: (\\w+)(?: (\\w+)(?: (\\w+))?)?)?)?")))
+    break;
+
+    case COMMAND_TYPE::SE:
     {
-        const std::string &arg1 = matches[2].str();
-        const std::string &arg2 = matches[3].str();
-        const std::string &arg3 = matches[4].str();
-        const std::string &arg4 = matches[5].str();
-        const int &channel = std::stoi(matches[1].str());
+        const std::string &arg1 = cmd.args[2];
+        const std::string &arg2 = cmd.args[3];
+        const std::string &arg3 = cmd.args[4];
+        const std::string &arg4 = cmd.args[5];
+        const int &channel = cmd.values[1];
         int loop = 0;
 
         std::string asset = arg1;
@@ -493,7 +571,7 @@ void SceneManager::handleCommand(const std::string &cmdString)
             // Proper fade not implemented, just use SDL impl
             if (arg1 == "fade")
             {
-                const int &frames = std::stoi(arg2);
+                const int &frames = cmd.values[3];
                 if (arg3 != "0" && arg4 == "0")
                     audioManager.fadeOutSound(channel, frames * 16);
 
@@ -512,21 +590,20 @@ void SceneManager::handleCommand(const std::string &cmdString)
                 loop = -1;
             }
         }
-#ifdef LOWERCASE_ASSETS
-        Utils::lowercase(asset);
-#endif
+
         audioManager.setSE(asset, channel, loop);
     }
+    break;
 
     // Display images
-    else if (std::regex_search(cmdString, matches, std::regex("^(bg|eg|fg|cg|fw)(?: (\\d)(?: ([\\w,$]+)(?: ([^\\s]*)(?: ([^\\s]*)(?: ([^\\s]*)(?: ([^\\s]*))?)?)?)?)?)?")))
+    case COMMAND_TYPE::IMAGE:
     {
         // bg 0 BG15_d 0 0 0
         // cg 0 Tchi01m,1,1,g,g #(950+#300) #(955+0) 1 0
 
         // Get image type enum based on identifier
         IMAGE_TYPE imageType;
-        const auto &t = matches[1].str();
+        const auto &t = cmd.args[1];
         if (t == "bg")
             imageType = IMAGE_TYPE::BG;
         else if (t == "eg")
@@ -543,19 +620,19 @@ void SceneManager::handleCommand(const std::string &cmdString)
         }
         else
         {
-            LOG << "Unknown image type identifier!";
+            LOG_WARN << "Unknown image type identifier!";
             return;
         }
 
-        const std::string &zIndexStr = matches[2].str();
+        const std::string &zIndexStr = cmd.args[2];
         if (zIndexStr.empty())
         {
             imageManager.clearImageType(imageType);
             return;
         }
 
-        int zIndex = std::stoi(zIndexStr);
-        const std::string &asset = matches[3].str();
+        int zIndex = cmd.values[2];
+        const std::string &asset = cmd.args[3];
         if (asset.empty() || asset == "0")
         {
             imageManager.clearZIndex(imageType, zIndex);
@@ -588,18 +665,18 @@ void SceneManager::handleCommand(const std::string &cmdString)
         }
         else if (asset == "mode")
         {
-            // imageManager.setMode(imageType, zIndex, matches[4].str());
+            // imageManager.setMode(imageType, zIndex, cmd.args[4]);
         }
 
         else if (asset == "blend")
         {
-            imageManager.setBlend(imageType, zIndex, parser.parse(matches[4].str()));
+            imageManager.setBlend(imageType, zIndex, parser.parse(cmd.args[4]));
         }
         else if (asset == "attr")
         {
-            int attr = std::stoi(matches[4].str());
-            const auto &xStr = matches[5].str();
-            const auto &yStr = matches[6].str();
+            int attr = cmd.values[4];
+            const auto &xStr = cmd.args[5];
+            const auto &yStr = cmd.args[6];
 
             const auto &stdinfo = imageManager.getStdinfo(imageType, zIndex);
 
@@ -620,9 +697,9 @@ void SceneManager::handleCommand(const std::string &cmdString)
         else if (asset == "fade")
         {
             // eg 5 fade 240 255 0
-            const unsigned int frames = std::stoi(matches[4].str());
-            const Uint8 startAlpha = std::stoi(matches[5].str());
-            const Uint8 targetAlpha = std::stoi(matches[6].str());
+            const unsigned int frames = cmd.values[4];
+            const Uint8 startAlpha = cmd.values[5];
+            const Uint8 targetAlpha = cmd.values[6];
 
             addSectionFrames(frames);
 
@@ -647,15 +724,15 @@ void SceneManager::handleCommand(const std::string &cmdString)
             asset == "m2amove2" ||
             asset == "m2amove3")
         {
-            const auto &rdrawStr = matches[4].str();
-            const auto &xShiftStr = matches[5].str();
-            auto yShiftStr = matches[6].str();
+            const auto &xShiftStr = cmd.args[5];
+            auto yShiftStr = cmd.args[6];
 
             // No movement on axis if empty
             if (yShiftStr.empty())
                 yShiftStr = "@";
 
-            unsigned int rdraw = std::stoi(rdrawStr);
+            // Frame counts are plain digits unlike the shifts, which may be expressions
+            unsigned int rdraw = cmd.values[4];
             int targetXShift = parser.parse(xShiftStr, prevXShift);
             int targetYShift = parser.parse(yShiftStr, prevYShift);
 
@@ -671,8 +748,8 @@ void SceneManager::handleCommand(const std::string &cmdString)
             if (asset.length() < 9)
                 return;
 
-            const auto &widthStr = matches[4].str();
-            const auto &heightStr = matches[5].str();
+            const auto &widthStr = cmd.args[4];
+            const auto &heightStr = cmd.args[5];
             int width = widthStr.empty() ? WINDOW_WIDTH : parser.parse(widthStr);
             int height = heightStr.empty() ? WINDOW_HEIGHT : parser.parse(heightStr);
 
@@ -680,8 +757,8 @@ void SceneManager::handleCommand(const std::string &cmdString)
 
             imageManager.createSolid(asset, width, height, color);
 
-            const auto &xShiftStr = matches[6].str();
-            const auto &yShiftStr = matches[7].str();
+            const auto &xShiftStr = cmd.args[6];
+            const auto &yShiftStr = cmd.args[7];
 
             int xShift = xShiftStr.empty() ? 0 : parser.parse(xShiftStr, prevXShift);
             int yShift = yShiftStr.empty() ? 0 : parser.parse(yShiftStr, prevYShift);
@@ -692,10 +769,10 @@ void SceneManager::handleCommand(const std::string &cmdString)
         else
         {
 
-            const auto &xShiftStr = matches[4].str();
-            const auto &yShiftStr = matches[5].str();
-            const auto &opt1 = matches[6].str();
-            const auto &opt2 = matches[7].str();
+            const auto &xShiftStr = cmd.args[4];
+            const auto &yShiftStr = cmd.args[5];
+            const auto &opt1 = cmd.args[6];
+            const auto &opt2 = cmd.args[7];
 
             int xShift = xShiftStr.empty() ? 0 : parser.parse(xShiftStr, prevXShift);
             int yShift = yShiftStr.empty() ? 0 : parser.parse(yShiftStr, prevYShift);
@@ -703,60 +780,72 @@ void SceneManager::handleCommand(const std::string &cmdString)
             imageManager.setImage(imageType, zIndex, asset, xShift, yShift);
         }
     }
+    break;
 
     // Conditional statement
-    else if (std::regex_search(cmdString, matches, std::regex("^if\\s*\\((.+)\\)\\s+(.+)")))
+    case COMMAND_TYPE::IF:
     {
-        std::string cond = matches[1].str();
+        std::string cond = cmd.args[1];
         if (parser.parse(cond) == 1)
         {
-            handleCommand(matches[2].str());
+            // Statement was compiled along with the script
+            handleCommand(currScript->branches[line.branch]);
         }
     }
+    break;
 
     // Next scene
-    else if (std::regex_search(cmdString, matches, std::regex("^next (\\S+)")))
+    case COMMAND_TYPE::NEXT:
     {
-        setScript(matches[1].str());
+        setScript(cmd.args[1]);
     }
+    break;
 
-    // Non-capturing regex
     // Indicates start of choices
-    else if (std::regex_search(cmdString, std::regex("^fselect")))
+    case COMMAND_TYPE::FSELECT:
     {
         // Should not be required, but clear just to be sure
         currChoices.clear();
+        imageManager.markDirty();
     }
+    break;
 
     // Choice options
-    else if (std::regex_match(cmdString, matches, std::regex("^(\\d+) (\\w+) (.+)")))
+    case COMMAND_TYPE::CHOICE:
     {
-        currChoices.push_back({imageManager, cleanText(matches[2].str()), cleanText(matches[3].str())});
+        currChoices.push_back({imageManager, cmd.args[2], cmd.args[3]});
+        imageManager.markDirty();
     }
+    break;
 
     // Auto mode
-    else if (std::regex_search(cmdString, matches, std::regex("^auto (\\w+)")))
+    case COMMAND_TYPE::AUTO:
     {
-        const std::string &status = matches[1].str();
+        const std::string &status = cmd.args[1];
         if (status == "on")
             autoMode = 0;
         else if (status == "off")
             autoMode = -1;
     }
+    break;
 
-    // Non-capturing regex
     // Variable assignment
-    else if (std::regex_match(cmdString, std::regex("^#.+")))
+    case COMMAND_TYPE::ASSIGN:
     {
         try
         {
-            parser.parse(cmdString);
+            parser.parse(line.text);
         }
         catch (const std::runtime_error &error)
         {
             // Ignore parse errors
         }
     }
+    break;
+
+    default:
+        break;
+    }
 }
 
 void SceneManager::selectChoice(int idx)
@@ -765,10 +854,11 @@ void SceneManager::selectChoice(int idx)
     {
         setScript(currChoices[idx].target);
         currChoices.clear();
+        imageManager.markDirty();
     }
     else
     {
-        LOG << "Selected choice out of bounds!";
+        LOG_WARN << "Selected choice out of bounds!";
     }
 }
 
@@ -783,7 +873,9 @@ json SceneManager::getCurrentState()
     json &jScene = j[KEY_SCENE];
     jScene[KEY_SYMBOL_TABLE] = json(parser.getSymbolTable());
     jScene[KEY_SCRIPT_NAME] = currScriptName;
-    jScene[KEY_OFFSET] = stringTableBase - reinterpret_cast<byte *>(stringOffsetTable);
+
+    // Counted back from the end of the string offset table as saves have always been
+    jScene[KEY_OFFSET] = currScript ? currScript->offsetFromLine(currLine) : 0;
 
     json &jChoices = jScene[KEY_CHOICE];
     for (const auto &c : currChoices)
@@ -792,6 +884,83 @@ json SceneManager::getCurrentState()
     return j;
 }
 
+// Record the state at a break in the history
+// Parts equal to those of the previous break are shared instead of stored again
+void SceneManager::pushSnapshot()
+{
+    const StateSnapshot *prev = stateHistory.empty() ? NULL : &stateHistory.back();
+    StateSnapshot snapshot;
+
+    stateWriter.clear();
+    imageManager.snapshot(stateWriter);
+    snapshot.image = StateHistory::share(stateWriter, prev ? prev->image : NULL);
+
+    stateWriter.clear();
+    audioManager.snapshot(stateWriter);
+    snapshot.audio = StateHistory::share(stateWriter, prev ? prev->audio : NULL);
+
+    stateWriter.clear();
+    parser.snapshotSymbols(stateWriter);
+    snapshot.symbols = StateHistory::share(stateWriter, prev ? prev->symbols : NULL);
+
+    stateWriter.clear();
+    stateWriter.write(imageManager.currText);
+    stateWriter.write(imageManager.currSpeaker);
+    stateWriter.write(currScriptName);
+    stateWriter.write<uint32>(currScript ? currScript->offsetFromLine(currLine) : 0);
+    stateWriter.write<uint32>(currChoices.size());
+    for (const auto &c : currChoices)
+    {
+        stateWriter.write(c.target);
+        stateWriter.write(c.prompt);
+    }
+    snapshot.scene = StateHistory::share(stateWriter, prev ? prev->scene : NULL);
+
+    stateHistory.push(std::move(snapshot));
+}
+
+// Same as loadStateJson for a snapshot from the history
+void SceneManager::loadSnapshot(const StateSnapshot &snapshot)
+{
+    resetForLoad();
+
+    StateReader scene(*snapshot.scene);
+    imageManager.currText = scene.readString();
+    imageManager.currSpeaker = scene.readString();
+
+    const std::string &scriptName = scene.readString();
+    setScriptOffset({scriptName, scene.read<uint32>()});
+
+    StateReader symbols(*snapshot.symbols);
+    parser.loadSymbolSnapshot(symbols);
+
+    StateReader image(*snapshot.image);
+    imageManager.loadSnapshot(image);
+
+    StateReader audio(*snapshot.audio);
+    audioManager.loadSnapshot(audio);
+
+    autoMode = -1;
+
+    currChoices.clear();
+    for (uint32 n = scene.read<uint32>(); n > 0; n--)
+    {
+        const std::string &target = scene.readString();
+        currChoices.push_back({imageManager, target, scene.readString()});
+    }
+
+    imageManager.markDirty();
+}
+
+// Override and reset existing timer/text display
+void SceneManager::resetForLoad()
+{
+    parseScript = false;
+    waitTargetFrames = 0;
+    imageManager.setShowMwnd();
+    imageManager.setShowText();
+}
+
 void SceneManager::saveState(const int saveSlot)
 {
     Utils::save(std::to_string(saveSlot), getCurrentState());
@@ -804,13 +973,9 @@ void SceneManager::loadStateJson(const json &j)
     const json &jImage = j.at(KEY_IMAGE);
     const json &jAudio = j.at(KEY_AUDIO);
 
-    // Override and reset existing timer/text display
-    parseScript = false;
-    waitTargetFrames = 0;
-    imageManager.setShowMwnd();
-    imageManager.setShowText();
+    resetForLoad();
 
-    setScriptOffset({jScene.at(KEY_SCRIPT_NAME), reinterpret_cast<byte *>(jScene.at(KEY_OFFSET).get<Uint64>())});
+    setScriptOffset({jScene.at(KEY_SCRIPT_NAME), jScene.at(KEY_OFFSET).get<uint32>()});
     parser.setSymbolTable(jScene.at(KEY_SYMBOL_TABLE).get<SymbolTable>());
     imageManager.currText = j.at(KEY_TEXT);
     imageManager.currSpeaker = j.at(KEY_SPEAKER);
@@ -824,6 +989,8 @@ void SceneManager::loadStateJson(const json &j)
     // Populate choices from savedata
     for (auto &el : jScene.at(KEY_CHOICE).items())
         currChoices.push_back({imageManager, el.key(), el.value()});
+
+    imageManager.markDirty();
 }
 
 void SceneManager::loadState(const int saveSlot)
@@ -831,7 +998,7 @@ void SceneManager::loadState(const int saveSlot)
     const auto &j = Utils::load(std::to_string(saveSlot));
     if (j.empty())
     {
-        LOG << "No save data on slot " << saveSlot;
+        LOG_WARN << "No save data on slot " << saveSlot;
         return;
     }
 
@@ -841,6 +1008,6 @@ void SceneManager::loadState(const int saveSlot)
     }
     catch (const json::out_of_range &e)
     {
-        LOG << "Invalid save data on slot " << saveSlot;
+        LOG_ERROR << "Invalid save data on slot " << saveSlot;
     }
 }
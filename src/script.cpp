@@ -0,0 +1,434 @@
+#include <script.hpp>
+#include <utils.hpp>
+#include <file.hpp>
+#include <profiler.hpp>
+
+#include <cstring>
+#include <cstddef>
+
+#ifdef SCRIPT_CACHE_DIR
+#include <fstream>
+#include <filesystem>
+#endif
+
+std::shared_ptr<const CompiledScript> ScriptCache::get(const std::string &name, byte *buf, size_t sz)
+{
+    const uint64 contentHash = hash(buf, sz);
+
+    auto got = index.find(name);
+    if (got != index.end() && got->second->second->hash == contentHash)
+    {
+        scripts.splice(scripts.begin(), scripts, got->second);
+        return got->second->second;
+    }
+
+    auto script = build(name, buf, sz, contentHash);
+    if (script)
+        add(name, script);
+
+    return script;
+}
+
+std::shared_ptr<const CompiledScript> ScriptCache::build(const std::string &name, byte *buf, size_t sz)
+{
+    return build(name, buf, sz, hash(buf, sz));
+}
+
+std::shared_ptr<const CompiledScript> ScriptCache::build(const std::string &name, byte *buf, size_t sz, const uint64 contentHash)
+{
+#ifdef SCRIPT_CACHE_DIR
+    auto script = readFile(name, contentHash);
+    if (script)
+        return script;
+#endif
+
+    auto compiled = compile(buf, sz, contentHash);
+
+#ifdef SCRIPT_CACHE_DIR
+    if (compiled)
+        writeFile(name, *compiled);
+#endif
+
+    return compiled;
+}
+
+std::shared_ptr<const CompiledScript> ScriptCache::find(const std::string &name)
+{
+    auto got = index.find(name);
+    if (got == index.end())
+        return NULL;
+
+    scripts.splice(scripts.begin(), scripts, got->second);
+    return got->second->second;
+}
+
+void ScriptCache::add(const std::string &name, const std::shared_ptr<const CompiledScript> &script)
+{
+    auto got = index.find(name);
+    if (got != index.end())
+    {
+        scripts.erase(got->second);
+        index.erase(got);
+    }
+
+    scripts.emplace_front(name, script);
+    index[name] = scripts.begin();
+
+    // Scripts still being run are kept alive by their owners
+    while (scripts.size() > SCRIPT_CACHE_SIZE)
+    {
+        index.erase(scripts.back().first);
+        scripts.pop_back();
+    }
+}
+
+// 64-bit FNV-1a
+uint64 ScriptCache::hash(const byte *buf, size_t sz)
+{
+    uint64 h = 0xCBF29CE484222325;
+    for (size_t i = 0; i < sz; i++)
+    {
+        h ^= buf[i];
+        h *= 0x100000001B3;
+    }
+
+    return h;
+}
+
+// Uncompress a raw CST file and compile every line of it
+std::shared_ptr<CompiledScript> ScriptCache::compile(byte *buf, size_t sz, const uint64 contentHash)
+{
+    PROFILE_SCOPE(SCRIPT);
+
+    CSTHeader *scriptHeader = reinterpret_cast<CSTHeader *>(buf);
+
+    // Verify signature
+    if (sz < sizeof(CSTHeader) || strncmp(scriptHeader->FileSignature, SCRIPT_SIGNATURE, sizeof(scriptHeader->FileSignature)) != 0)
+    {
+        LOG_ERROR << "Invalid CST file signature!";
+        return NULL;
+    }
+
+    // Get pointer to start of raw data
+    auto *scriptDataRaw = reinterpret_cast<byte *>(scriptHeader + 1);
+
+    std::vector<byte> scriptData;
+    if (scriptHeader->CompressedSize == 0)
+    {
+        // Uncompressed script
+        scriptData = std::vector<byte>(scriptDataRaw, scriptDataRaw + scriptHeader->DecompressedSize);
+    }
+    else
+    {
+        scriptData = Utils::zlibUncompress(scriptHeader->DecompressedSize, scriptDataRaw, scriptHeader->CompressedSize);
+        if (scriptData.empty())
+        {
+            LOG_ERROR << "Script uncompress error";
+            return NULL;
+        }
+    }
+
+    if (scriptData.size() < sizeof(ScriptDataHeader))
+    {
+        LOG_ERROR << "Script too short";
+        return NULL;
+    }
+
+    ScriptDataHeader *scriptDataHeader = reinterpret_cast<ScriptDataHeader *>(scriptData.data());
+    byte *tablesStart = reinterpret_cast<byte *>(scriptDataHeader + 1);
+    byte *dataEnd = scriptData.data() + scriptData.size();
+
+    // Locate offset table and string table
+    StringOffsetTable *stringOffsetTable = reinterpret_cast<StringOffsetTable *>(tablesStart + scriptDataHeader->StringOffsetTableOffset);
+    byte *stringTableBase = tablesStart + scriptDataHeader->StringTableOffset;
+
+    if (scriptDataHeader->StringOffsetTableOffset > scriptDataHeader->StringTableOffset || stringTableBase > dataEnd)
+    {
+        LOG_ERROR << "Invalid script tables";
+        return NULL;
+    }
+
+    auto script = std::make_shared<CompiledScript>();
+    script->hash = contentHash;
+    script->tableBytes = scriptDataHeader->StringTableOffset - scriptDataHeader->StringOffsetTableOffset;
+
+    // Lines keep the order of the offset table so save offsets map onto them directly
+    for (; reinterpret_cast<byte *>(stringOffsetTable) < stringTableBase; stringOffsetTable++)
+    {
+        ScriptLine line = {0, "", {}, -1};
+
+        const byte *entry = stringTableBase + stringOffsetTable->Offset;
+        if (entry + offsetof(StringTable, StringStart) < dataEnd)
+        {
+            auto stringTable = reinterpret_cast<const StringTable *>(entry);
+            const char *start = &stringTable->StringStart;
+
+            line.type = stringTable->Type;
+            line.text.assign(start, strnlen(start, dataEnd - reinterpret_cast<const byte *>(start)));
+
+            compileLine(*script, line);
+        }
+
+        script->lines.push_back(std::move(line));
+    }
+
+    return script;
+}
+
+// Do the string processing of a line that would otherwise happen every time it is run
+void ScriptCache::compileLine(CompiledScript &script, ScriptLine &line)
+{
+    switch (line.type)
+    {
+    case 0x20: // Display a message
+        // Empty messages do nothing, so they are compiled as no-ops
+        if (line.text.empty())
+            line.type = 0;
+        else
+            Utils::cleanText(line.text, line.text, line.spans);
+        break;
+
+    case 0x21: // Set speaker of the message
+        line.text = Utils::cleanText(line.text);
+        break;
+
+    case 0x30: // Perform any other command
+    {
+        auto &cmd = line.cmd;
+        if (!CommandParser::parse(line.text, cmd))
+            break;
+
+        switch (cmd.type)
+        {
+        case COMMAND_TYPE::CHOICE:
+            cmd.args[2] = Utils::cleanText(cmd.args[2]);
+            cmd.args[3] = Utils::cleanText(cmd.args[3]);
+            break;
+
+#ifdef LOWERCASE_ASSETS
+        case COMMAND_TYPE::PCM:
+            Utils::lowercase(cmd.args[1]);
+            break;
+
+        case COMMAND_TYPE::SE:
+            // Keywords are already lowercase
+            Utils::lowercase(cmd.args[2]);
+            if (cmd.args[2] == "loop")
+                Utils::lowercase(cmd.args[3]);
+            break;
+#endif
+
+        case COMMAND_TYPE::IF:
+        {
+            // Statements may be nested ifs, so compile before taking the index
+            ScriptLine branch = {0x30, cmd.args[2], {}, -1};
+            compileLine(script, branch);
+
+            line.branch = script.branches.size();
+            script.branches.push_back(std::move(branch));
+            break;
+        }
+
+        default:
+            break;
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+#ifdef SCRIPT_CACHE_DIR
+namespace
+{
+    template <typename T>
+    void writeValue(std::ofstream &ofs, const T &value)
+    {
+        ofs.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void writeString(std::ofstream &ofs, const std::string &s)
+    {
+        writeValue<uint32>(ofs, s.size());
+        ofs.write(s.data(), s.size());
+    }
+
+    void writeLine(std::ofstream &ofs, const ScriptLine &line)
+    {
+        writeValue(ofs, line.type);
+        writeValue<int32_t>(ofs, line.branch);
+        writeString(ofs, line.text);
+
+        writeValue<uint32>(ofs, line.spans.size());
+        for (const auto &span : line.spans)
+        {
+            writeValue(ofs, static_cast<byte>(span.type));
+            writeValue<uint32>(ofs, span.start);
+            writeValue<uint32>(ofs, span.length);
+        }
+
+        writeValue(ofs, static_cast<byte>(line.cmd.type));
+        for (int i = 1; i < MAX_COMMAND_ARGS; i++)
+        {
+            writeString(ofs, line.cmd.args[i]);
+            writeValue<int32_t>(ofs, line.cmd.values[i]);
+        }
+    }
+
+    // Smallest encoding of a line and of a span, used to bound counts read from the file
+    const uint64 MIN_LINE_BYTES = sizeof(byte) + sizeof(int32_t) + 2 * sizeof(uint32) + sizeof(byte) + (MAX_COMMAND_ARGS - 1) * (sizeof(uint32) + sizeof(int32_t));
+    const uint64 SPAN_BYTES = sizeof(byte) + 2 * sizeof(uint32);
+
+    template <typename T>
+    bool readValue(std::ifstream &ifs, T &value)
+    {
+        return static_cast<bool>(ifs.read(reinterpret_cast<char *>(&value), sizeof(T)));
+    }
+
+    // Whether count items of at least itemBytes each fit before end
+    // Checked before anything is allocated so a corrupt count cannot exhaust memory
+    bool fits(std::ifstream &ifs, const std::streamoff end, const uint64 count, const uint64 itemBytes)
+    {
+        const std::streamoff pos = ifs.tellg();
+        return pos >= 0 && pos <= end && count <= static_cast<uint64>(end - pos) / itemBytes;
+    }
+
+    bool readString(std::ifstream &ifs, const std::streamoff end, std::string &s)
+    {
+        uint32 len;
+        if (!readValue(ifs, len) || !fits(ifs, end, len, 1))
+            return false;
+
+        s.resize(len);
+        return static_cast<bool>(ifs.read(&s[0], len));
+    }
+
+    bool readLine(std::ifstream &ifs, const std::streamoff end, ScriptLine &line)
+    {
+        int32_t branch;
+        uint32 spanCount;
+        byte cmdType;
+
+        if (!readValue(ifs, line.type) || !readValue(ifs, branch) || !readString(ifs, end, line.text) || !readValue(ifs, spanCount) ||
+            !fits(ifs, end, spanCount, SPAN_BYTES))
+            return false;
+
+        line.branch = branch;
+
+        line.spans.resize(spanCount);
+        for (auto &span : line.spans)
+        {
+            byte spanType;
+            uint32 start, length;
+            if (!readValue(ifs, spanType) || !readValue(ifs, start) || !readValue(ifs, length))
+                return false;
+
+            span = {static_cast<TEXT_SPAN>(spanType), start, length};
+        }
+
+        if (!readValue(ifs, cmdType))
+            return false;
+
+        line.cmd.type = static_cast<COMMAND_TYPE>(cmdType);
+
+        for (int i = 1; i < MAX_COMMAND_ARGS; i++)
+        {
+            int32_t value;
+            if (!readString(ifs, end, line.cmd.args[i]) || !readValue(ifs, value))
+                return false;
+
+            line.cmd.values[i] = value;
+        }
+
+        return true;
+    }
+
+    // Statements of `if` lines must exist, as they are run without further checks
+    // Nested statements are compiled first, so a branch may only refer to those before it
+    bool validBranch(const ScriptLine &line, const size_t limit)
+    {
+        if (line.cmd.type == COMMAND_TYPE::IF)
+            return line.branch >= 0 && static_cast<size_t>(line.branch) < limit;
+
+        return line.branch == -1;
+    }
+}
+
+// Load a compiled script written by a previous run, NULL if it is missing or was compiled from other data
+std::shared_ptr<CompiledScript> ScriptCache::readFile(const std::string &name, const uint64 contentHash)
+{
+    std::ifstream ifs(SCRIPT_CACHE_DIR + name + SCRIPT_CACHE_EXT, std::ios::binary | std::ios::ate);
+    if (!ifs.is_open())
+        return NULL;
+
+    const std::streamoff end = ifs.tellg();
+    ifs.seekg(0);
+
+    char signature[sizeof(SCRIPT_CACHE_SIGNATURE) - 1];
+    uint32 version, lineCount, branchCount;
+
+    auto script = std::make_shared<CompiledScript>();
+
+    if (!ifs.read(signature, sizeof(signature)) || strncmp(signature, SCRIPT_CACHE_SIGNATURE, sizeof(signature)) != 0 ||
+        !readValue(ifs, version) || version != SCRIPT_CACHE_VERSION ||
+        !readValue(ifs, script->hash) || script->hash != contentHash ||
+        !readValue(ifs, script->tableBytes) || !readValue(ifs, lineCount) || !readValue(ifs, branchCount) ||
+        !fits(ifs, end, static_cast<uint64>(lineCount) + branchCount, MIN_LINE_BYTES))
+        return NULL;
+
+    script->lines.resize(lineCount);
+    script->branches.resize(branchCount);
+
+    for (auto &line : script->lines)
+    {
+        if (!readLine(ifs, end, line) || !validBranch(line, branchCount))
+            return NULL;
+    }
+
+    for (size_t i = 0; i < script->branches.size(); i++)
+    {
+        if (!readLine(ifs, end, script->branches[i]) || !validBranch(script->branches[i], i))
+            return NULL;
+    }
+
+    return script;
+}
+
+void ScriptCache::writeFile(const std::string &name, const CompiledScript &script)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(SCRIPT_CACHE_DIR, ec);
+
+    // Write to a temporary file first so an interrupted write never leaves a partial cache behind
+    const std::string &path = SCRIPT_CACHE_DIR + name + SCRIPT_CACHE_EXT;
+    const std::string &tmpPath = path + ".tmp";
+
+    std::ofstream ofs(tmpPath, std::ios::binary | std::ios::trunc);
+
+    ofs.write(SCRIPT_CACHE_SIGNATURE, sizeof(SCRIPT_CACHE_SIGNATURE) - 1);
+    writeValue<uint32>(ofs, SCRIPT_CACHE_VERSION);
+    writeValue(ofs, script.hash);
+    writeValue(ofs, script.tableBytes);
+    writeValue<uint32>(ofs, script.lines.size());
+    writeValue<uint32>(ofs, script.branches.size());
+
+    for (const auto &line : script.lines)
+        writeLine(ofs, line);
+
+    for (const auto &line : script.branches)
+        writeLine(ofs, line);
+
+    ofs.close();
+    if (!ofs)
+    {
+        LOG_WARN << "Could not write script cache for " << name;
+        return;
+    }
+
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec)
+        LOG_WARN << "Could not replace script cache for " << name << ": " << ec.message();
+}
+#endif
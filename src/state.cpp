@@ -0,0 +1,31 @@
+#include <state.hpp>
+
+void StateHistory::push(StateSnapshot &&snapshot)
+{
+    if (count == snapshots.size())
+    {
+        start = (start + 1) % snapshots.size();
+        count--;
+    }
+
+    snapshots[(start + count) % snapshots.size()] = std::move(snapshot);
+    count++;
+}
+
+void StateHistory::pop()
+{
+    if (count == 0)
+        return;
+
+    // Release parts not shared with other snapshots
+    snapshots[(start + count - 1) % snapshots.size()] = {};
+    count--;
+}
+
+StatePart StateHistory::share(const StateWriter &writer, const StatePart &prev)
+{
+    if (prev && *prev == writer.buf)
+        return prev;
+
+    return std::make_shared<const std::vector<byte>>(writer.buf);
+}
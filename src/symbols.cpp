@@ -0,0 +1,135 @@
+#include <symbols.hpp>
+
+#include <cmath>
+#include <climits>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+
+SymbolStore::SymbolStore() : dense(SYMBOL_DENSE_SIZE), used(SYMBOL_DENSE_SIZE) {}
+
+double *SymbolStore::get(const int idx)
+{
+    if (idx >= 0 && idx < SYMBOL_DENSE_SIZE)
+    {
+        used[idx] = true;
+        return &dense[idx];
+    }
+
+    return &sparse[idx];
+}
+
+// Same entry as the name std::to_string gives the value
+double *SymbolStore::get(const double value)
+{
+    // Whole numbers format exactly, except -0 which keeps its sign
+    if (value == std::floor(value) && value >= INT_MIN && value <= INT_MAX && !(value == 0 && std::signbit(value)))
+        return get(static_cast<int>(value));
+
+    // Values that round to a whole number share its name
+    const std::string &name = std::to_string(value);
+
+    int idx;
+    if (toIndex(name, idx))
+        return get(idx);
+
+    return &named[name];
+}
+
+SymbolTable SymbolStore::dump() const
+{
+    SymbolTable table = named;
+
+    for (int i = 0; i < SYMBOL_DENSE_SIZE; i++)
+    {
+        if (used[i])
+            table[std::to_string(static_cast<double>(i))] = dense[i];
+    }
+
+    for (const auto &entry : sparse)
+        table[std::to_string(static_cast<double>(entry.first))] = entry.second;
+
+    return table;
+}
+
+void SymbolStore::clear()
+{
+    std::fill(dense.begin(), dense.end(), 0);
+    std::fill(used.begin(), used.end(), false);
+    sparse.clear();
+    named.clear();
+}
+
+void SymbolStore::load(const SymbolTable &table)
+{
+    clear();
+
+    for (const auto &entry : table)
+    {
+        int idx;
+        if (toIndex(entry.first, idx))
+            *get(idx) = entry.second;
+        else
+            named[entry.first] = entry.second;
+    }
+}
+
+// Integer indexed variables as index and value pairs, then the named ones
+void SymbolStore::snapshot(StateWriter &writer) const
+{
+    writer.write<uint32>(std::count(used.begin(), used.end(), true) + sparse.size());
+
+    for (int i = 0; i < SYMBOL_DENSE_SIZE; i++)
+    {
+        if (!used[i])
+            continue;
+
+        writer.write<int32_t>(i);
+        writer.write(dense[i]);
+    }
+
+    for (const auto &entry : sparse)
+    {
+        writer.write<int32_t>(entry.first);
+        writer.write(entry.second);
+    }
+
+    writer.write<uint32>(named.size());
+    for (const auto &entry : named)
+    {
+        writer.write(entry.first);
+        writer.write(entry.second);
+    }
+}
+
+void SymbolStore::loadSnapshot(StateReader &reader)
+{
+    clear();
+
+    for (uint32 n = reader.read<uint32>(); n > 0; n--)
+    {
+        const int idx = reader.read<int32_t>();
+        *get(idx) = reader.read<double>();
+    }
+
+    for (uint32 n = reader.read<uint32>(); n > 0; n--)
+    {
+        const std::string &name = reader.readString();
+        named[name] = reader.read<double>();
+    }
+}
+
+// Index for names exactly as std::to_string formats an integer
+bool SymbolStore::toIndex(const std::string &name, int &idx)
+{
+    const char *start = name.c_str();
+    char *end;
+
+    errno = 0;
+    const long value = strtol(start, &end, 10);
+    if (end == start || errno == ERANGE || value < INT_MIN || value > INT_MAX)
+        return false;
+
+    idx = value;
+    return std::to_string(static_cast<double>(idx)) == name;
+}
@@ -0,0 +1,231 @@
+#include <text.hpp>
+#include <utils.hpp>
+#include <profiler.hpp>
+
+#include <algorithm>
+
+const TextRenderer::TextLayout &TextRenderer::layout(TTF_Font *font, const std::string &text, const int wrapWidth)
+{
+    PROFILE_SCOPE(TEXT);
+
+    const size_t fontIdx = getFontIndex(font);
+
+    auto &cache = layouts[{fontIdx, wrapWidth}];
+
+    auto got = cache.find(text);
+    if (got != cache.end())
+        return got->second;
+
+    // Old text is rarely shown again, so simply start over when full
+    if (cache.size() >= TEXT_LAYOUT_CACHE)
+        cache.clear();
+
+    return cache.emplace(text, createLayout(font, fontIdx, text, wrapWidth)).first->second;
+}
+
+// Copy the glyphs of a laid out string with the top left at x, y
+// Only the color channels are applied as with the blended TTF renderers
+void TextRenderer::draw(const TextLayout &layout, const int x, const int y, const SDL_Color &color)
+{
+    for (const auto &quad : layout.quads)
+    {
+        SDL_Texture *texture = atlas.getTexture(quad.page);
+
+        // Mods are captured per copy, reset them for images sharing the page
+        SDL_SetTextureColorMod(texture, color.r, color.g, color.b);
+        SDL_SetTextureAlphaMod(texture, 255);
+
+        SDL_Rect dst = {x + quad.dst.x, y + quad.dst.y, quad.dst.w, quad.dst.h};
+        SDL_RenderCopy(renderer, texture, &quad.src, &dst);
+
+        SDL_SetTextureColorMod(texture, 255, 255, 255);
+    }
+}
+
+size_t TextRenderer::getFontIndex(TTF_Font *font)
+{
+    for (size_t i = 0; i < fonts.size(); i++)
+    {
+        if (fonts[i] == font)
+            return i;
+    }
+
+    fonts.push_back(font);
+    return fonts.size() - 1;
+}
+
+// Rasterize a glyph into the atlas the first time it is used
+const TextRenderer::Glyph &TextRenderer::getGlyph(TTF_Font *font, const size_t fontIdx, const Uint32 codepoint)
+{
+    const uint64 key = (static_cast<uint64>(fontIdx) << 32) | codepoint;
+
+    auto got = glyphs.find(key);
+    if (got != glyphs.end())
+        return got->second;
+
+    Glyph glyph = {-1, {0, 0, 0, 0}, 0};
+
+    // Older SDL_ttf only renders glyphs in the BMP
+    const Uint16 ch = codepoint > 0xFFFF ? '?' : codepoint;
+
+    int advance;
+    if (TTF_GlyphMetrics(font, ch, NULL, NULL, NULL, NULL, &advance) == 0)
+        glyph.advance = advance;
+
+    // Spaces only move the pen
+    if (ch != ' ')
+    {
+        // Rendered in white so any color can be applied with a color mod
+        SDL_Surface *surface;
+        {
+            PROFILE_SCOPE(GLYPH);
+            surface = TTF_RenderGlyph_Blended(font, ch, {255, 255, 255, 255});
+        }
+
+        if (surface != NULL && surface->format->format != SDL_PIXELFORMAT_ARGB8888)
+        {
+            SDL_Surface *converted = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+            SDL_FreeSurface(surface);
+            surface = converted;
+        }
+
+        if (surface != NULL)
+        {
+            TextureAtlas::Slot slot;
+            if (atlas.add(renderer, surface->pixels, surface->pitch, surface->w, surface->h, slot))
+            {
+                glyph.page = slot.page;
+                glyph.src = slot.rect;
+            }
+            else
+            {
+                LOG_WARN_LIMITED << "Could not add glyph " << codepoint << " to atlas";
+            }
+
+            if (glyph.advance == 0)
+                glyph.advance = surface->w;
+
+            SDL_FreeSurface(surface);
+        }
+    }
+
+    return glyphs.emplace(key, glyph).first->second;
+}
+
+// Place glyphs line by line, wrapping after the last space or anywhere if there is none
+TextRenderer::TextLayout TextRenderer::createLayout(TTF_Font *font, const size_t fontIdx, const std::string &text, const int wrapWidth)
+{
+    TextLayout layout = {{}, 0, 0};
+    auto &quads = layout.quads;
+
+    const int lineSkip = TTF_FontLineSkip(font);
+
+    int x = 0;
+    int y = 0;
+
+    // Position after the last space on the current line
+    bool canBreak = false;
+    size_t breakQuad = 0;
+    int breakX = 0;
+
+    size_t i = 0;
+    while (i < text.size())
+    {
+        const Uint32 codepoint = nextCodepoint(text, i);
+
+        if (codepoint == '\n')
+        {
+            layout.w = std::max(layout.w, x);
+            x = 0;
+            y += lineSkip;
+            canBreak = false;
+            continue;
+        }
+
+        const Glyph &glyph = getGlyph(font, fontIdx, codepoint);
+
+        // Move the word after the last space down to a new line
+        if (wrapWidth > 0 && x + glyph.advance > wrapWidth && canBreak && codepoint != ' ')
+        {
+            layout.w = std::max(layout.w, breakX);
+
+            for (size_t q = breakQuad; q < quads.size(); q++)
+            {
+                quads[q].dst.x -= breakX;
+                quads[q].dst.y += lineSkip;
+            }
+
+            x -= breakX;
+            y += lineSkip;
+            canBreak = false;
+        }
+
+        // Words longer than a line are broken anywhere
+        if (wrapWidth > 0 && x > 0 && x + glyph.advance > wrapWidth)
+        {
+            layout.w = std::max(layout.w, x);
+            x = 0;
+            y += lineSkip;
+            canBreak = false;
+
+            // Spaces at the start of a wrapped line are dropped
+            if (codepoint == ' ')
+                continue;
+        }
+
+        if (glyph.page >= 0)
+            quads.push_back({glyph.page, glyph.src, {x, y, glyph.src.w, glyph.src.h}});
+
+        x += glyph.advance;
+
+        if (codepoint == ' ')
+        {
+            canBreak = true;
+            breakQuad = quads.size();
+            breakX = x;
+        }
+    }
+
+    layout.w = std::max(layout.w, x);
+    layout.h = y + TTF_FontHeight(font);
+
+    return layout;
+}
+
+// Decode the UTF-8 sequence at i and advance past it
+// Invalid bytes are returned as is
+Uint32 TextRenderer::nextCodepoint(const std::string &s, size_t &i)
+{
+    const unsigned char c = s[i++];
+
+    if (c < 0x80)
+        return c;
+
+    // Number of continuation bytes from the lead byte
+    int extra;
+    if ((c & 0xE0) == 0xC0)
+        extra = 1;
+    else if ((c & 0xF0) == 0xE0)
+        extra = 2;
+    else if ((c & 0xF8) == 0xF0)
+        extra = 3;
+    else
+        return c;
+
+    Uint32 codepoint = c & (0x3F >> extra);
+
+    if (i + extra > s.size())
+        return c;
+
+    for (int k = 0; k < extra; k++)
+    {
+        const unsigned char cc = s[i + k];
+        if ((cc & 0xC0) != 0x80)
+            return c;
+
+        codepoint = (codepoint << 6) | (cc & 0x3F);
+    }
+
+    i += extra;
+    return codepoint;
+}
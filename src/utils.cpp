@@ -1,4 +1,5 @@
 #include <utils.hpp>
+#include <convtable.hpp>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +7,20 @@
 #include <string.h>
 
 #include <fstream>
+#include <unordered_map>
+
+#ifndef __EMSCRIPTEN__
+#include <filesystem>
+#endif
+
+// SIMD scan for runs of plain ASCII in sj2utf8, words of 8 bytes are used when none is available
+#if defined(__wasm_simd128__)
+#define UTILS_SIMD128
+#include <wasm_simd128.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UTILS_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace Utils
 {
@@ -65,55 +80,375 @@ namespace Utils
     }
 #endif
 
-    // Platform specific save
+    namespace
+    {
+        // Slots read or written this run, so each is parsed at most once
+        std::unordered_map<std::string, json> slotCache;
+
+#ifndef __EMSCRIPTEN__
+        std::string slotPath(const std::string &name)
+        {
+            return SAVEDATA_DIR + name + SAVEDATA_EXT;
+        }
+
+        // Slot saved to the single file used before, which is only read if a slot has no file of its own
+        json loadLegacySlot(const std::string &name)
+        {
+            static json legacySlots;
+            static bool legacyRead = false;
+
+            if (!legacyRead)
+            {
+                legacyRead = true;
+
+                std::ifstream ifs(SAVEDATA_FILENAME);
+                if (ifs.is_open())
+                {
+                    try
+                    {
+                        legacySlots = json::parse(ifs);
+                    }
+                    catch (const json::parse_error &e)
+                    {
+                        // Invalid savedata file, ignore it
+                    }
+                }
+            }
+
+            auto got = legacySlots.find(name);
+            if (got == legacySlots.end())
+                return {};
+
+            return *got;
+        }
+#endif
+    }
+
+    // Platform specific save of a single slot
+    // Other slots are not read or rewritten
     void save(const std::string &name, const json &data)
     {
+        slotCache[name] = data;
+
 #ifdef __EMSCRIPTEN__
         setLocalStorage(name, data.dump());
 #else
-        json j;
+        std::error_code ec;
+        std::filesystem::create_directories(SAVEDATA_DIR, ec);
+
+        // Write to a temporary file first so a failed save leaves the old one intact
+        const std::string &path = slotPath(name);
+        const std::string &tmpPath = path + ".tmp";
 
-        std::ifstream ifs(SAVEDATA_FILENAME);
-        if (ifs.is_open())
+        std::ofstream ofs(tmpPath, std::ios::trunc);
+        ofs << data;
+        ofs.close();
+        if (!ofs)
         {
-            try
-            {
-                j = json::parse(ifs);
-            }
-            catch (const json::parse_error &e)
-            {
-                // Invalid savedata file, ignore and create a new one
-            }
+            LOG_ERROR << "Could not write save " << name;
+            return;
         }
-        j[name] = data;
-        std::ofstream ofs(SAVEDATA_FILENAME);
-        ofs << j;
+
+        std::filesystem::rename(tmpPath, path, ec);
+        if (ec)
+            LOG_ERROR << "Could not replace save " << name << ": " << ec.message();
 #endif
     }
 
-    // Platform specific load
+    // Platform specific load of a single slot, empty if there is none
     json load(const std::string &name)
     {
+        auto got = slotCache.find(name);
+        if (got != slotCache.end())
+            return got->second;
+
+        json data;
         try
         {
 #ifdef __EMSCRIPTEN__
-            const std::string &dataRaw = getLocalStorage(name);
-            return json::parse(dataRaw);
+            data = json::parse(getLocalStorage(name));
 #else
-            std::ifstream ifs(SAVEDATA_FILENAME);
-            return json::parse(ifs).at(name);
+            std::ifstream ifs(slotPath(name));
+            if (ifs.is_open())
+                data = json::parse(ifs);
+            else
+                data = loadLegacySlot(name);
 #endif
         }
         catch (const json::parse_error &e)
         {
             return {};
         }
-        catch (const json::out_of_range &e)
+
+        if (!data.is_null())
+            slotCache[name] = data;
+
+        return data;
+    }
+
+    namespace
+    {
+        // UTF-8 bytes of every table entry in little-endian order, with the sequence length in the top byte
+        const std::vector<uint32_t> &utf8Table()
         {
-            return {};
+            static const std::vector<uint32_t> table = []()
+            {
+                std::vector<uint32_t> t(sizeof(shiftJIS_convTable) / 2);
+                for (size_t i = 0; i < t.size(); i++)
+                {
+                    const uint16_t unicodeValue = (shiftJIS_convTable[i << 1] << 8) | shiftJIS_convTable[(i << 1) + 1];
+
+                    if (unicodeValue < 0x80)
+                        t[i] = 1 << 24 | unicodeValue;
+                    else if (unicodeValue < 0x800)
+                        t[i] = 2 << 24 | (0xC0 | (unicodeValue >> 6)) | (0x80 | (unicodeValue & 0x3f)) << 8;
+                    else
+                        t[i] = 3 << 24 | (0xE0 | (unicodeValue >> 12)) | (0x80 | ((unicodeValue & 0xfff) >> 6)) << 8 | (0x80 | (unicodeValue & 0x3f)) << 16;
+                }
+                return t;
+            }();
+
+            return table;
+        }
+
+        // Length of the leading run of bytes that convert to themselves
+        // That is ASCII except 0x5C and 0x7E which become ¥ and ‾, and 0x7F which becomes a space
+        size_t plainRun(const char *in, const size_t len, char *out)
+        {
+            size_t i = 0;
+
+#if defined(UTILS_SSE2) || defined(UTILS_SIMD128)
+            for (; i + 16 <= len; i += 16)
+            {
+#ifdef UTILS_SSE2
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+                const __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x5C)), _mm_cmpgt_epi8(v, _mm_set1_epi8(0x7D)));
+
+                // Bytes with the high bit set are negative, so they are caught by the sign bit itself
+                const unsigned mask = _mm_movemask_epi8(_mm_or_si128(v, special));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), v);
+#else
+                const v128_t v = wasm_v128_load(in + i);
+                const v128_t special = wasm_v128_or(wasm_i8x16_eq(v, wasm_i8x16_splat(0x5C)), wasm_i8x16_gt(v, wasm_i8x16_splat(0x7D)));
+
+                const unsigned mask = wasm_i8x16_bitmask(wasm_v128_or(v, special));
+                wasm_v128_store(out + i, v);
+#endif
+                // Bytes past the run are written too, but are overwritten by the caller
+                if (mask)
+                    return i + __builtin_ctz(mask);
+            }
+#else
+            for (; i + 8 <= len; i += 8)
+            {
+                uint64_t w;
+                memcpy(&w, in + i, 8);
+
+                // A byte of w ^ 0x5C.. is zero where the input is a backslash
+                const uint64_t bs = w ^ 0x5C5C5C5C5C5C5C5CULL;
+                const uint64_t special = ((w | (w + 0x0202020202020202ULL)) | ((bs - 0x0101010101010101ULL) & ~bs)) & 0x8080808080808080ULL;
+                if (special)
+                    break;
+
+                memcpy(out + i, &w, 8);
+            }
+#endif
+
+            for (; i < len; i++)
+            {
+                const char c = in[i];
+                if (c < 0 || c == 0x5C || c >= 0x7E)
+                    break;
+                out[i] = c;
+            }
+
+            return i;
         }
     }
 
+    void sj2utf8(const std::string &input, std::string &output)
+    {
+        const auto &table = utf8Table();
+        const char *in = input.data();
+        const size_t len = input.length();
+
+        // ShiftJis won't give 4byte UTF8, so max. 3 byte per input char are needed
+        // The slack lets table entries be stored 4 bytes at a time
+        if (output.size() < 3 * len + 4)
+            output.resize(3 * len + 4);
+        char *out = &output[0];
+
+        size_t indexInput = 0, indexOutput = 0;
+
+        while (indexInput < len)
+        {
+            const uint8_t lead = in[indexInput];
+
+            // Text in scripts is mostly double-byte, so only look for runs after a plain byte
+            if (lead < 0x7E && lead != 0x5C)
+            {
+                const size_t run = plainRun(in + indexInput, len - indexInput, out + indexOutput);
+                indexInput += run;
+                indexOutput += run;
+                continue;
+            }
+
+            indexInput++;
+
+            size_t arrayOffset;
+            switch (lead >> 4)
+            {
+            case 0x8: // these are two-byte shiftjis
+                arrayOffset = 0x100;
+                break;
+            case 0x9:
+                arrayOffset = 0x1100;
+                break;
+            case 0xE:
+                arrayOffset = 0x2100;
+                break;
+            default: // this is one byte shiftjis
+                arrayOffset = 0;
+                break;
+            }
+
+            if (arrayOffset)
+            {
+                // A lead byte at the end of the input is dropped
+                if (indexInput >= len)
+                    break;
+                arrayOffset += (lead & 0xf) << 8;
+                arrayOffset += static_cast<uint8_t>(in[indexInput++]);
+            }
+            else
+            {
+                arrayOffset = lead;
+            }
+
+            const uint32_t entry = table[arrayOffset];
+            memcpy(out + indexOutput, &entry, 4);
+            indexOutput += entry >> 24;
+        }
+
+        output.resize(indexOutput);
+    }
+
+    std::string sj2utf8(const std::string &input)
+    {
+        std::string output;
+        sj2utf8(input, output);
+        return output;
+    }
+
+    namespace
+    {
+        // ¥ in UTF-8, which is what backslashes become in sj2utf8
+        const char YEN[] = "\xC2\xA5";
+
+        bool isLineEnd(const char c) { return c == '\n' || c == '\r'; }
+    }
+
+    // Removes formatting symbols from text in a single pass, recording what they marked
+    // Matches the old chain of regex replacements except where removing markup joins up a new escape
+    void cleanText(const std::string &rawText, std::string &text, std::vector<TextSpan> &spans)
+    {
+        thread_local std::string utf8;
+        sj2utf8(rawText, utf8);
+
+        text.clear();
+        spans.clear();
+
+        const size_t len = utf8.length();
+        size_t rubyStart = 0, rubyEnd = std::string::npos;
+
+        for (size_t i = 0; i < len;)
+        {
+            const char c = utf8[i];
+
+            if (i == rubyEnd)
+            {
+                spans.push_back({TEXT_SPAN::RUBY, rubyStart, text.size() - rubyStart});
+                rubyEnd = std::string::npos;
+                i++;
+                continue;
+            }
+
+            // Brackets are kept only if they are not closed on the same line, and the first close ends them
+            if (c == '[' && rubyEnd == std::string::npos)
+            {
+                size_t close = i + 1;
+                while (close < len && utf8[close] != ']' && !isLineEnd(utf8[close]))
+                    close++;
+
+                if (close < len && utf8[close] == ']')
+                {
+                    rubyStart = text.size();
+                    rubyEnd = close;
+                    i++;
+                    continue;
+                }
+            }
+
+            if (utf8.compare(i, 2, YEN) == 0 && i + 2 < len)
+            {
+                const size_t esc = i + 2;
+
+                if (utf8[esc] == '\'')
+                {
+                    text += '\'';
+                    i = esc + 1;
+                    continue;
+                }
+
+                if (utf8[esc] == 'n')
+                {
+                    spans.push_back({TEXT_SPAN::LINE_BREAK, text.size(), 1});
+                    text += ' ';
+                    i = esc + 1;
+                    continue;
+                }
+
+                if (utf8[esc] == '@')
+                {
+                    spans.push_back({TEXT_SPAN::WAIT, text.size(), 0});
+                    i = esc + 1;
+                    continue;
+                }
+
+                if (utf8.compare(esc, 2, "pc") == 0)
+                {
+                    spans.push_back({TEXT_SPAN::PAGE_CLEAR, text.size(), 0});
+                    i = esc + 2;
+                    continue;
+                }
+
+                if (utf8.compare(esc, 2, "fn") == 0)
+                {
+                    i = esc + 2;
+                    continue;
+                }
+
+                if (utf8.compare(esc, 2, "fs") == 0)
+                {
+                    text += ' ';
+                    i = esc + 2;
+                    continue;
+                }
+            }
+
+            text += c;
+            i++;
+        }
+    }
+
+    std::string cleanText(const std::string &rawText)
+    {
+        std::string text;
+        std::vector<TextSpan> spans;
+        cleanText(rawText, text, spans);
+        return text;
+    }
+
     // Parse comma separated asset names
     const std::vector<std::string> getAssetArgs(const std::string &asset)
     {
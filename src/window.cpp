@@ -23,7 +23,11 @@ WindowManager::WindowManager()
                               SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
                               WINDOW_WIDTH,
                               WINDOW_HEIGHT,
+#ifdef HEADLESS
+                              SDL_WINDOW_HIDDEN);
+#else
                               SDL_WINDOW_SHOWN);
+#endif
     if (window == NULL)
     {
         throw std::runtime_error("Could not create SDL window");
@@ -31,7 +35,12 @@ WindowManager::WindowManager()
 
     setWindowIcon(window);
 
+#ifdef HEADLESS
+    // Frames are not held back by vsync so they can be timed
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+#else
     renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+#endif
     if (renderer == NULL)
     {
         throw std::runtime_error("Could not create SDL renderer");
@@ -45,7 +54,7 @@ void WindowManager::setWindowIcon(SDL_Window *window)
     SDL_Surface *surface = SDL_CreateRGBSurfaceFrom(logo, 64, 64, 32, 64 * 4, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
     if (surface == NULL)
     {
-        LOG << "Could not create surface from logo";
+        LOG_WARN << "Could not create surface from logo";
         return;
     }
 
@@ -53,6 +62,16 @@ void WindowManager::setWindowIcon(SDL_Window *window)
     SDL_FreeSurface(surface);
 }
 
+// Length of a frame on the display the window is on
+double WindowManager::getFrameMs()
+{
+    SDL_DisplayMode mode;
+    if (SDL_GetWindowDisplayMode(window, &mode) != 0 || mode.refresh_rate <= 0)
+        return DEFAULT_FRAME_MS;
+
+    return 1000.0 / mode.refresh_rate;
+}
+
 void WindowManager::toggleFullscreen()
 {
 #ifdef __EMSCRIPTEN__
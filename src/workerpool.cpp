@@ -0,0 +1,166 @@
+#include <workerpool.hpp>
+
+#include <SDL2/SDL.h>
+
+#include <algorithm>
+
+WorkerPool::WorkerPool()
+{
+#ifndef __EMSCRIPTEN__
+    // Leave one core for the main loop
+    unsigned int count = std::thread::hardware_concurrency();
+    count = std::max(1u, std::min(count > 1 ? count - 1 : 1, static_cast<unsigned int>(MAX_WORKERS)));
+
+    for (unsigned int i = 0; i < count; i++)
+        workers.emplace_back(&WorkerPool::work, this);
+#endif
+}
+
+// Stop workers after their current job, unstarted jobs are dropped
+WorkerPool::~WorkerPool()
+{
+#ifndef __EMSCRIPTEN__
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stopping = true;
+        jobs.clear();
+        urgentJobs.clear();
+    }
+    jobCond.notify_all();
+
+    for (auto &worker : workers)
+        worker.join();
+#endif
+}
+
+void WorkerPool::submit(Task task, const bool urgent)
+{
+#ifdef __EMSCRIPTEN__
+    task();
+#else
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        (urgent ? urgentJobs : jobs).push_back(std::move(task));
+    }
+    jobCond.notify_one();
+#endif
+}
+
+void WorkerPool::post(Task task, const bool urgent)
+{
+    {
+#ifndef __EMSCRIPTEN__
+        std::lock_guard<std::mutex> lock(completionMutex);
+#endif
+        (urgent ? urgentCompletions : completions).push_back(std::move(task));
+    }
+#ifndef __EMSCRIPTEN__
+    completionCond.notify_all();
+#endif
+}
+
+size_t WorkerPool::pendingCompletions()
+{
+#ifndef __EMSCRIPTEN__
+    std::lock_guard<std::mutex> lock(completionMutex);
+#endif
+    return completions.size() + urgentCompletions.size();
+}
+
+void WorkerPool::waitCompletion()
+{
+#ifndef __EMSCRIPTEN__
+    // Workers never hold jobMutex while taking completionMutex, so taking it inside is safe
+    std::unique_lock<std::mutex> lock(completionMutex);
+    completionCond.wait(lock, [this]
+                        {
+                            if (!completions.empty() || !urgentCompletions.empty())
+                                return true;
+
+                            std::lock_guard<std::mutex> jobLock(jobMutex);
+                            return jobs.empty() && urgentJobs.empty() && activeJobs == 0; });
+#endif
+}
+
+bool WorkerPool::idle()
+{
+#ifndef __EMSCRIPTEN__
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        if (!jobs.empty() || !urgentJobs.empty() || activeJobs > 0)
+            return false;
+    }
+#endif
+    return pendingCompletions() == 0;
+}
+
+unsigned int WorkerPool::drain(double budgetMs)
+{
+    const Uint64 start = SDL_GetPerformanceCounter();
+    const double ticksPerMs = SDL_GetPerformanceFrequency() / 1000.0;
+
+    unsigned int count = 0;
+    for (;;)
+    {
+        Task task;
+        {
+#ifndef __EMSCRIPTEN__
+            std::lock_guard<std::mutex> lock(completionMutex);
+#endif
+            auto &queue = urgentCompletions.empty() ? completions : urgentCompletions;
+            if (queue.empty())
+                break;
+
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        // Run outside the lock so completions may post further work
+        task();
+        count++;
+
+        if ((SDL_GetPerformanceCounter() - start) / ticksPerMs >= budgetMs)
+            break;
+    }
+
+    return count;
+}
+
+#ifndef __EMSCRIPTEN__
+
+// Worker thread loop
+void WorkerPool::work()
+{
+    for (;;)
+    {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobCond.wait(lock, [this]
+                         { return stopping || !jobs.empty() || !urgentJobs.empty(); });
+
+            if (stopping)
+                return;
+
+            auto &queue = urgentJobs.empty() ? jobs : urgentJobs;
+            task = std::move(queue.front());
+            queue.pop_front();
+            activeJobs++;
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            activeJobs--;
+        }
+
+        // Wake waitCompletion in case this job posted nothing and the pool is now idle
+        {
+            std::lock_guard<std::mutex> lock(completionMutex);
+        }
+        completionCond.notify_all();
+    }
+}
+
+#endif
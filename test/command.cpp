@@ -0,0 +1,252 @@
+// Checks CommandParser against the regex cascade it replaced and compares their speed
+// Every command is matched by both, which must agree on the type and on every capture
+// Integer values must match std::stoi, or stay 0 when the digits do not fit in an int
+//
+// Usage: test_command.exe
+
+#include <command.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Generated commands compared on top of the fixed corpus
+#define RANDOM_CASES 300000
+
+// Commands parsed per benchmark run
+#define BENCH_COMMANDS 200000
+
+// The regex cascade of SceneManager::handleCommand, kept as the reference
+// Patterns are tried in the same order and captures keep their group numbers
+static bool referenceParse(const std::string &cmdString, Command &cmd)
+{
+    static const std::regex waitRegex("^wait\\s?(\\d*)");
+    static const std::regex frameonRegex("^frameon(?: (\\w+) (\\d+))?");
+    static const std::regex frameoffRegex("^frameoff(?: (\\w+) (\\d+))?");
+    static const std::regex rdrawRegex("^rdraw (\\d+)");
+    static const std::regex wipeRegex("^r?wipe2? (\\w+) (\\d+)");
+    static const std::regex pcmRegex("^pcm (\\S+)");
+    static const std::regex bgmRegex("^bgm (\\d+) (\\S+)");
+    static const std::regex seRegex("^se (\\d)(?: (\\w+)(?: (\\w+)(?: (\\w+)(?: (\\w+))?)?)?)?");
+    static const std::regex imageRegex("^(bg|eg|fg|cg|fw)(?: (\\d)(?: ([\\w,$]+)(?: ([^\\s]*)(?: ([^\\s]*)(?: ([^\\s]*)(?: ([^\\s]*))?)?)?)?)?)?");
+    static const std::regex ifRegex("^if\\s*\\((.+)\\)\\s+(.+)");
+    static const std::regex nextRegex("^next (\\S+)");
+    static const std::regex fselectRegex("^fselect");
+    static const std::regex choiceRegex("^(\\d+) (\\w+) (.+)");
+    static const std::regex autoRegex("^auto (\\w+)");
+    static const std::regex assignRegex("^#.+");
+
+    cmd = Command();
+
+    std::smatch matches;
+    if (std::regex_search(cmdString, matches, waitRegex))
+        cmd.type = COMMAND_TYPE::WAIT;
+    else if (std::regex_search(cmdString, matches, frameonRegex))
+        cmd.type = COMMAND_TYPE::FRAMEON;
+    else if (std::regex_search(cmdString, matches, frameoffRegex))
+        cmd.type = COMMAND_TYPE::FRAMEOFF;
+    else if (std::regex_search(cmdString, matches, rdrawRegex))
+        cmd.type = COMMAND_TYPE::RDRAW;
+    else if (std::regex_search(cmdString, matches, wipeRegex))
+        cmd.type = COMMAND_TYPE::WIPE;
+    else if (std::regex_search(cmdString, matches, pcmRegex))
+        cmd.type = COMMAND_TYPE::PCM;
+    else if (std::regex_search(cmdString, matches, bgmRegex))
+        cmd.type = COMMAND_TYPE::BGM;
+    else if (std::regex_search(cmdString, matches, seRegex))
+        cmd.type = COMMAND_TYPE::SE;
+    else if (std::regex_search(cmdString, matches, imageRegex))
+        cmd.type = COMMAND_TYPE::IMAGE;
+    else if (std::regex_search(cmdString, matches, ifRegex))
+        cmd.type = COMMAND_TYPE::IF;
+    else if (std::regex_search(cmdString, matches, nextRegex))
+        cmd.type = COMMAND_TYPE::NEXT;
+    else if (std::regex_search(cmdString, matches, fselectRegex))
+        cmd.type = COMMAND_TYPE::FSELECT;
+    else if (std::regex_match(cmdString, matches, choiceRegex))
+        cmd.type = COMMAND_TYPE::CHOICE;
+    else if (std::regex_search(cmdString, matches, autoRegex))
+        cmd.type = COMMAND_TYPE::AUTO;
+    else if (std::regex_match(cmdString, matches, assignRegex))
+        cmd.type = COMMAND_TYPE::ASSIGN;
+    else
+        return false;
+
+    // Handlers converted captures with std::stoi, which throws on values that do not fit
+    for (size_t i = 1; i < matches.size() && i < MAX_COMMAND_ARGS; i++)
+    {
+        cmd.args[i] = matches[i].str();
+        if (cmd.args[i].empty() || cmd.args[i].find_first_not_of("0123456789") != std::string::npos)
+            continue;
+
+        try
+        {
+            cmd.values[i] = std::stoi(cmd.args[i]);
+        }
+        catch (const std::out_of_range &)
+        {
+        }
+    }
+
+    return true;
+}
+
+static int failures = 0;
+
+static void check(const std::string &cmdString)
+{
+    Command expected, got;
+    const bool expectedFound = referenceParse(cmdString, expected);
+    const bool gotFound = CommandParser::parse(cmdString, got);
+
+    bool same = expectedFound == gotFound && expected.type == got.type;
+    for (int i = 1; same && i < MAX_COMMAND_ARGS; i++)
+        same = expected.args[i] == got.args[i] && expected.values[i] == got.values[i];
+
+    if (!same && failures++ < 10)
+        printf("FAIL '%s'\n", cmdString.c_str());
+}
+
+// Commands as they appear in the scripts, plus edge cases of each pattern
+static const char *const CORPUS[] = {
+    "wait",
+    "wait 30",
+    "wait\t120",
+    "wait  5",
+    "waitkey",
+    "wipe fade 30",
+    "rwipe2 fade 15",
+    "wipe2 l2r 60",
+    "wipe fade",
+    "frameon",
+    "frameon fade 15",
+    "frameon fade",
+    "frameoff",
+    "frameoff fade 20",
+    "rdraw 1",
+    "rdraw 30",
+    "rdraw",
+    "pcm ai_0001",
+    "pcm  ai_0001",
+    "bgm 0 bgm01",
+    "bgm 1 bgm02 loop",
+    "bgm bgm01",
+    "se 0 se_door",
+    "se 1 loop se_rain",
+    "se 2 se_rain 1 2 3 4",
+    "se 10 se_rain",
+    "se",
+    "bg 0 BG15_d 0 0 0",
+    "bg 0 BG15_d",
+    "bg 0",
+    "bg",
+    "bgm",
+    "cg 0 Tchi01m,1,1,g,g #(950+#300) #(955+0) 1 0",
+    "fg 2 ch01_a_1 -40 0",
+    "fg 1 0",
+    "eg 5 fade 240 255 0",
+    "eg 0 $white 1280 720 0 0",
+    "fw 0 attr 1 10 20",
+    "cg 0 move 30 100 -50",
+    "cg 0 m2amove3 30 100",
+    "fg 0 blend 128",
+    "fg 0 ch01 0 0 a b c d e",
+    "fg 12 ch01",
+    "fga 0 ch01",
+    "if (#100 == 1) next scene02",
+    "if(#1) wait 30",
+    "if (#1)wait",
+    "if (#1) ",
+    "if (a) (b) c",
+    "next scene02",
+    "next",
+    "fselect",
+    "fselectx",
+    "1 choice01 Go left",
+    "12 choice02 \x82\xcd\x82\xa2",
+    "1 choice01",
+    "1 choice01 text\nmore",
+    "auto on",
+    "auto off",
+    "auto",
+    "#100 = 1",
+    "#100++",
+    "#",
+    "#\n",
+    "",
+    " ",
+    "\x81\x75\x82\xb1\x82\xf1\x82\xc9\x82\xbf\x82\xcd\x81\x76",
+    // Digits that do not fit in an int
+    "wait 99999999999",
+    "rdraw 2147483647",
+    "rdraw 2147483648",
+    "bgm 4294967296 bgm01",
+    "wipe fade 0000000000000000000000030",
+    "fg 0 ch01 99999999999 0",
+};
+
+// Random commands built from the pieces that decide between patterns
+static std::string randomCommand(std::mt19937 &rng)
+{
+    static const char *const heads[] = {
+        "wait", "wipe", "rwipe", "wipe2", "rwipe2", "frameon", "frameoff", "rdraw", "pcm", "bgm", "se",
+        "bg", "eg", "fg", "cg", "fw", "if", "next", "fselect", "auto", "#", "1", "23", "x", "",
+    };
+    static const char *const pieces[] = {
+        " ", "  ", "\t", "\n", "0", "7", "30", "12345678901", "fade", "ch01_a", "a,b", "$white", "#(1+2)",
+        "-40", "(", ")", "(#1)", "on", ".", "\x82\xcd",
+    };
+
+    std::string s = heads[rng() % (sizeof(heads) / sizeof(heads[0]))];
+    const int count = rng() % 10;
+    for (int i = 0; i < count; i++)
+        s += pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))];
+    return s;
+}
+
+static double nsPerCommand(bool (*fn)(const std::string &, Command &), const std::vector<std::string> &commands)
+{
+    Command cmd;
+    size_t count = 0;
+    size_t sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    while (count < BENCH_COMMANDS)
+    {
+        for (const auto &s : commands)
+            sink += fn(s, cmd) ? static_cast<size_t>(cmd.type) : 0;
+        count += commands.size();
+    }
+    const double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Keeps the calls from being optimized out
+    if (sink == 0)
+        printf(" ");
+
+    return s * 1e9 / count;
+}
+
+int main(int argc, char **argv)
+{
+    for (const char *cmdString : CORPUS)
+        check(cmdString);
+
+    std::mt19937 rng(12);
+    for (int i = 0; i < RANDOM_CASES; i++)
+        check(randomCommand(rng));
+
+    if (failures > 0)
+    {
+        printf("FAIL %d commands differ from the reference\n", failures);
+        return 1;
+    }
+    printf("PASS CommandParser matches the reference\n");
+
+    const std::vector<std::string> commands(std::begin(CORPUS), std::end(CORPUS));
+    printf("Per command: reference %.0f ns, CommandParser %.0f ns\n", nsPerCommand(referenceParse, commands), nsPerCommand(CommandParser::parse, commands));
+
+    return 0;
+}
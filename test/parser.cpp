@@ -0,0 +1,864 @@
+// Checks the compiled Parser against the recursive descent interpreter it replaced and compares their speed
+// Both evaluate the same expressions in the same order, and must agree on every result,
+// every error and its message, and every variable left behind, including by expressions that throw
+//
+// Usage: test_parser.exe
+
+#include <parser.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Generated expressions compared on top of the fixed corpus
+#define RANDOM_CASES 200000
+
+// Generated expressions run before the variables are compared and cleared
+#define RANDOM_BATCH 50
+
+// Expressions evaluated per benchmark run
+#define BENCH_EXPRESSIONS 200000
+
+// The interpreter Parser replaced, kept as the reference
+// Evaluates while parsing, so every call lexes and walks the expression again
+namespace reference
+{
+#define BASE_EXPR or_expr
+
+    class Lexer;
+
+    class Parser
+    {
+    public:
+        double parse(const std::string &, const int = 0);
+
+        void set_lexer_buffer(std::string &);
+
+        // Replace the existing symbol table with a new one
+        void setSymbolTable(const SymbolTable &symbolTable) { symbol_table = symbolTable; }
+
+        // Return a reference to the symbol table map object
+        const SymbolTable &getSymbolTable() { return symbol_table; }
+
+        void setVar(const std::string &, const double);
+
+    private:
+        int prevValue = 0;
+        std::string last_var_name;
+        Lexer *p_lexer = NULL;
+        SymbolTable symbol_table{};
+
+        double primary();
+        double unary_expr();
+        double mul_expr();
+        double add_expr();
+        double bitshift_expr();
+        double inequality_expr();
+        double equality_expr();
+        double band_expr();
+        double bor_expr();
+        double and_expr();
+        double or_expr();
+        double assign_expr();
+    };
+
+    class Lexer
+    {
+        friend void Parser::set_lexer_buffer(std::string &);
+
+    private:
+        Token current_token;
+        std::string buffer;
+        std::istringstream iss;
+
+        Token get_next_token();
+
+    public:
+        Lexer(const std::string);
+        Token get_current_token() { return current_token; };
+        std::string get_curr_buffer() { return buffer; };
+        void advance();
+    };
+
+    Lexer::Lexer(const std::string s) : iss{s}
+    {
+        current_token = get_next_token();
+    }
+
+    Token Lexer::get_next_token()
+    {
+        char c = EOF;
+
+        // Attempt to get a char
+        c = iss.get();
+
+        // Skip until non-whitespace or eof
+        while (isspace(c))
+            c = iss.get();
+
+        if (c == EOF)
+            return Token::Eof;
+
+        switch (c)
+        {
+            // Multi character tokens
+            // First check for first character match
+            // Then check next character, otherwise call unget and return first token
+        case '|':
+            if (iss.get() == '|')
+                return Token::Or;
+            iss.unget();
+            return Token::Bor;
+
+        case '&':
+            if (iss.get() == '&')
+                return Token::And;
+            iss.unget();
+            return Token::Band;
+
+        case '!':
+            if (iss.get() == '=')
+                return Token::Neq;
+            iss.unget();
+            // No other token that starts with !
+            throw std::runtime_error(std::string("Invalid token: ") + c);
+
+        case '=':
+            if (iss.get() == '=')
+                return Token::Eq;
+            iss.unget();
+            return Token::Assign;
+
+        case '<':
+            switch (iss.get())
+            {
+            case '<':
+                return Token::Shl;
+            case '=':
+                return Token::Lte;
+            default:
+                iss.unget();
+                return Token::Lt;
+            }
+
+        case '>':
+            switch (iss.get())
+            {
+            case '>':
+                return Token::Shr;
+            case '=':
+                return Token::Gte;
+            default:
+                iss.unget();
+                return Token::Gt;
+            }
+
+        case '+':
+            switch (iss.get())
+            {
+            case '+':
+                return Token::Incr;
+            case '=':
+                return Token::PlusAssign;
+            default:
+                iss.unget();
+                return Token::Plus;
+            }
+
+        case '-':
+            switch (iss.get())
+            {
+            case '-':
+                return Token::Decr;
+            case '=':
+                return Token::MinusAssign;
+            default:
+                iss.unget();
+                return Token::Minus;
+            }
+
+            // Single character tokens
+        case '*':
+            switch (iss.get())
+            {
+            case '=':
+                return Token::MulAssign;
+            default:
+                iss.unget();
+                return Token::Mul;
+            }
+
+        case '/':
+            switch (iss.get())
+            {
+            case '=':
+                return Token::DivAssign;
+            default:
+                iss.unget();
+                return Token::Div;
+            }
+
+        case '#':
+        case '(':
+        case ')':
+        case '@':
+            buffer = c;
+            return Token(c);
+        }
+
+        // Handle tokens that utilize the buffer
+        buffer.clear();
+
+        if (isdigit(c))
+        {
+            while (isdigit(c))
+            {
+                buffer += c;
+                c = iss.get();
+            }
+            // Put back c if loop exits as it is not a digit
+            iss.putback(c);
+            return Token::Number;
+        }
+
+        // IGNORE ALL UNSUPPORTED TOKENS
+        return Token::Eof;
+    }
+
+    void Lexer::advance()
+    {
+        if (current_token != Token::Eof)
+            current_token = get_next_token();
+    }
+
+    void Parser::set_lexer_buffer(std::string &buffer)
+    {
+        p_lexer->buffer = buffer;
+    }
+
+    double Parser::primary()
+    {
+        std::string buffer;
+        double result = 0.0;
+
+        switch (p_lexer->get_current_token())
+        {
+        case Token::Id:
+            p_lexer->advance();
+
+            // Evaluate variable name
+            last_var_name = std::to_string(primary());
+            set_lexer_buffer(last_var_name);
+
+            // Store initial result, assume post increment/decrement
+            result = symbol_table[last_var_name];
+            for (;;)
+            {
+                switch (p_lexer->get_current_token())
+                {
+                case (Token::Decr):
+                    p_lexer->advance();
+                    symbol_table[last_var_name]--;
+                    break;
+                case (Token::Incr):
+                    p_lexer->advance();
+                    symbol_table[last_var_name]++;
+                    break;
+                default:
+                    return result;
+                }
+            }
+        case Token::Prev:
+            p_lexer->advance();
+            return prevValue;
+        case Token::Number:
+            buffer = p_lexer->get_curr_buffer();
+            p_lexer->advance();
+            return std::stoi(buffer);
+        case Token::Lp:
+            p_lexer->advance();
+            result = BASE_EXPR();
+            if (p_lexer->get_current_token() != Token::Rp)
+                throw std::runtime_error("No closing parentheses!");
+            p_lexer->advance();
+            return result;
+
+        default:
+            auto token = static_cast<char>(p_lexer->get_current_token());
+            if (token == -1)
+                throw std::runtime_error("Unexpected EOF!");
+
+            // IGNORE ALL UNSUPPORTED TOKENS
+            return result;
+        }
+    }
+
+    double Parser::unary_expr()
+    {
+        switch (p_lexer->get_current_token())
+        {
+        case Token::Plus:
+            p_lexer->advance();
+            return +primary();
+        case Token::Minus:
+            p_lexer->advance();
+            return -primary();
+        default:
+            return primary();
+        }
+    }
+
+    double Parser::mul_expr()
+    {
+        double result = unary_expr();
+        double operand;
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case (Token::Mul):
+                p_lexer->advance();
+                result *= unary_expr();
+                break;
+            case (Token::Div):
+                p_lexer->advance();
+                operand = unary_expr();
+                if (operand == 0)
+                    throw(std::runtime_error("Division by 0!"));
+                result /= operand;
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::add_expr()
+    {
+        double result = mul_expr();
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case Token::Plus:
+                p_lexer->advance();
+                result += mul_expr();
+                break;
+            case Token::Minus:
+                p_lexer->advance();
+                result -= mul_expr();
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::bitshift_expr()
+    {
+        int result = add_expr();
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case Token::Shl:
+                p_lexer->advance();
+                result <<= static_cast<int>(add_expr());
+                break;
+            case Token::Shr:
+                p_lexer->advance();
+                result >>= static_cast<int>(add_expr());
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::inequality_expr()
+    {
+        auto result = bitshift_expr();
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case Token::Gt:
+                p_lexer->advance();
+                result = result > bitshift_expr();
+                break;
+            case Token::Gte:
+                p_lexer->advance();
+                result = result >= bitshift_expr();
+                break;
+            case Token::Lt:
+                p_lexer->advance();
+                result = result < bitshift_expr();
+                break;
+            case Token::Lte:
+                p_lexer->advance();
+                result = result <= bitshift_expr();
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::equality_expr()
+    {
+        auto result = inequality_expr();
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case Token::Eq:
+                p_lexer->advance();
+                result = result == inequality_expr();
+                break;
+            case Token::Neq:
+                p_lexer->advance();
+                result = result != inequality_expr();
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::band_expr()
+    {
+        int result = equality_expr();
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case Token::Band:
+                p_lexer->advance();
+                result &= static_cast<int>(equality_expr());
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::bor_expr()
+    {
+        int result = band_expr();
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case Token::Bor:
+                p_lexer->advance();
+                result |= static_cast<int>(band_expr());
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::and_expr()
+    {
+        int result = bor_expr();
+        int result_rhs;
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case Token::And:
+                p_lexer->advance();
+                // Evaluate separately to ensure function is called instead of short-circuiting
+                result_rhs = bor_expr();
+                result = result && result_rhs;
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::or_expr()
+    {
+        int result = and_expr();
+        int result_rhs;
+
+        for (;;)
+        {
+            switch (p_lexer->get_current_token())
+            {
+            case Token::Or:
+                p_lexer->advance();
+                // Evaluate separately to ensure function is called instead of short-circuiting
+                result_rhs = and_expr();
+                result = result || result_rhs;
+                break;
+            default:
+                return result;
+            }
+        }
+    }
+
+    double Parser::assign_expr()
+    {
+        Token t = p_lexer->get_current_token();
+        auto result = BASE_EXPR();
+
+        if (t == Token::Id)
+        {
+            // Evaluate RHS
+            switch (p_lexer->get_current_token())
+            {
+            case Token::Assign:
+                p_lexer->advance();
+                result = BASE_EXPR();
+                symbol_table[last_var_name] = result;
+                break;
+
+            case Token::PlusAssign:
+                p_lexer->advance();
+                result = BASE_EXPR();
+                symbol_table[last_var_name] += result;
+                break;
+
+            case Token::MinusAssign:
+                p_lexer->advance();
+                result = BASE_EXPR();
+                symbol_table[last_var_name] -= result;
+                break;
+
+            case Token::MulAssign:
+                p_lexer->advance();
+                result = BASE_EXPR();
+                symbol_table[last_var_name] *= result;
+                break;
+
+            case Token::DivAssign:
+                p_lexer->advance();
+                result = BASE_EXPR();
+                symbol_table[last_var_name] /= result;
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        if (p_lexer->get_current_token() != Token::Eof)
+        {
+            throw std::runtime_error(std::string("Unexpected before EOF: ") + static_cast<char>(p_lexer->get_current_token()));
+        }
+
+        return result;
+    }
+
+    // Evaluate a lhs variable name and assign rhs to it
+    void Parser::setVar(const std::string &lhs, const double rhs)
+    {
+        const std::string &varName = std::to_string(parse(lhs));
+        symbol_table[varName] = rhs;
+    }
+
+    // Evaluate a single string
+    double Parser::parse(const std::string &s, const int prev)
+    {
+        // Initialize the lexer with the string
+        Lexer lexer = Lexer{s};
+        p_lexer = &lexer;
+
+        prevValue = prev;
+
+        // Begin with expression of least precedence
+        double result = assign_expr();
+
+        p_lexer = NULL;
+        return result;
+    }
+
+#undef BASE_EXPR
+}
+
+// What one evaluation produced, the error if it threw
+typedef struct
+{
+    double value;
+    std::string error;
+} Outcome;
+
+template <typename P>
+static Outcome evaluate(P &parser, const std::string &expr, const int prev)
+{
+    try
+    {
+        return {parser.parse(expr, prev), ""};
+    }
+    catch (const std::out_of_range &e)
+    {
+        return {0, std::string("out_of_range: ") + e.what()};
+    }
+    catch (const std::runtime_error &e)
+    {
+        return {0, std::string("runtime_error: ") + e.what()};
+    }
+}
+
+// Equal bit for bit, so -0 and NaN are told apart as the scripts would see them in names
+static bool same(const double a, const double b)
+{
+    return memcmp(&a, &b, sizeof(double)) == 0 || (std::isnan(a) && std::isnan(b));
+}
+
+static bool sameTable(const SymbolTable &a, const SymbolTable &b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (auto i = a.begin(), j = b.begin(); i != a.end(); ++i, ++j)
+    {
+        if (i->first != j->first || !same(i->second, j->second))
+            return false;
+    }
+
+    return true;
+}
+
+static int failures = 0;
+
+static void fail(const std::string &expr, const char *what)
+{
+    if (failures++ < 10)
+        printf("FAIL '%s' %s\n", expr.c_str(), what);
+}
+
+static void check(reference::Parser &expected, Parser &got, const std::string &expr, const int prev, const bool compareTables)
+{
+    const Outcome e = evaluate(expected, expr, prev);
+    const Outcome g = evaluate(got, expr, prev);
+
+    if (e.error != g.error)
+        fail(expr, ("threw '" + g.error + "' instead of '" + e.error + "'").c_str());
+    else if (e.error.empty() && !same(e.value, g.value))
+        fail(expr, "result differs");
+    else if (compareTables && !sameTable(expected.getSymbolTable(), got.getSymbolTable()))
+        fail(expr, "variables differ");
+}
+
+// Expressions as the scripts write them, plus the forms whose side effects and errors depend on order
+static const char *const CORPUS[] = {
+    "1",
+    "#100 = 1",
+    "#100",
+    "#(950+#300)",
+    "#(955+0)",
+    "#300 = 5",
+    "#(950+#300)",
+    "#(950+#300) = 7",
+    "#955",
+    "#(#300) = 3",
+    "#(#300)++",
+    "#(#300)--",
+    "#((#300 + 1) * 2) = #300",
+    "#(1/2) = 4",
+    "#(-0) = 9",
+    "#(-1) = 2",
+    "#(0-1)",
+    "#(2147483647) = 1",
+    "@",
+    "@+10",
+    "@ - 40",
+    "-@",
+    "#5 = @",
+    "#1++",
+    "#1--",
+    "#1++++",
+    "#1++--++",
+    "#1 ++ + 1",
+    "#1-- - #1--",
+    "#2 = #1++",
+    "#1 += 5",
+    "#1 -= 2",
+    "#1 *= 3",
+    "#1 /= 2",
+    "#1 /= 0",
+    "#1 += #1++",
+    "#1++ += 1",
+    "#(#1++) = #1",
+    "#1 = #2 = 3",
+    "1 + 2 * 3",
+    "(1 + 2) * 3",
+    "7 / 2",
+    "7 / 2 * 2",
+    "1 << 4",
+    "256 >> 2 >> 1",
+    "1 < 2 < 3",
+    "3 >= 3",
+    "1 == 1 == 1",
+    "2 != 1",
+    "6 & 3",
+    "6 | 3",
+    "#1 == 1 && #2 != 0",
+    "0 && #7++",
+    "1 || #7++",
+    "#7",
+    "-#7",
+    "+#7",
+    "--#7",
+    // Errors, and the side effects before them
+    "1 / 0",
+    "#8++ + 1 / 0",
+    "1 / 0 + #8++",
+    "#8",
+    "#9 = 1 / 0",
+    "#9",
+    "#9 = #9++ / (#9 - 1)",
+    "(1 + 2",
+    "(#10++",
+    "#10",
+    "1 +",
+    "#",
+    "",
+    "   ",
+    "!1",
+    "#11++ !1",
+    "1 ! 1",
+    "1 != !",
+    "1 2",
+    "#12++ 3",
+    "#12",
+    "1 )",
+    "99999999999",
+    "#13++ + 99999999999",
+    "99999999999 + #13++",
+    "#13",
+    "1 + 2 x 3",
+    "x",
+    "1 = 2",
+    "@ = 3",
+    "(#14) = 3",
+    "#14",
+    "#15 = 1 2",
+    "#15",
+};
+
+// Random expressions from the tokens that matter to the grammar, including ones that do not lex
+static std::string randomExpression(std::mt19937 &rng)
+{
+    static const char *const pieces[] = {
+        "#", "#", "#", "(", ")", "@", "++", "--", "+", "-", "*", "/", "<<", ">>", "<", "<=", ">", ">=", "==", "!=",
+        "&", "|", "&&", "||", "=", "+=", "-=", "*=", "/=", "0", "1", "2", "3", "7", "30", "!", "x", " ",
+    };
+
+    std::string s;
+    const int count = 1 + rng() % 12;
+    for (int i = 0; i < count; i++)
+        s += pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))];
+    return s;
+}
+
+template <typename P>
+static double nsPerExpression(P &parser, const std::vector<std::string> &exprs)
+{
+    size_t count = 0;
+    double sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    while (count < BENCH_EXPRESSIONS)
+    {
+        for (const auto &expr : exprs)
+            sink += evaluate(parser, expr, 1).value;
+        count += exprs.size();
+    }
+    const double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Keeps the calls from being optimized out
+    if (sink == 0.5)
+        printf(" ");
+
+    return s * 1e9 / count;
+}
+
+int main(int argc, char **argv)
+{
+    {
+        reference::Parser expected;
+        Parser got;
+
+        int prev = 0;
+        for (const char *expr : CORPUS)
+            check(expected, got, expr, prev++, true);
+
+        // Again with every expression already compiled
+        for (const char *expr : CORPUS)
+            check(expected, got, expr, prev++, true);
+
+        // Variables named by an expression
+        expected.setVar("#1 + 40", 12.5);
+        got.setVar("#1 + 40", 12.5);
+        check(expected, got, "#(#1 + 40)", 0, true);
+
+        // Loading a saved table replaces everything, including the target of the last assignment
+        SymbolTable saved = expected.getSymbolTable();
+        saved["0.500000"] = 3;
+        expected.setSymbolTable(saved);
+        got.setSymbolTable(saved);
+        check(expected, got, "#(1/2) += 1", 0, true);
+    }
+
+    std::mt19937 rng(14);
+    for (int batch = 0; batch < RANDOM_CASES / RANDOM_BATCH; batch++)
+    {
+        // Fresh parsers keep values small, as shifts of large values are not defined
+        reference::Parser expected;
+        Parser got;
+
+        for (int i = 0; i < RANDOM_BATCH; i++)
+            check(expected, got, randomExpression(rng), rng() % 5, false);
+
+        if (!sameTable(expected.getSymbolTable(), got.getSymbolTable()))
+            fail("batch " + std::to_string(batch), "variables differ");
+    }
+
+    if (failures > 0)
+    {
+        printf("FAIL %d expressions differ from the reference\n", failures);
+        return 1;
+    }
+    printf("PASS Parser matches the reference\n");
+
+    // Script expressions that evaluate without errors, as the benchmark measures the common path
+    const std::vector<std::string> exprs = {
+        "#(950+#300)", "#(955+0)", "@+10", "#100 == 1 && #2 != 0", "#1 += 5", "#1++", "(1 + 2) * 3", "256 >> 2",
+    };
+
+    // Each distinct expression is compiled once, so the first run of new ones pays for compiling
+    std::vector<std::string> unique;
+    for (int i = 0; i < PARSER_CACHE_SIZE / 2; i++)
+        unique.push_back(exprs[i % exprs.size()] + " + " + std::to_string(i));
+
+    reference::Parser referenceParser;
+    Parser compileParser;
+    Parser cachedParser;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto &expr : unique)
+        evaluate(compileParser, expr, 1);
+    const double compileNs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e9 / unique.size();
+
+    printf("Per expression: reference %.0f ns, Parser first run %.0f ns, Parser compiled %.0f ns\n",
+           nsPerExpression(referenceParser, exprs), compileNs, nsPerExpression(cachedParser, exprs));
+
+    return 0;
+}
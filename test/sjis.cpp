@@ -0,0 +1,212 @@
+// Checks Utils::sj2utf8 against the original byte by byte transcoder and compares their speed
+// Covers every 1 and 2 byte input, each placed around the edges of the SIMD blocks of plain ASCII,
+// the bytes that look like ASCII but are not plain (0x5C, 0x7E, 0x7F), and lead bytes at the end of input
+//
+// Usage: test_sjis.exe
+
+#include <utils.hpp>
+#include <convtable.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// Random strings compared on top of the exhaustive cases
+#define RANDOM_CASES 300000
+
+// Bytes of text transcoded per benchmark run
+#define BENCH_BYTES (32 * 1024 * 1024)
+
+// The transcoder sj2utf8 replaced, kept as the reference
+static std::string referenceSj2utf8(const std::string &input)
+{
+    std::string output(3 * input.length(), ' '); // ShiftJis won't give 4byte UTF8, so max. 3 byte per input char are needed
+    size_t indexInput = 0, indexOutput = 0;
+
+    while (indexInput < input.length())
+    {
+        char arraySection = ((uint8_t)input[indexInput]) >> 4;
+
+        size_t arrayOffset;
+        if (arraySection == 0x8)
+            arrayOffset = 0x100; // these are two-byte shiftjis
+        else if (arraySection == 0x9)
+            arrayOffset = 0x1100;
+        else if (arraySection == 0xE)
+            arrayOffset = 0x2100;
+        else
+            arrayOffset = 0; // this is one byte shiftjis
+
+        // determining real array offset
+        if (arrayOffset)
+        {
+            arrayOffset += (((uint8_t)input[indexInput]) & 0xf) << 8;
+            indexInput++;
+            if (indexInput >= input.length())
+                break;
+        }
+        arrayOffset += (uint8_t)input[indexInput++];
+        arrayOffset <<= 1;
+
+        // unicode number is...
+        uint16_t unicodeValue = (shiftJIS_convTable[arrayOffset] << 8) | shiftJIS_convTable[arrayOffset + 1];
+
+        // converting to UTF8
+        if (unicodeValue < 0x80)
+        {
+            output[indexOutput++] = unicodeValue;
+        }
+        else if (unicodeValue < 0x800)
+        {
+            output[indexOutput++] = 0xC0 | (unicodeValue >> 6);
+            output[indexOutput++] = 0x80 | (unicodeValue & 0x3f);
+        }
+        else
+        {
+            output[indexOutput++] = 0xE0 | (unicodeValue >> 12);
+            output[indexOutput++] = 0x80 | ((unicodeValue & 0xfff) >> 6);
+            output[indexOutput++] = 0x80 | (unicodeValue & 0x3f);
+        }
+    }
+
+    output.resize(indexOutput); // remove the unnecessary bytes
+    return output;
+}
+
+static int failures = 0;
+
+static void check(const std::string &input)
+{
+    if (Utils::sj2utf8(input) == referenceSj2utf8(input))
+        return;
+
+    if (failures++ < 10)
+    {
+        printf("FAIL input");
+        for (const unsigned char c : input)
+            printf(" %02X", c);
+        printf("\n");
+    }
+}
+
+// Mostly dialogue, kana and kanji with some markup and ASCII, like script text
+static std::string scriptText(std::mt19937 &rng, const size_t length)
+{
+    static const char *const pieces[] = {
+        "\x82\xb1\x82\xf1\x82\xc9\x82\xbf\x82\xcd", // kana
+        "\x8e\x84\x82\xcd\x8a\x77\x90\xb6\x82\xc5\x82\xb7", // kanji and kana
+        "\x81\x75",                                 // opening bracket
+        "\x81\x76",                                 // closing bracket
+        "[\x8f\xac\x92\xb9]",                       // ruby markup
+        "\\n",                                      // escaped line break
+        "fg ch01 0 0 ",                             // command
+        "Hello, world. ",                           // plain ASCII
+    };
+
+    std::string text;
+    while (text.size() < length)
+        text += pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))];
+    text.resize(length);
+    return text;
+}
+
+static double mbPerSecond(std::string (*fn)(const std::string &), const std::vector<std::string> &lines)
+{
+    size_t bytes = 0;
+    size_t sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    while (bytes < BENCH_BYTES)
+    {
+        for (const auto &line : lines)
+        {
+            sink += fn(line).size();
+            bytes += line.size();
+        }
+    }
+    const double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Keeps the calls from being optimized out
+    if (sink == 0)
+        printf(" ");
+
+    return bytes / s / (1024 * 1024);
+}
+
+static std::string newSj2utf8(const std::string &input)
+{
+    return Utils::sj2utf8(input);
+}
+
+int main(int argc, char **argv)
+{
+    const std::string ascii = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+    // Every 1 and 2 byte input, alone and inside plain ASCII runs at offsets around the 8 and 16 byte blocks
+    for (int a = 0; a < 256; a++)
+    {
+        for (int b = -1; b < 256; b++)
+        {
+            std::string pair(1, static_cast<char>(a));
+            if (b >= 0)
+                pair += static_cast<char>(b);
+
+            check(pair);
+
+            for (const size_t offset : {1, 7, 8, 9, 15, 16, 17, 31, 32, 33})
+            {
+                check(ascii.substr(0, offset) + pair);
+                check(ascii.substr(0, offset) + pair + ascii.substr(0, 40 - offset));
+            }
+        }
+    }
+
+    // Bytes that look like ASCII but change, at every position of a block
+    for (const char special : {'\x5C', '\x7E', '\x7F'})
+    {
+        for (size_t pos = 0; pos < 40; pos++)
+        {
+            std::string text = ascii.substr(0, 40);
+            text[pos] = special;
+            check(text);
+        }
+    }
+
+    // Lead bytes cut off by the end of input after runs of every length
+    for (const char lead : {'\x81', '\x9F', '\xE0', '\xEF'})
+    {
+        for (size_t len = 0; len < 40; len++)
+            check(ascii.substr(0, len) + lead);
+    }
+
+    std::mt19937 rng(16);
+    for (int i = 0; i < RANDOM_CASES; i++)
+    {
+        std::string text(rng() % 64, '\0');
+        for (auto &c : text)
+            c = rng() % 3 == 0 ? rng() : 0x20 + rng() % 0x60;
+        check(text);
+        check(scriptText(rng, rng() % 200));
+    }
+
+    if (failures > 0)
+    {
+        printf("FAIL %d inputs differ from the reference\n", failures);
+        return 1;
+    }
+    printf("PASS sj2utf8 matches the reference\n");
+
+    // Throughput on lines of script text and on plain ASCII
+    std::vector<std::string> mixed, plain;
+    for (int i = 0; i < 1000; i++)
+    {
+        mixed.push_back(scriptText(rng, 20 + rng() % 120));
+        plain.push_back(std::string(20 + rng() % 120, 'a'));
+    }
+
+    printf("Script text: reference %.0f MB/s, sj2utf8 %.0f MB/s\n", mbPerSecond(referenceSj2utf8, mixed), mbPerSecond(newSj2utf8, mixed));
+    printf("Plain ASCII: reference %.0f MB/s, sj2utf8 %.0f MB/s\n", mbPerSecond(referenceSj2utf8, plain), mbPerSecond(newSj2utf8, plain));
+
+    return 0;
+}
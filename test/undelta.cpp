@@ -0,0 +1,237 @@
+// Checks the SIMD Undeltafilter kernels against the scalar one byte for byte
+// Decodes every frame of the embedded interface images, then random buffers of awkward sizes
+// so the tails after each vector block are covered
+// Also checks that frames with an empty or broken command stream are rejected
+//
+// Usage: test_undelta.exe
+
+#include <hgdecoder.hpp>
+#include <hgx2bmp.h>
+#include <utils.hpp>
+
+#include <sys_mwnd.h>
+#include <sys_sel.h>
+
+#include <zlib.h>
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Random buffers decoded per kernel
+#define RANDOM_CASES 3000
+
+typedef struct
+{
+    UndeltaKernel kernel;
+    const char *name;
+} KernelInfo;
+
+static const KernelInfo SIMD_KERNELS[] = {
+    {UndeltaKernel::SSE2, "SSE2"},
+    {UndeltaKernel::AVX2, "AVX2"},
+    {UndeltaKernel::SIMD128, "SIMD128"},
+};
+
+// Decode every frame of an HG-3 buffer with the current kernel
+static bool decodeAll(byte *buf, std::vector<std::vector<byte>> &out)
+{
+    HGHeader *hgHeader = reinterpret_cast<HGHeader *>(buf);
+    FrameHeader *frameHeader = reinterpret_cast<FrameHeader *>(hgHeader + 1);
+
+    HGDecoder decoder;
+    const auto &frames = decoder.parseFrames(frameHeader);
+
+    out.clear();
+    for (const auto &frame : frames)
+    {
+        std::vector<byte> pixels(HGDecoder::getPixelsLength(frame));
+        if (!decoder.decodeFrame(frame, pixels.data(), pixels.size()))
+            return false;
+        out.push_back(std::move(pixels));
+    }
+
+    return !out.empty();
+}
+
+// Undelta the same random un-RLEd data with the current kernel
+static std::vector<byte> undeltaRandom(const std::vector<byte> &unrle, const uint32 width, const uint32 height, const uint32 depthBytes)
+{
+    std::vector<byte> input = unrle;
+    std::vector<byte> pixels(input.size());
+
+    const uint32 stride = STRIDE(width, depthBytes);
+    if (ProcessUnrled(input.data(), input.size(), pixels.data(), pixels.size(), width, height, depthBytes, stride) != ReturnCode::Success)
+        return {};
+
+    return pixels;
+}
+
+// Decode a copy of a frame whose command stream is replaced, which must fail
+static bool rejectsCmdStream(HGDecoder &decoder, const HGDecoder::Frame &frame, const std::vector<byte> &cmd)
+{
+    const byte *data = reinterpret_cast<const byte *>(frame.Img + 1);
+
+    // Img header, the RLE data as is, then the replacement commands
+    std::vector<byte> buf(sizeof(Img) + frame.Img->CompressedDataLength + cmd.size());
+    memcpy(buf.data(), frame.Img, sizeof(Img));
+    memcpy(buf.data() + sizeof(Img), data, frame.Img->CompressedDataLength);
+    if (!cmd.empty())
+        memcpy(buf.data() + sizeof(Img) + frame.Img->CompressedDataLength, cmd.data(), cmd.size());
+
+    Img *img = reinterpret_cast<Img *>(buf.data());
+    img->CompressedCmdLength = cmd.size();
+
+    std::vector<byte> pixels(HGDecoder::getPixelsLength(frame));
+    return !decoder.decodeFrame({frame.Stdinfo, img}, pixels.data(), pixels.size());
+}
+
+// Command streams that end before their declared length, then a valid frame on the same context
+static int checkBadCmdStreams(byte *buf, const std::vector<byte> &expected)
+{
+    HGHeader *hgHeader = reinterpret_cast<HGHeader *>(buf);
+    FrameHeader *frameHeader = reinterpret_cast<FrameHeader *>(hgHeader + 1);
+
+    HGDecoder decoder;
+    const auto frame = decoder.parseFrames(frameHeader)[0];
+
+    // zlib stream of no bytes
+    uLongf emptyLength = compressBound(0);
+    std::vector<byte> empty(emptyLength);
+    compress(empty.data(), &emptyLength, empty.data(), 0);
+    empty.resize(emptyLength);
+
+    int failures = 0;
+    const struct
+    {
+        const char *name;
+        std::vector<byte> cmd;
+    } cases[] = {
+        {"missing", {}},
+        {"empty", empty},
+        {"corrupt", std::vector<byte>(64, 0xFF)},
+    };
+
+    for (const auto &c : cases)
+    {
+        if (!rejectsCmdStream(decoder, frame, c.cmd))
+        {
+            printf("FAIL %s command stream was decoded\n", c.name);
+            failures++;
+        }
+    }
+
+    // Failed decodes must not leave the context unusable
+    std::vector<byte> pixels(HGDecoder::getPixelsLength(frame));
+    if (!decoder.decodeFrame(frame, pixels.data(), pixels.size()) || pixels != expected)
+    {
+        printf("FAIL frame differs after bad command streams\n");
+        failures++;
+    }
+
+    if (failures == 0)
+        printf("PASS bad command streams rejected\n");
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    struct
+    {
+        const char *name;
+        byte *buf;
+    } images[] = {{"sys_mwnd", sys_mwnd}, {"sys_sel", sys_sel}};
+
+    // Reference output of the scalar kernel
+    SetUndeltaKernel(UndeltaKernel::Scalar);
+
+    std::vector<std::vector<std::vector<byte>>> expected(sizeof(images) / sizeof(images[0]));
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        if (!decodeAll(images[i].buf, expected[i]))
+        {
+            printf("FAIL could not decode %s\n", images[i].name);
+            return 1;
+        }
+    }
+
+    int failures = checkBadCmdStreams(images[0].buf, expected[0][0]);
+
+    // Sizes and contents are drawn once so every kernel sees the same cases
+    typedef struct
+    {
+        uint32 width;
+        uint32 height;
+        uint32 depthBytes;
+        std::vector<byte> unrle;
+        std::vector<byte> pixels;
+    } RandomCase;
+
+    std::mt19937 rng(5);
+    std::vector<RandomCase> cases;
+    for (int i = 0; i < RANDOM_CASES; i++)
+    {
+        RandomCase c;
+        c.width = 1 + rng() % 300;
+        c.height = 1 + rng() % 12;
+        c.depthBytes = 3 + rng() % 2;
+        c.unrle.resize(STRIDE(c.width, c.depthBytes) * c.height);
+
+        // Mostly zeros like real images, with runs of noise
+        for (auto &b : c.unrle)
+            b = rng() % 4 == 0 ? rng() : 0;
+
+        c.pixels = undeltaRandom(c.unrle, c.width, c.height, c.depthBytes);
+        cases.push_back(std::move(c));
+    }
+
+    for (const auto &info : SIMD_KERNELS)
+    {
+        if (!SetUndeltaKernel(info.kernel))
+        {
+            printf("SKIP %s not available\n", info.name);
+            continue;
+        }
+
+        int kernelFailures = 0;
+        size_t frameCount = 0;
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            std::vector<std::vector<byte>> got;
+            if (!decodeAll(images[i].buf, got) || got.size() != expected[i].size())
+            {
+                printf("FAIL %s could not decode %s\n", info.name, images[i].name);
+                kernelFailures++;
+                continue;
+            }
+
+            for (size_t f = 0; f < got.size(); f++)
+            {
+                if (got[f] != expected[i][f])
+                {
+                    printf("FAIL %s %s frame %zu differs\n", info.name, images[i].name, f);
+                    kernelFailures++;
+                }
+            }
+            frameCount += got.size();
+        }
+
+        for (const auto &c : cases)
+        {
+            if (undeltaRandom(c.unrle, c.width, c.height, c.depthBytes) != c.pixels)
+            {
+                printf("FAIL %s random %ux%u depth %u differs\n", info.name, c.width, c.height, c.depthBytes);
+                kernelFailures++;
+            }
+        }
+
+        if (kernelFailures == 0)
+            printf("PASS %s %zu frames, %d random buffers\n", info.name, frameCount, RANDOM_CASES);
+        failures += kernelFailures;
+    }
+
+    SetUndeltaKernel(UndeltaKernel::Auto);
+
+    return failures == 0 ? 0 : 1;
+}
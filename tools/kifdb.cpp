@@ -0,0 +1,409 @@
+// KIF DB builder and validator
+// Writes the v2 KIF DB the engine reads in place, from the game's .int archives or from a v1 DB
+//
+// Usage:
+//   kifdb.exe build <game dir> [out] [--vcode2 code]
+//   kifdb.exe convert <v1 db> <out>
+//   kifdb.exe validate <db> [archive dir]
+//
+// Encrypted archives need the game's V_CODE2, which dumpkif.py prints when it finds it in the executable
+
+#include <kifdb.hpp>
+#include <blowfish.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#define KIF_SIGNATURE "KIF"
+#define KIF_NAME_SIZE 64
+#define KIF_ENTRY_SIZE (KIF_NAME_SIZE + 8)
+#define KIF_KEY_FILENAME "__key__.dat"
+#define KIFDB_DEFAULT_NAME "kif.fs2"
+
+static std::vector<byte> readAll(const fs::path &path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.is_open())
+        return {};
+
+    return std::vector<byte>(std::istreambuf_iterator<char>(ifs), {});
+}
+
+// Read up to len bytes from the start of a file
+static std::vector<byte> readHead(const fs::path &path, const size_t len)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    std::vector<byte> buf(len);
+    ifs.read(reinterpret_cast<char *>(buf.data()), len);
+    buf.resize(ifs.gcount());
+    return buf;
+}
+
+static bool writeAll(const fs::path &path, const std::vector<byte> &buf)
+{
+    std::ofstream ofs(path, std::ios::binary);
+    ofs.write(reinterpret_cast<const char *>(buf.data()), buf.size());
+    return static_cast<bool>(ofs);
+}
+
+static uint32_t readU32(const byte *buf)
+{
+    uint32_t v;
+    memcpy(&v, buf, 4);
+    return v;
+}
+
+static void lowercase(std::string &s)
+{
+    for (auto &c : s)
+        c = tolower(static_cast<unsigned char>(c));
+}
+
+// First output of the 1999 MT19937 seeded with seed, which is all CatSystem2 draws per seed
+// Only the first word of the state is twisted and tempered
+static uint32_t mtGenrand(uint32_t seed)
+{
+    uint32_t state[398];
+    for (auto &word : state)
+    {
+        word = seed & 0xFFFF0000;
+        seed = 69069 * seed + 1;
+        word |= (seed & 0xFFFF0000) >> 16;
+        seed = 69069 * seed + 1;
+    }
+
+    const uint32_t y = (state[0] & 0x80000000) | (state[1] & 0x7FFFFFFF);
+    uint32_t r = state[397] ^ (y >> 1) ^ ((y & 1) ? 0x9908B0DF : 0);
+
+    r ^= r >> 11;
+    r ^= (r << 7) & 0x9D2C5680;
+    r ^= (r << 15) & 0xEFC60000;
+    r ^= r >> 18;
+    return r;
+}
+
+// Seed of the entry name ciphers, a CRC variant of the V_CODE2
+static uint32_t vcodeSeed(const std::string &vcode)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (const unsigned char c : vcode)
+    {
+        if (c == 0)
+            break;
+
+        crc ^= static_cast<uint32_t>(c) << 24;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+
+        crc = ~crc;
+    }
+    return crc;
+}
+
+// Undo the Beaufort cipher on the letters of an encrypted entry name
+static std::string decipherName(const byte *raw, const uint32_t tocSeed, const uint32_t index)
+{
+    const uint32_t mtKey = mtGenrand(tocSeed + index);
+    const int key = ((mtKey >> 24) + (mtKey >> 16) + (mtKey >> 8) + mtKey) & 0xFF;
+
+    // The key advances with every character, letter or not
+    std::string name;
+    for (int i = 0; i < KIF_NAME_SIZE && raw[i] != 0; i++)
+    {
+        int c = raw[i];
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+        {
+            // Upper case letters are 0 to 25 and lower case 26 to 51
+            int idx = c <= 'Z' ? c - 'A' : c - 'a' + 26;
+            idx = (idx + key % 52 + i) % 52;
+            c = idx < 26 ? 'z' - idx : 'Z' + 26 - idx;
+        }
+        name += static_cast<char>(c);
+    }
+    return name;
+}
+
+// Add an archive and its entries to the builder, returns false if it cannot be read
+static bool scanArchive(const fs::path &path, const bool haveSeed, const uint32_t tocSeed, KifDbBuilder &builder)
+{
+    const auto head = readHead(path, 8);
+    if (head.size() < 8 || memcmp(head.data(), KIF_SIGNATURE, 4) != 0)
+    {
+        std::cerr << "Not a KIF archive: " << path.string() << std::endl;
+        return false;
+    }
+
+    // Only the entry table is read, archives can be several GB
+    const uint32_t count = readU32(head.data() + 4);
+    const auto buf = readHead(path, 8 + static_cast<size_t>(count) * KIF_ENTRY_SIZE);
+    if ((buf.size() - 8) / KIF_ENTRY_SIZE < count)
+    {
+        std::cerr << "Truncated entry table: " << path.string() << std::endl;
+        return false;
+    }
+
+    const byte *table = buf.data() + 8;
+    const uint32_t archiveIdx = builder.getArchiveCount();
+
+    // The key entry comes first in encrypted archives
+    const bool encrypted = count > 0 && strncmp(reinterpret_cast<const char *>(table), KIF_KEY_FILENAME, KIF_NAME_SIZE) == 0;
+    byte fileKey[4] = {};
+    Blowfish bf;
+
+    if (encrypted)
+    {
+        if (!haveSeed)
+        {
+            std::cerr << "--vcode2 is required to read encrypted archive " << path.filename().string() << std::endl;
+            return false;
+        }
+
+        const uint32_t key = mtGenrand(readU32(table + KIF_NAME_SIZE + 4));
+        memcpy(fileKey, &key, 4);
+        bf.SetKey(fileKey, 4);
+    }
+
+    builder.addArchive(path.filename().string(), encrypted, fileKey);
+
+    for (uint32_t i = encrypted ? 1 : 0; i < count; i++)
+    {
+        const byte *raw = table + i * KIF_ENTRY_SIZE;
+
+        std::string name;
+        byte meta[8];
+        memcpy(meta, raw + KIF_NAME_SIZE, 8);
+
+        if (encrypted)
+        {
+            name = decipherName(raw, tocSeed, i);
+
+            // Offset and length are encrypted as one block after adding the entry index
+            uint64_t block;
+            memcpy(&block, meta, 8);
+            block += i;
+            memcpy(meta, &block, 8);
+            bf.Decrypt(meta, meta, 8);
+        }
+        else
+            name.assign(reinterpret_cast<const char *>(raw), strnlen(reinterpret_cast<const char *>(raw), KIF_NAME_SIZE));
+
+        lowercase(name);
+        builder.addEntry(name, readU32(meta), readU32(meta + 4), archiveIdx);
+    }
+
+    std::cout << "Read " << (encrypted ? count - 1 : count) << " entries from " << path.filename().string() << std::endl;
+    return true;
+}
+
+static int build(const fs::path &gameDir, fs::path out, const std::string &vcode2)
+{
+    std::vector<fs::path> archives;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(gameDir, ec))
+    {
+        if (entry.is_regular_file() && entry.path().extension() == ".int")
+            archives.push_back(entry.path());
+    }
+
+    if (archives.empty())
+    {
+        std::cerr << "No archives in " << gameDir.string() << std::endl;
+        return 1;
+    }
+
+    // Sorted so the same archives always give the same DB
+    std::sort(archives.begin(), archives.end());
+
+    KifDbBuilder builder;
+    for (const auto &path : archives)
+    {
+        if (!scanArchive(path, !vcode2.empty(), vcodeSeed(vcode2), builder))
+            return 1;
+    }
+
+    if (out.empty())
+        out = gameDir / KIFDB_DEFAULT_NAME;
+    else if (fs::is_directory(out))
+        out /= KIFDB_DEFAULT_NAME;
+
+    if (!writeAll(out, builder.build()))
+    {
+        std::cerr << "Could not write " << out.string() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Wrote " << builder.getEntryCount() << " entries from " << builder.getArchiveCount() << " archives to " << out.string() << std::endl;
+    if (builder.getDuplicates() > 0)
+        std::cout << builder.getDuplicates() << " entries replaced an earlier one of the same name" << std::endl;
+
+    return 0;
+}
+
+static int convert(const fs::path &in, const fs::path &out)
+{
+    const auto buf = readAll(in);
+
+    KifDbBuilder builder;
+    if (buf.empty() || !readKifDbV1(buf.data(), buf.size(), true, builder))
+    {
+        std::cerr << "Not a v1 KIF DB: " << in.string() << std::endl;
+        return 1;
+    }
+
+    if (!writeAll(out, builder.build()))
+    {
+        std::cerr << "Could not write " << out.string() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Converted " << builder.getEntryCount() << " entries from " << builder.getArchiveCount() << " archives to " << out.string() << std::endl;
+    return 0;
+}
+
+// Check every entry lies within its archive and that encrypted archives still have the stored key
+static int validate(const fs::path &path, fs::path archiveDir)
+{
+    const auto buf = readAll(path);
+
+    std::vector<byte> storage;
+    KifDbView db;
+    if (buf.empty() || !loadKifDb(buf.data(), buf.size(), true, storage, db))
+    {
+        std::cerr << "Not a KIF DB: " << path.string() << std::endl;
+        return 1;
+    }
+
+    std::cout << (buf.size() >= 4 && memcmp(buf.data(), KIFDB_SIGNATURE, 4) == 0 ? "v2" : "v1") << " DB with "
+              << db.getEntryCount() << " entries in " << db.getArchiveCount() << " archives" << std::endl;
+
+    if (archiveDir.empty())
+        archiveDir = path.parent_path();
+
+    size_t problems = 0;
+    std::vector<uint64_t> sizes(db.getArchiveCount());
+
+    for (uint32_t i = 0; i < db.getArchiveCount(); i++)
+    {
+        const auto &archive = db.getArchive(i);
+        const fs::path archivePath = archiveDir / std::string(db.getName(archive));
+
+        std::error_code ec;
+        sizes[i] = fs::file_size(archivePath, ec);
+        if (ec)
+        {
+            std::cerr << "Missing archive " << archivePath.string() << std::endl;
+            sizes[i] = 0;
+            problems++;
+            continue;
+        }
+
+        if (archive.IsEncrypted != 1)
+            continue;
+
+        const auto header = readHead(archivePath, 8 + KIF_ENTRY_SIZE);
+        const byte *keyEntry = header.data() + 8;
+        if (header.size() < 8 + KIF_ENTRY_SIZE || strncmp(reinterpret_cast<const char *>(keyEntry), KIF_KEY_FILENAME, KIF_NAME_SIZE) != 0)
+        {
+            std::cerr << "No key entry in encrypted archive " << archivePath.string() << std::endl;
+            problems++;
+            continue;
+        }
+
+        const uint32_t key = mtGenrand(readU32(keyEntry + KIF_NAME_SIZE + 4));
+        if (memcmp(&key, archive.FileKey, 4) != 0)
+        {
+            std::cerr << "Stored key does not match " << archivePath.string() << std::endl;
+            problems++;
+        }
+    }
+
+    uint32_t previousHash = 0;
+    for (uint32_t i = 0; i < db.getEntryCount(); i++)
+    {
+        const auto &record = db.getRecord(i);
+        const auto name = db.getName(record);
+
+        if (name.empty() || record.Hash != kifDbHash(name) || record.Hash < previousHash)
+        {
+            std::cerr << "Corrupt entry " << i << std::endl;
+            problems++;
+            continue;
+        }
+        previousHash = record.Hash;
+
+        if (record.Index >= db.getArchiveCount())
+        {
+            std::cerr << name << " is in archive " << record.Index << " which does not exist" << std::endl;
+            problems++;
+        }
+        else if (sizes[record.Index] > 0 && static_cast<uint64_t>(record.Offset) + record.Length > sizes[record.Index])
+        {
+            std::cerr << name << " extends past the end of " << db.getName(db.getArchive(record.Index)) << std::endl;
+            problems++;
+        }
+        else if (db.find(name) != &record)
+        {
+            std::cerr << name << " cannot be looked up" << std::endl;
+            problems++;
+        }
+    }
+
+    if (problems > 0)
+    {
+        std::cerr << problems << " problems found" << std::endl;
+        return 1;
+    }
+
+    std::cout << "OK" << std::endl;
+    return 0;
+}
+
+static int usage()
+{
+    std::cerr << "Usage:" << std::endl
+              << "  kifdb build <game dir> [out] [--vcode2 code]" << std::endl
+              << "  kifdb convert <v1 db> <out>" << std::endl
+              << "  kifdb validate <db> [archive dir]" << std::endl;
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> args;
+    std::string vcode2;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--vcode2" && i + 1 < argc)
+            vcode2 = argv[++i];
+        else
+            args.push_back(arg);
+    }
+
+    if (args.size() < 2)
+        return usage();
+
+    const std::string &command = args[0];
+    const fs::path second = args.size() > 2 ? args[2] : "";
+
+    if (command == "build")
+        return build(args[1], second, vcode2);
+
+    if (command == "convert" && args.size() == 3)
+        return convert(args[1], second);
+
+    if (command == "validate")
+        return validate(args[1], second);
+
+    return usage();
+}